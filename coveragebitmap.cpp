@@ -0,0 +1,385 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <string.h>
+#include <algorithm>
+#include "common.h"
+#include "coveragebitmap.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// the loops below are over a fixed number of words
+// so that the compiler can vectorize them
+
+static inline bool BlockOr(CoverageBlock &a, const CoverageBlock &b) {
+  uint64_t changed = 0;
+  for (int i = 0; i < COVERAGE_BLOCK_WORDS; i++) {
+    changed |= b.words[i] & ~a.words[i];
+    a.words[i] |= b.words[i];
+  }
+  return changed != 0;
+}
+
+static inline bool BlockAnd(const CoverageBlock &a, const CoverageBlock &b, CoverageBlock &result) {
+  uint64_t any = 0;
+  for (int i = 0; i < COVERAGE_BLOCK_WORDS; i++) {
+    result.words[i] = a.words[i] & b.words[i];
+    any |= result.words[i];
+  }
+  return any != 0;
+}
+
+// result = b & ~a
+static inline bool BlockAndNot(const CoverageBlock &a, const CoverageBlock &b, CoverageBlock &result) {
+  uint64_t any = 0;
+  for (int i = 0; i < COVERAGE_BLOCK_WORDS; i++) {
+    result.words[i] = b.words[i] & ~a.words[i];
+    any |= result.words[i];
+  }
+  return any != 0;
+}
+
+int ModuleCoverageBitmap::CountTrailingZeros(uint64_t word) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, word);
+  return (int)index;
+#else
+  return __builtin_ctzll(word);
+#endif
+}
+
+int ModuleCoverageBitmap::PopCount(uint64_t word) {
+#if defined(_MSC_VER)
+  return (int)__popcnt64(word);
+#else
+  return __builtin_popcountll(word);
+#endif
+}
+
+bool ModuleCoverageBitmap::Insert(uint64_t offset) {
+  uint64_t index = offset / COVERAGE_BLOCK_BITS;
+  size_t bit = offset % COVERAGE_BLOCK_BITS;
+  uint64_t mask = 1ULL << (bit % 64);
+
+  size_t pos;
+  // offsets usually come in ascending order
+  if (block_indices.empty() || (block_indices.back() < index)) {
+    pos = block_indices.size();
+  } else {
+    pos = std::lower_bound(block_indices.begin(), block_indices.end(), index) - block_indices.begin();
+  }
+
+  if ((pos < block_indices.size()) && (block_indices[pos] == index)) {
+    uint64_t &word = blocks[pos].words[bit / 64];
+    if (word & mask) return false;
+    word |= mask;
+    return true;
+  }
+
+  CoverageBlock block;
+  memset(&block, 0, sizeof(block));
+  block.words[bit / 64] = mask;
+  block_indices.insert(block_indices.begin() + pos, index);
+  blocks.insert(blocks.begin() + pos, block);
+  return true;
+}
+
+bool ModuleCoverageBitmap::Contains(uint64_t offset) const {
+  uint64_t index = offset / COVERAGE_BLOCK_BITS;
+  size_t bit = offset % COVERAGE_BLOCK_BITS;
+  auto iter = std::lower_bound(block_indices.begin(), block_indices.end(), index);
+  if ((iter == block_indices.end()) || (*iter != index)) return false;
+  const CoverageBlock &block = blocks[iter - block_indices.begin()];
+  return (block.words[bit / 64] & (1ULL << (bit % 64))) != 0;
+}
+
+size_t ModuleCoverageBitmap::Count() const {
+  size_t count = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    for (int w = 0; w < COVERAGE_BLOCK_WORDS; w++) {
+      count += PopCount(blocks[i].words[w]);
+    }
+  }
+  return count;
+}
+
+ModuleCoverageBitmap *GetModuleCoverage(CoverageBitmap &coverage, const std::string &name) {
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->module_name == name) return &(*iter);
+  }
+  return NULL;
+}
+
+void CoverageToBitmap(Coverage &coverage, CoverageBitmap &result) {
+  result.clear();
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->offsets.empty()) continue;
+    ModuleCoverageBitmap *module_bitmap = GetModuleCoverage(result, iter->module_name);
+    if (!module_bitmap) {
+      result.push_back(ModuleCoverageBitmap(iter->module_name));
+      module_bitmap = &result.back();
+    }
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      module_bitmap->Insert(*iter2);
+    }
+  }
+}
+
+void BitmapToCoverage(CoverageBitmap &coverage, Coverage &result) {
+  result.clear();
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    result.push_back({ iter->module_name, {} });
+    std::set<uint64_t> &offsets = result.back().offsets;
+    iter->ForEach([&offsets](uint64_t offset) {
+      offsets.insert(offsets.end(), offset);
+    });
+  }
+}
+
+static void MergeModule(ModuleCoverageBitmap &module, const ModuleCoverageBitmap &toAdd) {
+  // fast path, all blocks already present
+  size_t i = 0, j = 0;
+  bool all_present = true;
+  while (j < toAdd.block_indices.size()) {
+    while ((i < module.block_indices.size()) && (module.block_indices[i] < toAdd.block_indices[j])) i++;
+    if ((i == module.block_indices.size()) || (module.block_indices[i] != toAdd.block_indices[j])) {
+      all_present = false;
+      break;
+    }
+    BlockOr(module.blocks[i], toAdd.blocks[j]);
+    j++;
+  }
+  if (all_present) return;
+
+  std::vector<uint64_t> new_indices;
+  std::vector<CoverageBlock> new_blocks;
+  new_indices.reserve(module.block_indices.size() + toAdd.block_indices.size());
+  new_blocks.reserve(module.block_indices.size() + toAdd.block_indices.size());
+  i = 0; j = 0;
+  while ((i < module.block_indices.size()) || (j < toAdd.block_indices.size())) {
+    if ((j == toAdd.block_indices.size()) ||
+        ((i < module.block_indices.size()) && (module.block_indices[i] < toAdd.block_indices[j])))
+    {
+      new_indices.push_back(module.block_indices[i]);
+      new_blocks.push_back(module.blocks[i]);
+      i++;
+    } else if ((i == module.block_indices.size()) ||
+               (toAdd.block_indices[j] < module.block_indices[i]))
+    {
+      new_indices.push_back(toAdd.block_indices[j]);
+      new_blocks.push_back(toAdd.blocks[j]);
+      j++;
+    } else {
+      new_indices.push_back(module.block_indices[i]);
+      new_blocks.push_back(module.blocks[i]);
+      BlockOr(new_blocks.back(), toAdd.blocks[j]);
+      i++; j++;
+    }
+  }
+  module.block_indices.swap(new_indices);
+  module.blocks.swap(new_blocks);
+}
+
+void MergeCoverage(CoverageBitmap &coverage, CoverageBitmap &toAdd) {
+  for (auto iter = toAdd.begin(); iter != toAdd.end(); iter++) {
+    ModuleCoverageBitmap *module = GetModuleCoverage(coverage, iter->module_name);
+    if (module) {
+      MergeModule(*module, *iter);
+    } else if (!iter->Empty()) {
+      coverage.push_back(*iter);
+    }
+  }
+}
+
+void CoverageIntersection(CoverageBitmap &coverage1, CoverageBitmap &coverage2, CoverageBitmap &result) {
+  result.clear();
+  for (auto iter = coverage1.begin(); iter != coverage1.end(); iter++) {
+    ModuleCoverageBitmap *module2 = GetModuleCoverage(coverage2, iter->module_name);
+    if (!module2) continue;
+
+    ModuleCoverageBitmap module_result(iter->module_name);
+    CoverageBlock block;
+    size_t i = 0, j = 0;
+    while ((i < iter->block_indices.size()) && (j < module2->block_indices.size())) {
+      if (iter->block_indices[i] < module2->block_indices[j]) {
+        i++;
+      } else if (module2->block_indices[j] < iter->block_indices[i]) {
+        j++;
+      } else {
+        if (BlockAnd(iter->blocks[i], module2->blocks[j], block)) {
+          module_result.block_indices.push_back(iter->block_indices[i]);
+          module_result.blocks.push_back(block);
+        }
+        i++; j++;
+      }
+    }
+
+    if (!module_result.Empty()) result.push_back(module_result);
+  }
+}
+
+void CoverageDifference(CoverageBitmap &coverage1, CoverageBitmap &coverage2, CoverageBitmap &result) {
+  result.clear();
+  for (auto iter = coverage2.begin(); iter != coverage2.end(); iter++) {
+    ModuleCoverageBitmap *module1 = GetModuleCoverage(coverage1, iter->module_name);
+    if (!module1) {
+      if (!iter->Empty()) result.push_back(*iter);
+      continue;
+    }
+
+    ModuleCoverageBitmap module_result(iter->module_name);
+    CoverageBlock block;
+    size_t i = 0, j = 0;
+    while (j < iter->block_indices.size()) {
+      while ((i < module1->block_indices.size()) && (module1->block_indices[i] < iter->block_indices[j])) i++;
+      if ((i < module1->block_indices.size()) && (module1->block_indices[i] == iter->block_indices[j])) {
+        if (BlockAndNot(module1->blocks[i], iter->blocks[j], block)) {
+          module_result.block_indices.push_back(iter->block_indices[j]);
+          module_result.blocks.push_back(block);
+        }
+      } else {
+        module_result.block_indices.push_back(iter->block_indices[j]);
+        module_result.blocks.push_back(iter->blocks[j]);
+      }
+      j++;
+    }
+
+    if (!module_result.Empty()) result.push_back(module_result);
+  }
+}
+
+bool CoverageContains(CoverageBitmap &coverage1, CoverageBitmap &coverage2) {
+  for (auto iter = coverage2.begin(); iter != coverage2.end(); iter++) {
+    if (iter->Empty()) continue;
+    ModuleCoverageBitmap *module1 = GetModuleCoverage(coverage1, iter->module_name);
+    if (!module1) return false;
+
+    size_t i = 0;
+    for (size_t j = 0; j < iter->block_indices.size(); j++) {
+      while ((i < module1->block_indices.size()) && (module1->block_indices[i] < iter->block_indices[j])) i++;
+      if ((i == module1->block_indices.size()) || (module1->block_indices[i] != iter->block_indices[j])) {
+        return false;
+      }
+      CoverageBlock block;
+      if (BlockAndNot(module1->blocks[i], iter->blocks[j], block)) return false;
+    }
+  }
+  return true;
+}
+
+bool CoverageContains(CoverageBitmap &coverage, const std::string &module_name, uint64_t offset) {
+  ModuleCoverageBitmap *module = GetModuleCoverage(coverage, module_name);
+  if (!module) return false;
+  return module->Contains(offset);
+}
+
+size_t CoverageCount(CoverageBitmap &coverage) {
+  size_t count = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    count += iter->Count();
+  }
+  return count;
+}
+
+void WriteCoverageBinary(CoverageBitmap &coverage, FILE *fp) {
+  uint64_t num_modules = coverage.size();
+  fwrite(&num_modules, sizeof(num_modules), 1, fp);
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    uint64_t name_size = iter->module_name.size();
+    fwrite(&name_size, sizeof(name_size), 1, fp);
+    fwrite(iter->module_name.data(), 1, name_size, fp);
+    uint64_t num_blocks = iter->blocks.size();
+    fwrite(&num_blocks, sizeof(num_blocks), 1, fp);
+    if (!num_blocks) continue;
+    fwrite(&iter->block_indices[0], sizeof(uint64_t), num_blocks, fp);
+    fwrite(&iter->blocks[0], sizeof(CoverageBlock), num_blocks, fp);
+  }
+}
+
+void ReadCoverageBinary(CoverageBitmap &coverage, FILE *fp) {
+  coverage.clear();
+  uint64_t num_modules;
+  if (fread(&num_modules, sizeof(num_modules), 1, fp) != 1) return;
+  for (uint64_t m = 0; m < num_modules; m++) {
+    uint64_t name_size;
+    if (fread(&name_size, sizeof(name_size), 1, fp) != 1) FATAL("Error reading coverage");
+    std::string name(name_size, '\0');
+    if (name_size && (fread(&name[0], 1, name_size, fp) != name_size)) FATAL("Error reading coverage");
+    ModuleCoverageBitmap module(name);
+    uint64_t num_blocks;
+    if (fread(&num_blocks, sizeof(num_blocks), 1, fp) != 1) FATAL("Error reading coverage");
+    module.block_indices.resize(num_blocks);
+    module.blocks.resize(num_blocks);
+    if (num_blocks) {
+      if (fread(&module.block_indices[0], sizeof(uint64_t), num_blocks, fp) != num_blocks) FATAL("Error reading coverage");
+      if (fread(&module.blocks[0], sizeof(CoverageBlock), num_blocks, fp) != num_blocks) FATAL("Error reading coverage");
+    }
+    if (!module.Empty()) coverage.push_back(module);
+  }
+}
+
+void WriteCoverageBinary(CoverageBitmap &coverage, std::string &out) {
+  uint64_t num_modules = coverage.size();
+  out.append((char *)&num_modules, sizeof(num_modules));
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    uint64_t name_size = iter->module_name.size();
+    out.append((char *)&name_size, sizeof(name_size));
+    out.append(iter->module_name);
+    uint64_t num_blocks = iter->blocks.size();
+    out.append((char *)&num_blocks, sizeof(num_blocks));
+    if (!num_blocks) continue;
+    out.append((char *)&iter->block_indices[0], sizeof(uint64_t) * num_blocks);
+    out.append((char *)&iter->blocks[0], sizeof(CoverageBlock) * num_blocks);
+  }
+}
+
+bool ReadCoverageBinary(CoverageBitmap &coverage, const char *data, size_t size) {
+  coverage.clear();
+  size_t pos = 0;
+
+  auto read = [&](void *dst, size_t n) {
+    if (size - pos < n) return false;
+    memcpy(dst, data + pos, n);
+    pos += n;
+    return true;
+  };
+
+  uint64_t num_modules;
+  if (!read(&num_modules, sizeof(num_modules))) return false;
+  for (uint64_t m = 0; m < num_modules; m++) {
+    uint64_t name_size;
+    if (!read(&name_size, sizeof(name_size))) return false;
+    if (size - pos < name_size) return false;
+    ModuleCoverageBitmap module(std::string(data + pos, name_size));
+    pos += name_size;
+    uint64_t num_blocks;
+    if (!read(&num_blocks, sizeof(num_blocks))) return false;
+    if ((size - pos) / (sizeof(uint64_t) + sizeof(CoverageBlock)) < num_blocks) return false;
+    module.block_indices.resize(num_blocks);
+    module.blocks.resize(num_blocks);
+    if (num_blocks) {
+      read(&module.block_indices[0], sizeof(uint64_t) * num_blocks);
+      read(&module.blocks[0], sizeof(CoverageBlock) * num_blocks);
+    }
+    if (!module.Empty()) coverage.push_back(module);
+  }
+  return true;
+}
@@ -0,0 +1,101 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include "coverage.h"
+
+// Dense alternative to Coverage (list of std::set<uint64_t>).
+// Offsets of each module are stored as a sorted list of 512-bit
+// blocks (one cache line each) keyed by offset / 512, so coverage
+// that is clustered in code costs a few bits per offset and set
+// operations work on whole words at a time.
+
+#define COVERAGE_BLOCK_WORDS 8
+#define COVERAGE_BLOCK_BITS (COVERAGE_BLOCK_WORDS * 64)
+
+struct alignas(64) CoverageBlock {
+  uint64_t words[COVERAGE_BLOCK_WORDS];
+};
+
+class ModuleCoverageBitmap {
+public:
+  ModuleCoverageBitmap() { }
+  ModuleCoverageBitmap(const std::string &name) : module_name(name) { }
+
+  // returns true if the offset wasn't already present
+  bool Insert(uint64_t offset);
+  bool Contains(uint64_t offset) const;
+  size_t Count() const;
+  bool Empty() const { return block_indices.empty(); }
+
+  // calls callback(offset) for every offset in ascending order
+  template<class F> void ForEach(F callback) const {
+    for (size_t i = 0; i < blocks.size(); i++) {
+      uint64_t base = block_indices[i] * COVERAGE_BLOCK_BITS;
+      for (int w = 0; w < COVERAGE_BLOCK_WORDS; w++) {
+        uint64_t word = blocks[i].words[w];
+        while (word) {
+          int bit = CountTrailingZeros(word);
+          callback(base + w * 64 + bit);
+          word &= word - 1;
+        }
+      }
+    }
+  }
+
+  static int CountTrailingZeros(uint64_t word);
+  static int PopCount(uint64_t word);
+
+  std::string module_name;
+  // sorted, blocks[i] holds offsets
+  // [block_indices[i] * COVERAGE_BLOCK_BITS, (block_indices[i] + 1) * COVERAGE_BLOCK_BITS)
+  // blocks that would be all zero are never stored
+  std::vector<uint64_t> block_indices;
+  std::vector<CoverageBlock> blocks;
+};
+
+// modules that would be empty are never stored
+typedef std::vector<ModuleCoverageBitmap> CoverageBitmap;
+
+ModuleCoverageBitmap *GetModuleCoverage(CoverageBitmap &coverage, const std::string &name);
+
+// conversion to and from the instrumentation's Coverage
+void CoverageToBitmap(Coverage &coverage, CoverageBitmap &result);
+void BitmapToCoverage(CoverageBitmap &coverage, Coverage &result);
+
+// same semantics as the Coverage versions in coverage.h
+void MergeCoverage(CoverageBitmap &coverage, CoverageBitmap &toAdd);
+void CoverageIntersection(CoverageBitmap &coverage1, CoverageBitmap &coverage2, CoverageBitmap &result);
+// returns coverage2 - coverage1
+void CoverageDifference(CoverageBitmap &coverage1, CoverageBitmap &coverage2, CoverageBitmap &result);
+// returns true if coverage1 contains all of coverage2
+bool CoverageContains(CoverageBitmap &coverage1, CoverageBitmap &coverage2);
+bool CoverageContains(CoverageBitmap &coverage, const std::string &module_name, uint64_t offset);
+
+size_t CoverageCount(CoverageBitmap &coverage);
+
+void WriteCoverageBinary(CoverageBitmap &coverage, FILE *fp);
+void ReadCoverageBinary(CoverageBitmap &coverage, FILE *fp);
+
+// same format, appended to / read from memory,
+// reading returns false if the data is malformed
+void WriteCoverageBinary(CoverageBitmap &coverage, std::string &out);
+bool ReadCoverageBinary(CoverageBitmap &coverage, const char *data, size_t size);
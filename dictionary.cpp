@@ -0,0 +1,206 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include "common.h"
+#include "dictionary.h"
+
+bool Dictionary::AddToken(const char *data, size_t size) {
+  if (!size || (size > DICT_MAX_TOKEN_SIZE)) return false;
+  std::string key(data, size);
+  if (token_index.find(key) != token_index.end()) return false;
+  token_index[key] = tokens.size();
+  tokens.emplace_back();
+  tokens.back().Init(data, size);
+  return true;
+}
+
+static int HexValue(char c) {
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return -1;
+}
+
+// parses one line of a dictionary file into value,
+// returns false if the line is malformed
+static bool ParseDictionaryLine(const char *line, const char *end, std::string &value) {
+  const char *p = line;
+  // optional name and level
+  while ((p < end) && (isalnum((unsigned char)*p) || (*p == '_') || (*p == '@'))) p++;
+  while ((p < end) && isspace((unsigned char)*p)) p++;
+  if ((p > line) && (p < end) && (*p == '=')) {
+    p++;
+    while ((p < end) && isspace((unsigned char)*p)) p++;
+  }
+  if ((p >= end) || (*p != '"')) return false;
+  p++;
+
+  // the closing quote is the last non-space character
+  const char *value_end = end;
+  while ((value_end > p) && isspace((unsigned char)value_end[-1])) value_end--;
+  if ((value_end <= p) || (value_end[-1] != '"')) return false;
+  value_end--;
+
+  value.clear();
+  while (p < value_end) {
+    if (*p != '\\') {
+      if (*p == '"') return false;
+      value.push_back(*p++);
+      continue;
+    }
+    p++;
+    if (p >= value_end) return false;
+    if ((*p == '\\') || (*p == '"')) {
+      value.push_back(*p++);
+    } else if (*p == 'x') {
+      if ((value_end - p) < 3) return false;
+      int hi = HexValue(p[1]);
+      int lo = HexValue(p[2]);
+      if ((hi < 0) || (lo < 0)) return false;
+      value.push_back((char)(hi * 16 + lo));
+      p += 3;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t Dictionary::LoadFile(const char *filename) {
+  Sample file;
+  if (!file.Load(filename)) {
+    FATAL("Error reading dictionary %s", filename);
+  }
+
+  size_t num_added = 0;
+  std::string value;
+  const char *p = file.bytes;
+  const char *file_end = file.bytes + file.size;
+  int line_number = 0;
+  while (p < file_end) {
+    const char *line_end = (const char *)memchr(p, '\n', file_end - p);
+    if (!line_end) line_end = file_end;
+    line_number++;
+
+    const char *line = p;
+    p = line_end + 1;
+
+    while ((line < line_end) && isspace((unsigned char)*line)) line++;
+    if ((line == line_end) || (*line == '#')) continue;
+
+    if (!ParseDictionaryLine(line, line_end, value)) {
+      FATAL("Error parsing dictionary %s, line %d", filename, line_number);
+    }
+    if (value.size() > DICT_MAX_TOKEN_SIZE) {
+      WARN("Dictionary %s, line %d: token larger than %d bytes, skipping", filename, line_number, DICT_MAX_TOKEN_SIZE);
+      continue;
+    }
+    if (AddToken(value.data(), value.size())) num_added++;
+  }
+
+  return num_added;
+}
+
+static bool IsTokenChar(char c) {
+  return isalnum((unsigned char)c) || (c == '_');
+}
+
+// counts the printable run [start, end) and the identifiers in it
+static void CountPrintableRun(const char *start, const char *end, std::unordered_map<std::string, uint64_t> &counts) {
+  size_t size = end - start;
+  if ((size >= DICT_MIN_AUTO_TOKEN_SIZE) && (size <= DICT_MAX_AUTO_TOKEN_SIZE)) {
+    counts[std::string(start, size)]++;
+  }
+
+  const char *p = start;
+  while (p < end) {
+    if (!IsTokenChar(*p)) {
+      p++;
+      continue;
+    }
+    const char *word = p;
+    while ((p < end) && IsTokenChar(*p)) p++;
+    size_t word_size = p - word;
+    // the whole run was counted above
+    if (word_size == size) continue;
+    if ((word_size >= DICT_MIN_AUTO_TOKEN_SIZE) && (word_size <= DICT_MAX_AUTO_TOKEN_SIZE)) {
+      counts[std::string(word, word_size)]++;
+    }
+  }
+}
+
+size_t Dictionary::ExtractTokens(std::vector<Sample *> &samples) {
+  std::unordered_map<std::string, uint64_t> counts;
+  std::unordered_map<std::string, uint64_t> ngram_counts;
+
+  for (Sample *sample : samples) {
+    const char *bytes = sample->bytes;
+    size_t size = sample->size;
+
+    // printable runs
+    size_t i = 0;
+    while (i < size) {
+      if (!isgraph((unsigned char)bytes[i])) {
+        i++;
+        continue;
+      }
+      size_t start = i;
+      while ((i < size) && isgraph((unsigned char)bytes[i])) i++;
+      CountPrintableRun(bytes + start, bytes + i, counts);
+    }
+
+    // n-grams that aren't text or a single repeated byte,
+    // which the printable runs and other mutators cover
+    size_t scan_size = size;
+    if (scan_size > DICT_NGRAM_SCAN_SIZE) scan_size = DICT_NGRAM_SCAN_SIZE;
+    for (size_t pos = 0; pos + DICT_NGRAM_SIZE <= scan_size; pos++) {
+      const char *ngram = bytes + pos;
+      bool printable = true;
+      bool uniform = true;
+      for (size_t j = 0; j < DICT_NGRAM_SIZE; j++) {
+        if (!isprint((unsigned char)ngram[j])) printable = false;
+        if (ngram[j] != ngram[0]) uniform = false;
+      }
+      if (printable || uniform) continue;
+      ngram_counts[std::string(ngram, DICT_NGRAM_SIZE)]++;
+    }
+  }
+
+  for (auto &iter : ngram_counts) {
+    if (iter.second < DICT_MIN_NGRAM_COUNT) continue;
+    counts[iter.first] += iter.second;
+  }
+
+  // most frequent first, ties broken by value so
+  // the result doesn't depend on hash order
+  std::vector<std::pair<std::string, uint64_t>> candidates(counts.begin(), counts.end());
+  std::sort(candidates.begin(), candidates.end(),
+    [](const std::pair<std::string, uint64_t> &a, const std::pair<std::string, uint64_t> &b) {
+      if (a.second != b.second) return a.second > b.second;
+      return a.first < b.first;
+    });
+
+  size_t num_added = 0;
+  for (auto &candidate : candidates) {
+    if (num_added >= DICT_MAX_AUTO_TOKENS) break;
+    if (AddToken(candidate.first.data(), candidate.first.size())) num_added++;
+  }
+
+  return num_added;
+}
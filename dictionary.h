@@ -0,0 +1,71 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "sample.h"
+
+// longest token accepted from a dictionary file
+#define DICT_MAX_TOKEN_SIZE 128
+
+// tokens extracted from the corpus
+#define DICT_MIN_AUTO_TOKEN_SIZE 3
+#define DICT_MAX_AUTO_TOKEN_SIZE 32
+#define DICT_MAX_AUTO_TOKENS 256
+// only the start of each sample is scanned for n-grams
+#define DICT_NGRAM_SCAN_SIZE 4096
+#define DICT_NGRAM_SIZE 4
+// how often an n-gram has to occur to become a token
+#define DICT_MIN_NGRAM_COUNT 2
+
+// A set of unique tokens for the dictionary mutator. Tokens come
+// from AFL/libFuzzer-format dictionary files and from the corpus.
+// It is filled before the fuzzing threads start and only read
+// afterwards, so it can be shared between threads.
+class Dictionary {
+public:
+  // returns false if the token is empty, too large or already known
+  bool AddToken(const char *data, size_t size);
+
+  // Reads a dictionary file, one token per line:
+  //
+  //   # comment
+  //   name="value"
+  //   name@level="value"
+  //   "value"
+  //
+  // In values, \\, \" and \xNN are escapes. Names and levels
+  // are ignored. Returns the number of new tokens.
+  size_t LoadFile(const char *filename);
+
+  // Extracts tokens from the samples: runs of printable characters
+  // (and the identifiers in them), and DICT_NGRAM_SIZE-byte sequences
+  // that occur at least DICT_MIN_NGRAM_COUNT times. At most
+  // DICT_MAX_AUTO_TOKENS are added, the most frequent first.
+  // Returns the number of new tokens.
+  size_t ExtractTokens(std::vector<Sample *> &samples);
+
+  size_t Size() const { return tokens.size(); }
+  const Sample &GetToken(size_t index) const { return tokens[index]; }
+
+protected:
+  std::vector<Sample> tokens;
+  // index of each token in tokens
+  std::unordered_map<std::string, size_t> token_index;
+};
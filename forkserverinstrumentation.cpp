@@ -0,0 +1,366 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <sstream>
+#include <vector>
+#include "common.h"
+#include "forkserverinstrumentation.h"
+#include "mutex.h"
+#include "profiler.h"
+
+extern char **environ;
+
+#define PERSISTENT_SIGNATURE "##SIG_AFL_PERSISTENT##"
+#define DEFERRED_SIGNATURE "##SIG_AFL_DEFER_FORKSRV##"
+
+// map entries hit by earlier crashes, shared by all instances
+// so that a crash gets the same name on every thread
+struct CrashEdges {
+  CrashEdges() {
+    memset(owners, 0, sizeof(owners));
+  }
+
+  Mutex mutex;
+  // for every map entry, 1 + the index (in hashes) of
+  // the first crash that hit it, 0 if no crash did
+  uint32_t owners[FORKSERVER_MAP_SIZE];
+  std::vector<uint64_t> hashes;
+};
+
+static CrashEdges &GetCrashEdges() {
+  static CrashEdges crash_edges;
+  return crash_edges;
+}
+
+// returns 1 on success, 0 on timeout and -1 if the other side is gone
+static int ReadWithTimeout(int fd, void *value, uint32_t timeout_ms) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  int ret;
+  do {
+    ret = poll(&pfd, 1, (timeout_ms > 0x7FFFFFFF) ? -1 : (int)timeout_ms);
+  } while ((ret < 0) && (errno == EINTR));
+
+  if (ret == 0) return 0;
+  if (ret < 0) return -1;
+  if (read(fd, value, 4) != 4) return -1;
+  return 1;
+}
+
+static bool FileContains(const char *filename, const char *signature) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return false;
+  fseek(fp, 0, SEEK_END);
+  size_t size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  std::vector<char> contents(size);
+  size_t num_read = fread(contents.data(), 1, size, fp);
+  fclose(fp);
+  return memmem(contents.data(), num_read, signature, strlen(signature)) != NULL;
+}
+
+ForkserverInstrumentation::ForkserverInstrumentation() :
+  persistent(false), deferred(false), debug(false), shm_id(-1),
+  trace_bits(NULL), coverage_mask(NULL), coverage_cleared(true),
+  input_fd(-1), server_pid(0), ctl_fd(-1), st_fd(-1),
+  child_killed(0), child_pid(0), crash_signal(0), crash_hash(0),
+  target_start_ns(0) { }
+
+ForkserverInstrumentation::~ForkserverInstrumentation() {
+  CleanTarget();
+  if (trace_bits) shmdt(trace_bits);
+  if (shm_id >= 0) shmctl(shm_id, IPC_RMID, NULL);
+  if (coverage_mask) free(coverage_mask);
+  if (input_fd >= 0) close(input_fd);
+}
+
+void ForkserverInstrumentation::Init(int argc, char **argv) {
+  char *target = GetTargetArgv(argc, argv)[0];
+
+  const char *name = strrchr(target, '/');
+  module_name = name ? name + 1 : target;
+
+  persistent = FileContains(target, PERSISTENT_SIGNATURE);
+  deferred = FileContains(target, DEFERRED_SIGNATURE);
+  debug = GetBinaryOption("-forkserver_debug", argc, argv, false);
+
+  shm_id = shmget(IPC_PRIVATE, FORKSERVER_MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  if (shm_id < 0) FATAL("Error creating shared memory");
+  trace_bits = (unsigned char *)shmat(shm_id, NULL, 0);
+  if (trace_bits == (void *)-1) FATAL("Error mapping shared memory");
+
+  coverage_mask = (unsigned char *)malloc(FORKSERVER_MAP_SIZE);
+  memset(coverage_mask, 0xFF, FORKSERVER_MAP_SIZE);
+  // the runtime sets entry 0 to signal that it is alive
+  coverage_mask[0] = 0;
+
+  // writing to a fork server that died shouldn't kill the fuzzer
+  signal(SIGPIPE, SIG_IGN);
+}
+
+void ForkserverInstrumentation::SetInputFile(const std::string &filename) {
+  OpenInputFile(&input_fd, filename);
+}
+
+void ForkserverInstrumentation::StartForkserver(int argc, char **argv, uint32_t init_timeout) {
+  int ctl_pipe[2], st_pipe[2];
+  if (pipe2(ctl_pipe, O_CLOEXEC) || pipe2(st_pipe, O_CLOEXEC)) FATAL("Error creating pipes");
+
+  // only async-signal-safe calls are allowed after forking
+  // a multithreaded process, prepare everything beforehand
+  std::vector<std::string> env;
+  bool has_asan_options = false;
+  for (char **var = environ; *var; var++) {
+    if (!strncmp(*var, "__AFL_", 6)) continue;
+    if (!strncmp(*var, "ASAN_OPTIONS=", 13)) has_asan_options = true;
+    env.push_back(*var);
+  }
+  env.push_back(std::string("__AFL_SHM_ID=") + std::to_string(shm_id));
+  if (persistent) env.push_back("__AFL_PERSISTENT=1");
+  if (deferred) env.push_back("__AFL_DEFER_FORKSRV=1");
+  // sanitizer reports have to end in a signal to be seen as crashes
+  if (!has_asan_options) env.push_back("ASAN_OPTIONS=abort_on_error=1:symbolize=0");
+  std::vector<char *> envp;
+  for (auto iter = env.begin(); iter != env.end(); iter++) {
+    envp.push_back((char *)iter->c_str());
+  }
+  envp.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) FATAL("Error creating the fork server process");
+
+  if (!pid) {
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (!debug) {
+      dup2(null_fd, 1);
+      dup2(null_fd, 2);
+    }
+    dup2((input_fd >= 0) ? input_fd : null_fd, 0);
+    dup2(ctl_pipe[0], FORKSERVER_CTL_FD);
+    dup2(st_pipe[1], FORKSERVER_ST_FD);
+    execve(argv[0], argv, envp.data());
+    _exit(127);
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+  server_pid = pid;
+  ctl_fd = ctl_pipe[1];
+  st_fd = st_pipe[0];
+  child_killed = 0;
+  child_pid = 0;
+
+  uint32_t hello;
+  if (ReadWithTimeout(st_fd, &hello, init_timeout) != 1) {
+    FATAL("Fork server handshake failed, is the target linked with a fork server runtime?");
+  }
+}
+
+// asks the server for a new child (or to resume a stopped one)
+bool ForkserverInstrumentation::StartChild(int *pid) {
+  if (write(ctl_fd, &child_killed, 4) != 4) return false;
+  child_killed = 0;
+  if (ReadWithTimeout(st_fd, pid, FORKSERVER_KILL_TIMEOUT) != 1) return false;
+  return *pid > 0;
+}
+
+RunResult ForkserverInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  target_start_ns = 0;
+  uint64_t start_ns = ProfileNow();
+  if (!server_pid) {
+    StartForkserver(argc, argv, init_timeout);
+    target_start_ns = ProfileNow() - start_ns;
+  }
+
+  memset(trace_bits, 0, FORKSERVER_MAP_SIZE);
+  coverage_cleared = false;
+  crash_signal = 0;
+  if (input_fd >= 0) lseek(input_fd, 0, SEEK_SET);
+
+  int pid;
+  if (!StartChild(&pid)) {
+    WARN("Fork server died, restarting");
+    CleanTarget();
+    start_ns = ProfileNow();
+    StartForkserver(argc, argv, init_timeout);
+    target_start_ns += ProfileNow() - start_ns;
+    if (!StartChild(&pid)) FATAL("Repeatedly failed to start the target through the fork server");
+  }
+  child_pid = pid;
+
+  int status;
+  int ret = ReadWithTimeout(st_fd, &status, timeout);
+  if (ret == 0) {
+    kill(child_pid, SIGKILL);
+    child_killed = 1;
+    // the server still reports the killed child
+    if (ReadWithTimeout(st_fd, &status, FORKSERVER_KILL_TIMEOUT) != 1) CleanTarget();
+    child_pid = 0;
+    return HANG;
+  }
+  if (ret < 0) {
+    WARN("Lost connection to the fork server");
+    CleanTarget();
+    return OTHER_ERROR;
+  }
+
+  // a persistent mode child waiting for the next iteration
+  if (WIFSTOPPED(status)) return OK;
+
+  child_pid = 0;
+  if (WIFSIGNALED(status)) {
+    crash_signal = WTERMSIG(status);
+    crash_hash = ClaimCrashEdges();
+    return CRASH;
+  }
+
+  return OK;
+}
+
+RunResult ForkserverInstrumentation::RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  // don't reuse a persistent child when reproducing crashes
+  if (persistent) CleanTarget();
+  RunResult ret = Run(argc, argv, init_timeout, timeout);
+  if (persistent) CleanTarget();
+  return ret;
+}
+
+void ForkserverInstrumentation::CleanTarget() {
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+  if (server_pid > 0) {
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+  }
+  if (ctl_fd >= 0) close(ctl_fd);
+  if (st_fd >= 0) close(st_fd);
+  server_pid = 0;
+  child_pid = 0;
+  ctl_fd = -1;
+  st_fd = -1;
+  child_killed = 0;
+}
+
+bool ForkserverInstrumentation::HasNewCoverage() {
+  if (coverage_cleared) return false;
+  uint64_t *bits = (uint64_t *)trace_bits;
+  uint64_t *mask = (uint64_t *)coverage_mask;
+  for (size_t i = 0; i < FORKSERVER_MAP_SIZE / sizeof(uint64_t); i++) {
+    if (bits[i] & mask[i]) return true;
+  }
+  return false;
+}
+
+void ForkserverInstrumentation::GetCoverage(Coverage &coverage, bool clear_coverage) {
+  if (!coverage_cleared) {
+    ModuleCoverage *module_coverage = NULL;
+    uint64_t *bits = (uint64_t *)trace_bits;
+    uint64_t *mask = (uint64_t *)coverage_mask;
+    for (size_t i = 0; i < FORKSERVER_MAP_SIZE / sizeof(uint64_t); i++) {
+      if (!(bits[i] & mask[i])) continue;
+      for (size_t j = i * sizeof(uint64_t); j < (i + 1) * sizeof(uint64_t); j++) {
+        if (!(trace_bits[j] & coverage_mask[j])) continue;
+        if (!module_coverage) {
+          module_coverage = GetModuleCoverage(coverage, module_name);
+          if (!module_coverage) {
+            coverage.push_back({ module_name, {} });
+            module_coverage = &coverage.back();
+          }
+        }
+        module_coverage->offsets.insert(j);
+      }
+    }
+  }
+
+  if (clear_coverage) ClearCoverage();
+}
+
+// the map is cleared before every run
+void ForkserverInstrumentation::ClearCoverage() {
+  coverage_cleared = true;
+}
+
+void ForkserverInstrumentation::IgnoreCoverage(Coverage &coverage) {
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->module_name != module_name) continue;
+    for (auto offset : iter->offsets) {
+      if (offset < FORKSERVER_MAP_SIZE) coverage_mask[offset] = 0;
+    }
+  }
+}
+
+// Like AFL, a crash is only new if it hits map entries no earlier
+// crash hit, the path leading to a known crash may vary. A new
+// crash is named after those entries and claims them. Other crashes
+// get the name of the latest crash that claimed one of their entries,
+// which makes reproducing a crash give the same name again.
+uint64_t ForkserverInstrumentation::ClaimCrashEdges() {
+  CrashEdges &crash_edges = GetCrashEdges();
+  crash_edges.mutex.Lock();
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  bool is_new = false;
+  uint32_t latest_owner = 0;
+  for (size_t i = 1; i < FORKSERVER_MAP_SIZE; i++) {
+    if (!trace_bits[i]) continue;
+    uint32_t owner = crash_edges.owners[i];
+    if (owner) {
+      if (owner > latest_owner) latest_owner = owner;
+      continue;
+    }
+    hash ^= i;
+    hash *= 0x100000001b3ULL;
+    is_new = true;
+  }
+
+  if (is_new) {
+    crash_edges.hashes.push_back(hash);
+    uint32_t owner = (uint32_t)crash_edges.hashes.size();
+    for (size_t i = 1; i < FORKSERVER_MAP_SIZE; i++) {
+      if (trace_bits[i] && !crash_edges.owners[i]) crash_edges.owners[i] = owner;
+    }
+  } else if (latest_owner) {
+    hash = crash_edges.hashes[latest_owner - 1];
+  }
+
+  crash_edges.mutex.Unlock();
+  return hash;
+}
+
+std::string ForkserverInstrumentation::GetCrashName() {
+  std::stringstream stream;
+  stream << GetSignalName(crash_signal) << "_";
+  stream << std::hex << (uint32_t)(crash_hash ^ (crash_hash >> 32));
+  return stream.str();
+}
+
+#endif
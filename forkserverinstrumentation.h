@@ -0,0 +1,102 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <sys/types.h>
+#include <string>
+#include "instrumentation.h"
+
+// Runs targets built with compile-time coverage instrumentation
+// through an AFL-style fork server: the target initializes once
+// (or up to the point where it calls __afl_manual_init for deferred
+// initialization), then forks a child for every execution, or keeps
+// a child running for several iterations in persistent mode
+// (__afl_persistent_loop). The target writes coverage into a shared
+// memory map, map indices are reported as offsets in a module named
+// after the target binary.
+//
+// Any target with an AFL-compatible runtime works, see
+// libFuzzer/afl/forkserver_rt.c for one to link together with
+// afl_driver.cpp and a trace-pc-guard instrumented harness.
+// Deferred and persistent mode are detected from the signatures
+// that afl_driver.cpp embeds in the binary.
+//
+// Samples are passed through the delivery's input file, which is
+// also the target's stdin when the command line has no @@.
+#define FORKSERVER_MAP_SIZE (1 << 16)
+#define FORKSERVER_CTL_FD 198
+#define FORKSERVER_ST_FD (FORKSERVER_CTL_FD + 1)
+// time to wait for the status of a child killed after a timeout
+#define FORKSERVER_KILL_TIMEOUT 1000
+
+class ForkserverInstrumentation : public Instrumentation {
+public:
+  ForkserverInstrumentation();
+  ~ForkserverInstrumentation();
+
+  void Init(int argc, char **argv) override;
+
+  RunResult Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+  RunResult RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+
+  void CleanTarget() override;
+
+  bool HasNewCoverage() override;
+  void GetCoverage(Coverage &coverage, bool clear_coverage) override;
+  void ClearCoverage() override;
+  void IgnoreCoverage(Coverage &coverage) override;
+
+  std::string GetCrashName() override;
+
+  uint64_t GetTargetStartTime() override { return target_start_ns; }
+
+  void SetInputFile(const std::string &filename) override;
+
+protected:
+  void StartForkserver(int argc, char **argv, uint32_t init_timeout);
+  bool StartChild(int *pid);
+  uint64_t ClaimCrashEdges();
+
+  std::string module_name;
+  bool persistent;
+  bool deferred;
+  bool debug;
+
+  int shm_id;
+  unsigned char *trace_bits;
+  // 0 for ignored map entries, 0xFF otherwise
+  unsigned char *coverage_mask;
+  bool coverage_cleared;
+
+  int input_fd;
+
+  pid_t server_pid;
+  int ctl_fd;
+  int st_fd;
+  // tells the server that the last (persistent) child was killed
+  uint32_t child_killed;
+  pid_t child_pid;
+
+  int crash_signal;
+  uint64_t crash_hash;
+
+  uint64_t target_start_ns;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Checks the fork server instrumentation against forkservertesttarget:
+// coverage of a trivial harness, ignored coverage, and crashes and
+// hangs ending the run but not the fork server.
+//
+// Usage: forkservertest <path to forkservertesttarget>
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "forkserverinstrumentation.h"
+
+#define TEST_TIMEOUT 1000
+#define TEST_HANG_TIMEOUT 200
+
+static std::string input_file;
+static char *target_argv[2];
+
+static RunResult RunSample(ForkserverInstrumentation *instrumentation, const char *input, uint32_t timeout) {
+  FILE *fp = fopen(input_file.c_str(), "wb");
+  if (!fp) FATAL("Error opening %s", input_file.c_str());
+  fwrite(input, 1, strlen(input), fp);
+  fclose(fp);
+  return instrumentation->Run(1, target_argv, TEST_TIMEOUT, timeout);
+}
+
+static size_t RunAndCount(ForkserverInstrumentation *instrumentation, const char *input) {
+  if (RunSample(instrumentation, input, TEST_TIMEOUT) != OK) {
+    FATAL("Unexpected run result");
+  }
+  Coverage coverage;
+  instrumentation->GetCoverage(coverage, true);
+  size_t num_offsets = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    num_offsets += iter->offsets.size();
+  }
+  return num_offsets;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) FATAL("Usage: %s <target>", argv[0]);
+  target_argv[0] = argv[1];
+  target_argv[1] = NULL;
+
+  char input_template[] = "/tmp/forkservertest_XXXXXX";
+  int fd = mkstemp(input_template);
+  if (fd < 0) FATAL("Error creating the input file");
+  close(fd);
+  input_file = input_template;
+
+  char *instrumentation_argv[] = { argv[0], (char *)"--", argv[1], NULL };
+  ForkserverInstrumentation *instrumentation = new ForkserverInstrumentation();
+  instrumentation->Init(3, instrumentation_argv);
+  instrumentation->SetInputFile(input_file);
+
+  if (RunAndCount(instrumentation, "A") != 2) FATAL("Missed coverage");
+
+  Coverage coverage;
+  RunSample(instrumentation, "A", TEST_TIMEOUT);
+  instrumentation->GetCoverage(coverage, true);
+  instrumentation->IgnoreCoverage(coverage);
+  if (RunAndCount(instrumentation, "A") != 0) FATAL("Ignored coverage reported");
+
+  if (RunSample(instrumentation, "C", TEST_TIMEOUT) != CRASH) FATAL("Crash not detected");
+  std::string crash_name = instrumentation->GetCrashName();
+  if (crash_name.compare(0, strlen("access_violation_"), "access_violation_")) {
+    FATAL("Unexpected crash name %s", crash_name.c_str());
+  }
+  instrumentation->ClearCoverage();
+
+  // reproducing the crash gives it the same name
+  if (instrumentation->RunWithCrashAnalysis(1, target_argv, TEST_TIMEOUT, TEST_TIMEOUT) != CRASH) {
+    FATAL("Crash not reproduced");
+  }
+  if (instrumentation->GetCrashName() != crash_name) FATAL("Reproduced crash named differently");
+  instrumentation->ClearCoverage();
+
+  if (RunSample(instrumentation, "H", TEST_HANG_TIMEOUT) != HANG) FATAL("Hang not detected");
+  instrumentation->ClearCoverage();
+
+  if (RunAndCount(instrumentation, "B") != 0) FATAL("Ignored coverage reported after a crash");
+
+  delete instrumentation;
+  unlink(input_file.c_str());
+
+  printf("OK\n");
+  return 0;
+}
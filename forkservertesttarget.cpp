@@ -0,0 +1,51 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// The target of forkservertest, linked with afl_driver.cpp and
+// libFuzzer/afl/forkserver_rt.c.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#define NUM_TEST_GUARDS 4
+
+extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t *guard);
+extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop);
+
+// instrumented by hand so that this builds
+// without -fsanitize-coverage
+static uint32_t guards[NUM_TEST_GUARDS];
+
+__attribute__((constructor)) static void InitGuards() {
+  __sanitizer_cov_trace_pc_guard_init(guards, guards + NUM_TEST_GUARDS);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  __sanitizer_cov_trace_pc_guard(&guards[0]);
+  if (size && (data[0] == 'A')) {
+    __sanitizer_cov_trace_pc_guard(&guards[1]);
+  }
+  if (size && (data[0] == 'C')) {
+    __sanitizer_cov_trace_pc_guard(&guards[2]);
+    *(volatile int *)NULL = 0;
+  }
+  if (size && (data[0] == 'H')) {
+    __sanitizer_cov_trace_pc_guard(&guards[3]);
+    while (1) usleep(1000);
+  }
+  return 0;
+}
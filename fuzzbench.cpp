@@ -0,0 +1,716 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+// Measures fuzzer-side throughput in isolation.
+// The target is an in-memory function over the sample
+// (see BenchInstrumentation::Run) so the numbers reflect
+// the cost of the queue, coverage and mutator code only.
+//
+// Usage:
+//   fuzzbench -out <dir> [-bench_threads <N>] [-bench_time <secs>]
+//             [-bench_execs <N>] [-bench_cost <N>] [-bench_seed <N>]
+//             [-schedule <explore|fast|entropic|all>] [-cull_interval <secs>]
+//             [-bench_allocs]
+//   fuzzbench -bench_mutators [-bench_seed <N>]
+//
+// Each run stops after -bench_time seconds or -bench_execs executions,
+// whichever comes first. -bench_cost is the number of rounds of work
+// the simulated target does per execution (0 by default, i.e. the
+// fuzzer alone). Thread N seeds its PRNG with -bench_seed + N. Runs
+// are still not repeatable, not even single-threaded ones: power
+// schedules and the calibrated timeout depend on measured exec times,
+// and the culling and triage threads run concurrently.
+//
+// Besides throughput, each run reports the number of offsets found
+// and when the last one was found, so power schedules can be
+// compared on time-to-coverage, the time to the first crash, and
+// the share of thread time spent outside the target (overhead) with
+// the fuzzer-side cost per exec it amounts to. The coverage curve of
+// each run is written to <run dir>/bench_coverage and summarized at
+// fixed fractions of the run time.
+//
+// With -bench_allocs, a single-threaded run counts heap allocations
+// made by the fuzzing thread between the start of a mutated sample's
+// execution that found nothing new and the start of the next one,
+// i.e. the cost of the uninteresting-exec hot path (job boundaries
+// are excluded).
+//
+// With -bench_mutators, each mutator of the default strategy, and the
+// strategy as a whole, mutates copies of a fixed set of samples the
+// way fuzz jobs do, reporting mutations and output bytes per second
+// and heap allocations per mutation. The fixed strategy is also run
+// as a compile-time pipeline (staticmutator.h), with the same PRNG
+// (fixed_static_mt) and with FastPRNG (fixed_static), to compare
+// against the virtual Mutator tree. No fuzzer is run in this mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include "common.h"
+#include "fuzzer.h"
+#include "mutator.h"
+#include "staticmutator.h"
+#include "sampledelivery.h"
+#include "instrumentation.h"
+#include "directory.h"
+#include "mutex.h"
+#include "profiler.h"
+#include "mersenne.h"
+
+// executions on the fuzzing threads, triage reruns are not counted
+static std::atomic<uint64_t> bench_execs;
+static uint64_t bench_num_threads;
+static uint64_t bench_max_execs;
+static uint64_t bench_cost;
+static uint32_t bench_seed;
+static volatile uint32_t bench_sink;
+
+// heap allocations made by the current thread. On glibc malloc
+// and friends are interposed, which also covers operator new,
+// elsewhere only operator new is counted.
+static thread_local uint64_t tl_allocs;
+
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  tl_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  tl_allocs++;
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  tl_allocs++;
+  return __libc_realloc(ptr, size);
+}
+}
+#else
+void *operator new(size_t size) {
+  tl_allocs++;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr, size_t size) noexcept {
+  free(ptr);
+}
+#endif
+
+static bool bench_count_allocs;
+// set by BenchMutator when the fuzzing thread starts a new job
+// and when the sample for the next execution was mutated
+static thread_local bool tl_job_boundary;
+static thread_local bool tl_mutated;
+static std::atomic<uint64_t> bench_uninteresting_execs;
+static std::atomic<uint64_t> bench_uninteresting_allocs;
+
+// offsets found by all threads of the current run
+static Mutex bench_offsets_mutex;
+static std::unordered_set<uint64_t> bench_offsets;
+static uint64_t bench_start_time;
+static uint64_t bench_last_offset_time;
+// (ms since the start of the run, offsets) for every new offset
+static std::vector<std::pair<uint64_t, size_t>> bench_curve;
+static std::atomic<uint64_t> bench_first_crash_time;
+
+// flushed by each thread's BenchInstrumentation when the thread exits
+static Mutex bench_time_mutex;
+// time spent in the simulated target
+static uint64_t bench_target_ns;
+// from the first to the last execution, summed over the threads
+static uint64_t bench_thread_ns;
+// from the first execution on any thread to the last on any thread
+static uint64_t bench_first_exec_ns;
+static uint64_t bench_last_exec_ns;
+
+class BenchInstrumentation : public Instrumentation {
+public:
+  BenchInstrumentation(bool fuzzing_thread) : fuzzing_thread(fuzzing_thread) { }
+
+  ~BenchInstrumentation() {
+    if (!fuzzing_thread || !first_exec_ns) return;
+    bench_time_mutex.Lock();
+    bench_target_ns += target_ns;
+    bench_thread_ns += last_exec_ns - first_exec_ns;
+    if (!bench_first_exec_ns || (first_exec_ns < bench_first_exec_ns)) bench_first_exec_ns = first_exec_ns;
+    if (last_exec_ns > bench_last_exec_ns) bench_last_exec_ns = last_exec_ns;
+    bench_time_mutex.Unlock();
+  }
+
+  void Init(int argc, char **argv) override { }
+
+  void SetSample(Sample *sample) {
+    current_sample = *sample;
+  }
+
+  RunResult Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override {
+    if (!fuzzing_thread) return RunTarget();
+
+    bench_execs++;
+
+    // reruns of interesting samples (calibration, trimming)
+    // are not fuzzing iterations and are not counted
+    bool mutated = tl_mutated;
+    if (bench_count_allocs) {
+      if (last_run_uninteresting && mutated && !tl_job_boundary) {
+        bench_uninteresting_execs++;
+        bench_uninteresting_allocs += tl_allocs - allocs_at_last_run;
+      }
+      tl_job_boundary = false;
+      tl_mutated = false;
+      allocs_at_last_run = tl_allocs;
+    }
+
+    uint64_t start_ns = ProfileNow();
+    if (!first_exec_ns) first_exec_ns = start_ns;
+
+    RunResult result = RunTarget();
+
+    last_exec_ns = ProfileNow();
+    target_ns += last_exec_ns - start_ns;
+
+    if (result == CRASH) {
+      uint64_t no_crash = 0;
+      bench_first_crash_time.compare_exchange_strong(no_crash, GetCurTime());
+    }
+
+    last_run_uninteresting = mutated && (result == OK) && new_offsets.empty();
+    return result;
+  }
+
+  RunResult RunTarget() {
+    unsigned char *bytes = (unsigned char *)current_sample.bytes;
+    size_t size = current_sample.size;
+
+    // simulated work that depends on the sample
+    if (bench_cost) {
+      uint32_t hash = 2166136261;
+      for (uint64_t i = 0; i < bench_cost; i++) {
+        hash = (hash ^ (size ? bytes[i % size] : 0)) * 16777619;
+      }
+      bench_sink = hash;
+    }
+
+    // value-dependent blocks for the first bytes of the sample
+    for (size_t i = 0; (i < size) && (i < 64); i++) {
+      AddOffset(0x1000 + i * 16 + (bytes[i] >> 4));
+    }
+
+    // a chain of comparisons against a magic value,
+    // each matched byte is a new block
+    static const char magic[] = "FUZZBENCH";
+    size_t matched = 0;
+    while ((matched < size) && (matched < sizeof(magic) - 1) &&
+           (bytes[matched] == (unsigned char)magic[matched]))
+    {
+      AddOffset(0x10000 + matched);
+      matched++;
+    }
+    if (matched == sizeof(magic) - 1) return CRASH;
+
+    return OK;
+  }
+
+  void CleanTarget() override { }
+
+  bool HasNewCoverage() override {
+    return !new_offsets.empty();
+  }
+
+  void GetCoverage(Coverage &coverage, bool clear_coverage) override {
+    if (!new_offsets.empty()) {
+      std::string module_name = "bench";
+      ModuleCoverage *module_coverage = GetModuleCoverage(coverage, module_name);
+      if (!module_coverage) {
+        coverage.push_back({ module_name, {} });
+        module_coverage = &coverage.back();
+      }
+      module_coverage->offsets.insert(new_offsets.begin(), new_offsets.end());
+    }
+    if (clear_coverage) ClearCoverage();
+  }
+
+  void ClearCoverage() override {
+    new_offsets.clear();
+  }
+
+  // the fuzzer ignores every offset once it has been found
+  // so this is where offsets get counted
+  void IgnoreCoverage(Coverage &coverage) override {
+    for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+      ignored_offsets.insert(iter->offsets.begin(), iter->offsets.end());
+      bench_offsets_mutex.Lock();
+      for (auto offset : iter->offsets) {
+        if (bench_offsets.insert(offset).second) {
+          bench_last_offset_time = GetCurTime();
+          bench_curve.push_back({ bench_last_offset_time - bench_start_time, bench_offsets.size() });
+        }
+      }
+      bench_offsets_mutex.Unlock();
+    }
+  }
+
+  std::string GetCrashName() override { return "bench_magic"; }
+
+protected:
+  void AddOffset(uint64_t offset) {
+    if (ignored_offsets.find(offset) != ignored_offsets.end()) return;
+    new_offsets.insert(offset);
+  }
+
+  Sample current_sample;
+  bool fuzzing_thread;
+  bool last_run_uninteresting = false;
+  uint64_t allocs_at_last_run = 0;
+  uint64_t first_exec_ns = 0;
+  uint64_t last_exec_ns = 0;
+  uint64_t target_ns = 0;
+  std::set<uint64_t> new_offsets;
+  std::unordered_set<uint64_t> ignored_offsets;
+};
+
+// hands the sample directly to the thread's BenchInstrumentation
+class BenchSampleDelivery : public SampleDelivery {
+public:
+  BenchSampleDelivery(BenchInstrumentation *instrumentation) :
+    instrumentation(instrumentation) { }
+
+  int DeliverSample(Sample *sample) override {
+    instrumentation->SetSample(sample);
+    return 1;
+  }
+
+protected:
+  BenchInstrumentation *instrumentation;
+};
+
+// forwards to the real strategy, marking job boundaries
+// so that they are left out of allocation counts
+class BenchMutator : public Mutator {
+public:
+  BenchMutator(Mutator *child_mutator) : child_mutator(child_mutator) { }
+  ~BenchMutator() { delete child_mutator; }
+
+  MutatorSampleContext *CreateSampleContext(Sample *sample) override {
+    return child_mutator->CreateSampleContext(sample);
+  }
+
+  void InitRound(Sample *input_sample, MutatorSampleContext *context) override {
+    tl_job_boundary = true;
+    child_mutator->InitRound(input_sample, context);
+  }
+
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    tl_mutated = true;
+    return child_mutator->Mutate(inout_sample, prng, all_samples);
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) override {
+    child_mutator->NotifyResult(result, has_new_coverage);
+  }
+
+  void SetEnergy(double energy) override {
+    child_mutator->SetEnergy(energy);
+  }
+
+  bool SaveState(std::string &state) override {
+    return child_mutator->SaveState(state);
+  }
+
+  void LoadState(const std::string &state) override {
+    child_mutator->LoadState(state);
+  }
+
+  void GetStats(std::vector<MutatorStats> &stats) override {
+    child_mutator->GetStats(stats);
+  }
+
+protected:
+  Mutator *child_mutator;
+};
+
+// same havoc strategy as the default fuzzer in main.cpp, without
+// the rounds, the deterministic stage and the dictionary
+static Mutator *CreateDefaultStrategy() {
+  AdaptiveMutator *adaptive = new AdaptiveMutator();
+  adaptive->AddMutator(new ByteFlipMutator(), 1, "byte_flip");
+  adaptive->AddMutator(new AppendMutator(1, 128), 0.2, "append");
+  adaptive->AddMutator(new BlockInsertMutator(1, 128), 0.1, "block_insert");
+  adaptive->AddMutator(new BlockFlipMutator(2, 16), 0.1, "block_flip_2_16");
+  adaptive->AddMutator(new BlockFlipMutator(16, 64), 0.1, "block_flip_16_64");
+  adaptive->AddMutator(new BlockFlipMutator(1, 64, true), 0.1, "block_flip_uniform");
+  adaptive->AddMutator(new BlockDuplicateMutator(1, 128, 1, 8), 0.1, "block_duplicate");
+  adaptive->AddMutator(new InterstingValueMutator(true), 0.1, "interesting_value");
+  adaptive->AddMutator(new SpliceMutator(1, 0.5), 0.1, "splice_1");
+  adaptive->AddMutator(new SpliceMutator(2, 0.5), 0.1, "splice_2");
+  return adaptive;
+}
+
+// the strategy before AdaptiveMutator, for comparison
+static Mutator *CreateFixedStrategy() {
+  PSelectMutator *pselect = new PSelectMutator();
+  pselect->AddMutator(new ByteFlipMutator(), 1);
+  pselect->AddMutator(new AppendMutator(1, 128), 0.2);
+  pselect->AddMutator(new BlockInsertMutator(1, 128), 0.1);
+  pselect->AddMutator(new BlockFlipMutator(2, 16), 0.1);
+  pselect->AddMutator(new BlockFlipMutator(16, 64), 0.1);
+  pselect->AddMutator(new BlockFlipMutator(1, 64, true), 0.1);
+  pselect->AddMutator(new BlockDuplicateMutator(1, 128, 1, 8), 0.1);
+  pselect->AddMutator(new InterstingValueMutator(true), 0.1);
+  pselect->AddMutator(new SpliceMutator(1, 0.5), 0.1);
+  pselect->AddMutator(new SpliceMutator(2, 0.5), 0.1);
+  return new RepeatMutator(pselect, 0.5);
+}
+
+// the fixed strategy composed at compile time
+static auto CreateFixedPipeline() {
+  return StaticRepeat(StaticPSelect({ 1, 0.2, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1 },
+                                    ByteFlipOp(),
+                                    AppendOp(1, 128),
+                                    BlockInsertOp(1, 128),
+                                    BlockFlipOp(2, 16),
+                                    BlockFlipOp(16, 64),
+                                    BlockFlipOp(1, 64, true),
+                                    BlockDuplicateOp(1, 128, 1, 8),
+                                    InterestingValueOp(true),
+                                    SpliceOp(1, 0.5),
+                                    SpliceOp(2, 0.5)),
+                      0.5);
+}
+
+typedef decltype(CreateFixedPipeline()) FixedPipeline;
+
+#define MUTATOR_BENCH_ITERATIONS 200000
+#define MUTATOR_BENCH_SAMPLES 16
+#define MUTATOR_BENCH_PASSES 3
+
+static void BenchMutators() {
+  PRNG *prng = new MTPRNG(bench_seed);
+
+  // 16 bytes to 16 KB
+  std::vector<Sample> samples(MUTATOR_BENCH_SAMPLES);
+  std::vector<Sample *> all_samples;
+  for (size_t i = 0; i < samples.size(); i++) {
+    std::vector<char> bytes((size_t)16 << (i % 11));
+    for (size_t j = 0; j < bytes.size(); j++) bytes[j] = (char)prng->Rand(0, 255);
+    samples[i].Init(bytes.data(), bytes.size());
+    all_samples.push_back(&samples[i]);
+  }
+
+  struct {
+    const char *name;
+    Mutator *mutator;
+  } mutators[] = {
+    { "byte_flip", new ByteFlipMutator() },
+    { "append", new AppendMutator(1, 128) },
+    { "block_insert", new BlockInsertMutator(1, 128) },
+    { "block_flip", new BlockFlipMutator(2, 16) },
+    { "block_flip_uniform", new BlockFlipMutator(1, 64, true) },
+    { "block_duplicate", new BlockDuplicateMutator(1, 128, 1, 8) },
+    { "interesting_value", new InterstingValueMutator(true) },
+    { "splice_1", new SpliceMutator(1, 0.5) },
+    { "splice_2", new SpliceMutator(2, 0.5) },
+    { "fixed", CreateFixedStrategy() },
+    { "fixed_static_mt", new StaticMutator<FixedPipeline, PRNG>(CreateFixedPipeline()) },
+    { "fixed_static", new StaticMutator<FixedPipeline>(CreateFixedPipeline()) },
+    { "default", CreateDefaultStrategy() },
+  };
+
+  printf("mutator              mutations/s       MB/s  allocs/mutation\n");
+  for (size_t i = 0; i < sizeof(mutators) / sizeof(mutators[0]); i++) {
+    // the working sample is reused like the fuzzer's mutated_sample
+    Sample work;
+    uint64_t bytes = 0;
+    uint64_t allocs_before = tl_allocs;
+    // the fastest pass, the others are mostly noise
+    double secs = 0;
+    for (int pass = 0; pass < MUTATOR_BENCH_PASSES; pass++) {
+      bytes = 0;
+      uint64_t start_ns = ProfileNow();
+      for (size_t j = 0; j < MUTATOR_BENCH_ITERATIONS; j++) {
+        work = *all_samples[j % all_samples.size()];
+        mutators[i].mutator->Mutate(&work, prng, all_samples);
+        mutators[i].mutator->NotifyResult(OK, false);
+        bytes += work.size;
+      }
+      double pass_secs = (ProfileNow() - start_ns) / 1000000000.0;
+      if (!pass || (pass_secs < secs)) secs = pass_secs;
+    }
+    uint64_t allocs = tl_allocs - allocs_before;
+    printf("%-18s %13.0f %10.1f %16.4f\n", mutators[i].name,
+           MUTATOR_BENCH_ITERATIONS / secs, bytes / secs / 1000000.0,
+           (double)allocs / (MUTATOR_BENCH_ITERATIONS * MUTATOR_BENCH_PASSES));
+  }
+
+  delete prng;
+}
+
+class BenchFuzzer : public Fuzzer {
+  Mutator *CreateMutator(int argc, char **argv, ThreadContext *tc) override;
+  PRNG *CreatePRNG(int argc, char **argv, ThreadContext *tc) override;
+  Instrumentation *CreateInstrumentation(int argc, char **argv, ThreadContext *tc) override;
+  SampleDelivery *CreateSampleDelivery(int argc, char **argv, ThreadContext *tc) override;
+  bool ShouldStop() override;
+};
+
+PRNG *BenchFuzzer::CreatePRNG(int argc, char **argv, ThreadContext *tc) {
+  return new MTPRNG(bench_seed + tc->thread_id);
+}
+
+// the fuzzer itself only checks -max_execs once per second
+bool BenchFuzzer::ShouldStop() {
+  if (bench_max_execs && (bench_execs >= bench_max_execs)) return true;
+  return Fuzzer::ShouldStop();
+}
+
+Mutator *BenchFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc) {
+  return new BenchMutator(new NRoundMutator(CreateDefaultStrategy(), 1000));
+}
+
+Instrumentation *BenchFuzzer::CreateInstrumentation(int argc, char **argv, ThreadContext *tc) {
+  BenchInstrumentation *instrumentation = new BenchInstrumentation(tc->thread_id <= bench_num_threads);
+  instrumentation->Init(argc, argv);
+  return instrumentation;
+}
+
+SampleDelivery *BenchFuzzer::CreateSampleDelivery(int argc, char **argv, ThreadContext *tc) {
+  return new BenchSampleDelivery((BenchInstrumentation *)tc->instrumentation);
+}
+
+static void CreateSeeds(std::string &in_dir) {
+  CreateDirectory(in_dir);
+  const char *seeds[] = { "hello world", "FUZZ", "0123456789abcdef" };
+  for (size_t i = 0; i < sizeof(seeds) / sizeof(seeds[0]); i++) {
+    Sample sample;
+    sample.Init(seeds[i], strlen(seeds[i]));
+    std::string outfile = DirJoin(in_dir, std::string("seed_") + std::to_string(i));
+    sample.Save(outfile.c_str());
+  }
+}
+
+int main(int argc, char **argv)
+{
+  bench_seed = (uint32_t)GetIntOption("-bench_seed", argc, argv, 0);
+  if (GetBinaryOption("-bench_mutators", argc, argv, false)) {
+    BenchMutators();
+    return 0;
+  }
+
+  char *option = GetOption("-out", argc, argv);
+  if (!option) {
+    printf("Usage: %s -out <dir> [-bench_threads <N>] [-bench_time <secs>] [-bench_execs <N>] [-bench_cost <N>] [-bench_seed <N>] [-schedule <name|all>] [-cull_interval <secs>] [-bench_allocs]\n       %s -bench_mutators [-bench_seed <N>]\n", argv[0], argv[0]);
+    return 0;
+  }
+  std::string out_dir = option;
+  int max_threads = GetIntOption("-bench_threads", argc, argv, 4);
+  int bench_time = GetIntOption("-bench_time", argc, argv, 10);
+  bench_max_execs = GetIntOption("-bench_execs", argc, argv, 0);
+  bench_cost = GetIntOption("-bench_cost", argc, argv, 0);
+  char *cull_interval = GetOption("-cull_interval", argc, argv);
+  bench_count_allocs = GetBinaryOption("-bench_allocs", argc, argv, false);
+  if (bench_count_allocs) max_threads = 1;
+
+  std::vector<std::string> schedules;
+  option = GetOption("-schedule", argc, argv);
+  if (!option) {
+    schedules.push_back("explore");
+  } else if (!strcmp(option, "all")) {
+    schedules.push_back("explore");
+    schedules.push_back("fast");
+    schedules.push_back("entropic");
+  } else {
+    schedules.push_back(option);
+  }
+
+  CreateDirectory(out_dir);
+  std::string in_dir = DirJoin(out_dir, "bench_in");
+  CreateSeeds(in_dir);
+
+  struct BenchResult {
+    std::string schedule;
+    int num_threads;
+    uint64_t execs;
+    double secs;
+    size_t offsets;
+    double last_offset_secs;
+    // negative if nothing crashed
+    double first_crash_secs;
+    double overhead;
+    double fuzzer_ns_per_exec;
+    // offsets found by each of the curve_points
+    std::vector<size_t> curve;
+  };
+  // fractions of the run time at which coverage is reported
+  static const double curve_points[] = { 0.1, 0.25, 0.5, 0.75, 1.0 };
+  const size_t num_curve_points = sizeof(curve_points) / sizeof(curve_points[0]);
+  std::vector<BenchResult> results;
+
+  for (auto schedule = schedules.begin(); schedule != schedules.end(); schedule++) {
+    for (int num_threads = 1; num_threads <= max_threads; ) {
+      std::string run_dir = DirJoin(out_dir, *schedule + "_threads_" + std::to_string(num_threads));
+      std::string nthreads_str = std::to_string(num_threads);
+      std::string time_str = std::to_string(bench_time);
+      std::string execs_str = std::to_string(bench_max_execs);
+
+      std::vector<char *> fuzzer_argv;
+      fuzzer_argv.push_back(argv[0]);
+      fuzzer_argv.push_back((char *)"-in");
+      fuzzer_argv.push_back((char *)in_dir.c_str());
+      fuzzer_argv.push_back((char *)"-out");
+      fuzzer_argv.push_back((char *)run_dir.c_str());
+      fuzzer_argv.push_back((char *)"-nthreads");
+      fuzzer_argv.push_back((char *)nthreads_str.c_str());
+      fuzzer_argv.push_back((char *)"-max_time");
+      fuzzer_argv.push_back((char *)time_str.c_str());
+      fuzzer_argv.push_back((char *)"-schedule");
+      fuzzer_argv.push_back((char *)schedule->c_str());
+      if (bench_max_execs) {
+        fuzzer_argv.push_back((char *)"-max_execs");
+        fuzzer_argv.push_back((char *)execs_str.c_str());
+      }
+      if (cull_interval) {
+        fuzzer_argv.push_back((char *)"-cull_interval");
+        fuzzer_argv.push_back(cull_interval);
+      }
+      fuzzer_argv.push_back(NULL);
+
+      bench_num_threads = num_threads;
+      bench_execs = 0;
+      bench_offsets.clear();
+      bench_curve.clear();
+      bench_first_crash_time = 0;
+      bench_target_ns = 0;
+      bench_thread_ns = 0;
+      bench_first_exec_ns = 0;
+      bench_last_exec_ns = 0;
+      bench_start_time = GetCurTime();
+      bench_last_offset_time = bench_start_time;
+
+      BenchFuzzer *fuzzer = new BenchFuzzer();
+      fuzzer->Run((int)fuzzer_argv.size() - 1, fuzzer_argv.data());
+      delete fuzzer;
+
+      uint64_t run_time = GetCurTime() - bench_start_time;
+
+      BenchResult result;
+      result.schedule = *schedule;
+      result.num_threads = num_threads;
+      result.execs = bench_execs;
+      result.secs = (bench_last_exec_ns - bench_first_exec_ns) / 1000000000.0;
+      result.offsets = bench_offsets.size();
+      result.last_offset_secs = (bench_last_offset_time - bench_start_time) / 1000.0;
+      result.first_crash_secs = bench_first_crash_time ? (bench_first_crash_time - bench_start_time) / 1000.0 : -1;
+      result.overhead = bench_thread_ns ? 1.0 - (double)bench_target_ns / bench_thread_ns : 0;
+      result.fuzzer_ns_per_exec = result.execs ? (double)(bench_thread_ns - bench_target_ns) / result.execs : 0;
+
+      std::string curve_file = DirJoin(run_dir, "bench_coverage");
+      FILE *fp = fopen(curve_file.c_str(), "w");
+      if (fp) {
+        fprintf(fp, "# ms, offsets\n");
+        for (auto iter = bench_curve.begin(); iter != bench_curve.end(); iter++) {
+          fprintf(fp, "%llu, %zu\n", (unsigned long long)iter->first, iter->second);
+        }
+        fclose(fp);
+      }
+
+      size_t point = 0;
+      for (size_t i = 0; i < num_curve_points; i++) {
+        uint64_t point_time = (uint64_t)(run_time * curve_points[i]);
+        while ((point < bench_curve.size()) && (bench_curve[point].first <= point_time)) point++;
+        result.curve.push_back(point ? bench_curve[point - 1].second : 0);
+      }
+
+      results.push_back(result);
+
+      if (num_threads == max_threads) break;
+      num_threads *= 2;
+      if (num_threads > max_threads) num_threads = max_threads;
+    }
+  }
+
+  if (bench_count_allocs) {
+    uint64_t execs = bench_uninteresting_execs;
+    uint64_t allocs = bench_uninteresting_allocs;
+    printf("\nuninteresting execs: %llu, heap allocations: %llu (%.4f per exec)\n",
+           (unsigned long long)execs, (unsigned long long)allocs,
+           execs ? (double)allocs / execs : 0);
+    return 0;
+  }
+
+  printf("\nschedule  threads      execs    execs/s  speedup  offsets  last new (s)  first crash (s)  overhead  fuzzer ns/exec\n");
+  double base = 0;
+  for (auto iter = results.begin(); iter != results.end(); iter++) {
+    double execs_per_sec = iter->secs ? iter->execs / iter->secs : 0;
+    // speedup is relative to the single-thread run of the same schedule
+    if (iter->num_threads == 1) base = execs_per_sec;
+    std::string first_crash = "-";
+    if (iter->first_crash_secs >= 0) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%.1f", iter->first_crash_secs);
+      first_crash = buf;
+    }
+    printf("%-8s %8d %10llu %10.0f %8.2f %8zu %13.1f %16s %8.1f%% %15.0f\n", iter->schedule.c_str(),
+           iter->num_threads, (unsigned long long)iter->execs, execs_per_sec,
+           base ? execs_per_sec / base : 0, iter->offsets, iter->last_offset_secs,
+           first_crash.c_str(), iter->overhead * 100, iter->fuzzer_ns_per_exec);
+  }
+
+  printf("\ncoverage curve (offsets found by a fraction of the run time)\n");
+  printf("schedule  threads");
+  for (size_t i = 0; i < num_curve_points; i++) {
+    printf(" %7.0f%%", curve_points[i] * 100);
+  }
+  printf("\n");
+  for (auto iter = results.begin(); iter != results.end(); iter++) {
+    printf("%-8s %8d", iter->schedule.c_str(), iter->num_threads);
+    for (size_t i = 0; i < num_curve_points; i++) {
+      printf(" %8zu", iter->curve[i]);
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -17,11 +17,19 @@ limitations under the License.
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <chrono>
+#include <algorithm>
 #include "common.h"
 #include "sample.h"
 #include "fuzzer.h"
+#include "powerschedule.h"
 #include "sampledelivery.h"
 #include "instrumentation.h"
+#include "inprocessinstrumentation.h"
+#include "forkserverinstrumentation.h"
+#include "ptraceinstrumentation.h"
 #include "coverage.h"
 #include "mutator.h"
 #include "thread.h"
@@ -73,12 +81,46 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
     target_argv = NULL;
   }
 
+  // without -t, the timeout is calibrated once the corpus is processed
+  auto_timeout = (GetOption("-t", argc, argv) == NULL);
   timeout = GetIntOption("-t", argc, argv, 0x7FFFFFFF);
+  timeout_factor = GetIntOption("-timeout_factor", argc, argv, AUTO_TIMEOUT_FACTOR);
+
+  // pin each fuzzing thread (and its target) to its own cpu
+  cpu_affinity = GetBinaryOption("-cpu_affinity", argc, argv, false);
+
+  // per-phase timing of the fuzzing loop
+  profile = GetBinaryOption("-profile", argc, argv, false);
+
+  // tokens for the dictionary mutator
+  GetOptionAll("-dict", argc, argv, &dict_files);
+  dict_auto = !GetBinaryOption("-no_dict_auto", argc, argv, false);
 
   init_timeout = GetIntOption("-t1", argc, argv, timeout);
   
   corpus_timeout = GetIntOption("-t_corpus", argc, argv, timeout);
 
+  hang_timeout_set = (GetOption("-t_hang", argc, argv) != NULL);
+  hang_timeout = GetIntOption("-t_hang", argc, argv, timeout);
+
+  calibration_converge_runs = GetIntOption("-calibration_converge", argc, argv, CALIBRATION_CONVERGE_RUNS);
+
+  // 0 disables slow entry handling
+  slow_factor = GetIntOption("-slow_factor", argc, argv, SLOW_FACTOR);
+  quarantine_factor = GetIntOption("-quarantine_factor", argc, argv, QUARANTINE_FACTOR);
+
+  cull_interval_secs = GetIntOption("-cull_interval", argc, argv, CULL_INTERVAL);
+
+  num_triage_threads = GetIntOption("-triage_threads", argc, argv, TRIAGE_THREADS);
+
+  trim_max_execs = GetIntOption("-trim_max_execs", argc, argv, TRIM_MAX_EXECS);
+  trim_max_time_ms = GetIntOption("-trim_max_time", argc, argv, TRIM_MAX_TIME_MS);
+  trim_normalize = !GetBinaryOption("-no_trim_normalize", argc, argv, false);
+
+  // optional stop conditions
+  max_execs = GetIntOption("-max_execs", argc, argv, 0);
+  max_time_secs = GetIntOption("-max_time", argc, argv, 0);
+
   if (GetOption("-server", argc, argv)) {
     server = new CoverageClient();
     server->Init(argc, argv);
@@ -106,12 +148,56 @@ void Fuzzer::SetupDirectories() {
   CreateDirectory(sample_dir);
 }
 
+void Fuzzer::SetupDictionary() {
+  size_t num_loaded = 0;
+  for (char *filename : dict_files) {
+    num_loaded += dictionary.LoadFile(filename);
+  }
+
+  size_t num_extracted = 0;
+  if (dict_auto) {
+    // the input files when starting, the samples found so far
+    // when restoring (input_files is empty then)
+    if (!input_files.empty()) {
+      std::vector<Sample> input_samples(input_files.size());
+      std::vector<Sample *> samples;
+      size_t i = 0;
+      for (auto &filename : input_files) {
+        Sample *sample = &input_samples[i++];
+        if (!sample->Load(filename.c_str())) continue;
+        if (sample->size > MAX_SAMPLE_SIZE) sample->Trim(MAX_SAMPLE_SIZE);
+        samples.push_back(sample);
+      }
+      num_extracted = dictionary.ExtractTokens(samples);
+    } else {
+      num_extracted = dictionary.ExtractTokens(all_samples);
+    }
+  }
+
+  if (dictionary.Size()) {
+    SAY("%d dictionary tokens (%d from files, %d from the corpus)\n",
+        (int)dictionary.Size(), (int)num_loaded, (int)num_extracted);
+  }
+}
+
 void *StartFuzzThread(void *arg) {
   Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
   tc->fuzzer->RunFuzzerThread(tc);
   return NULL;
 }
 
+void *StartCullThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunCullThread(tc);
+  return NULL;
+}
+
+void *StartTriageThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunTriageThread(tc);
+  return NULL;
+}
+
 Fuzzer::ThreadContext::~ThreadContext() {
   if (sampleDelivery) delete sampleDelivery;
   if (prng) delete prng;
@@ -120,6 +206,10 @@ Fuzzer::ThreadContext::~ThreadContext() {
   if (target_argv) free(target_argv);
 }
 
+Fuzzer::Fuzzer() { }
+
+Fuzzer::~Fuzzer() { }
+
 void Fuzzer::Run(int argc, char **argv) {
   if (GetOption("-start_server", argc, argv)) {
     // run the server
@@ -139,16 +229,68 @@ void Fuzzer::Run(int argc, char **argv) {
   num_hangs = 0;
   num_samples = 0;
   num_samples_discarded = 0;
-  total_execs = 0;
+  restored_execs = 0;
+  num_offsets = 0;
+  coverage_log_start = 0;
+  coverage_log_size = 0;
   min_priority = 1.79e+308;
 
+  num_trim_execs = 0;
+  num_trim_cache_hits = 0;
+  num_trim_bytes_saved = 0;
+
+  num_calibrations = 0;
+  num_calibrations_skipped = 0;
+  num_calibrations_deduplicated = 0;
+  num_calibrations_claimed = 0;
+  num_calibration_runs = 0;
+  num_calibration_runs_saved = 0;
+  calibration_time_ms = 0;
+
+  median_exec_us = 0;
+  num_slow_jobs = 0;
+  num_quarantined = 0;
+
+  num_cull_records = 0;
+  num_favored = 0;
+  cull_generation = 0;
+  num_cull_skips = 0;
+  cull_time_ms = 0;
+
+  triage_closed = false;
+  triage_max_pending = 0;
+  num_triaged = 0;
+  num_triaged_inline = 0;
+
+  timeout_calibrated = false;
+  num_hangs_unconfirmed = 0;
+
   ParseOptions(argc, argv);
 
   SetupDirectories();
 
+  schedule.reset(CreatePowerSchedule(argc, argv));
+
+  journal_compacted_size = 0;
+  mutator_states_changed = false;
+
+  sample_queue.Init(num_threads);
+  num_all_samples = 0;
+  should_stop = false;
+
   if(should_restore_state) {
     RestoreState();
   } else {
+    // start with an empty journal
+    coverage_mutex.Lock();
+    journal_mutex.Lock();
+    if (!journal.Open(DirJoin(out_dir, "state.journal"))) {
+      FATAL("Error opening state journal");
+    }
+    CompactJournal();
+    journal_mutex.Unlock();
+    coverage_mutex.Unlock();
+
     GetFilesInDirectory(in_dir, input_files);
 
     if (input_files.size() == 0) {
@@ -158,20 +300,82 @@ void Fuzzer::Run(int argc, char **argv) {
     }
   }
 
+  SetupDictionary();
+
   // in case of state restoring,
   // input_files is empty, so this is fine
   state = INPUT_SAMPLE_PROCESSING;
-  
-  for (int i = 1; i <= num_threads; i++) {
+
+  // per-thread statistics for fuzzing and helper threads, sized
+  // upfront as other threads read them while helpers are created
+  size_t num_all_threads = num_threads + (cull_interval_secs ? 1 : 0) + num_triage_threads;
+  thread_stats.resize(num_all_threads);
+  exec_time_histograms.resize(num_all_threads);
+  thread_profiles.resize(num_all_threads);
+
+  coverage_log_positions.assign(num_threads, SIZE_MAX);
+
+  if (cpu_affinity) AssignCpus();
+  std::vector<int> main_cpus = GetThreadAffinity();
+
+  num_running_threads = (int)num_threads;
+  for (uint64_t i = 1; i <= num_threads; i++) {
+    // the context is created on the thread's cpu, so that its buffers
+    // are allocated on the local NUMA node, and the thread inherits
+    // the affinity, as do the target processes it starts
+    if (!thread_cpus.empty() && !SetThreadAffinity({ thread_cpus[i - 1] })) {
+      // not pinned, and not on the previous thread's cpu either
+      thread_cpus[i - 1] = -1;
+      SetThreadAffinity(main_cpus);
+    }
     ThreadContext *tc = CreateThreadContext(argc, argv, i);
     CreateThread(StartFuzzThread, tc);
   }
+  if (!thread_cpus.empty()) {
+    SetThreadAffinity(main_cpus);
+    ReportPinnedThreads();
+  }
 
-  uint64_t last_execs = 0;
+  // helper threads get ids after the fuzzing threads
+  uint64_t next_thread_id = num_threads + 1;
+
+  if (cull_interval_secs) {
+    num_running_threads++;
+    ThreadContext *tc = CreateThreadContext(argc, argv, next_thread_id++, false);
+    CreateThread(StartCullThread, tc);
+  }
+
+  for (int i = 0; i < num_triage_threads; i++) {
+    num_running_threads++;
+    ThreadContext *tc = CreateThreadContext(argc, argv, next_thread_id++, false);
+    CreateThread(StartTriageThread, tc);
+  }
+
+  uint64_t last_execs = GetTotalExecs();
+  uint64_t execs_per_sec = 0;
   
   uint32_t secs_to_sleep = 1;
   
   uint64_t secs_since_last_save = 0;
+  uint64_t secs_since_last_stats = 0;
+  uint64_t secs_since_last_plot = 0;
+
+  start_time_ms = GetCurTime();
+
+  std::string plot_file = DirJoin(out_dir, "plot_data");
+  bool plot_file_exists = false;
+  FILE *fp = fopen(plot_file.c_str(), "rb");
+  if (fp) {
+    plot_file_exists = true;
+    fclose(fp);
+  }
+  plot_fp = fopen(plot_file.c_str(), "a");
+  if (!plot_fp) {
+    FATAL("Error opening %s", plot_file.c_str());
+  }
+  if (!plot_file_exists) {
+    fprintf(plot_fp, "# unix_time, run_time, execs_done, execs_per_sec, corpus_count, favored, offsets, crashes, unique_crashes, hangs, queue_size\n");
+  }
   
   while (1) {
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
@@ -186,99 +390,582 @@ void Fuzzer::Run(int argc, char **argv) {
       secs_since_last_save = 0;
     }
     
-    size_t num_offsets = 0;
-    coverage_mutex.Lock();
-    for(auto iter = fuzzer_coverage.begin(); iter != fuzzer_coverage.end(); iter++) {
-      num_offsets += iter->offsets.size();
-    }
-    coverage_mutex.Unlock();
-    
-    printf("\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %zu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, num_offsets, (total_execs - last_execs) / secs_to_sleep);
+    uint64_t total_execs = GetTotalExecs();
+    execs_per_sec = (total_execs - last_execs) / secs_to_sleep;
+
+    printf("\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %llu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, (unsigned long long)num_offsets, execs_per_sec);
     last_execs = total_execs;
+
+    uint64_t run_time_ms = GetCurTime() - start_time_ms;
+    printf("Calibrations: %llu (%llu skipped, %llu duplicates avoided, %llu/hour, %llu claimed by other threads)\nCalibration runs: %llu (%llu saved, %llu ms)\n",
+           (unsigned long long)num_calibrations, (unsigned long long)num_calibrations_skipped,
+           (unsigned long long)num_calibrations_deduplicated,
+           (unsigned long long)(run_time_ms ? num_calibrations_deduplicated * 3600000 / run_time_ms : 0),
+           (unsigned long long)num_calibrations_claimed,
+           (unsigned long long)num_calibration_runs, (unsigned long long)num_calibration_runs_saved,
+           (unsigned long long)calibration_time_ms);
+    if (hang_timeout > timeout) {
+      printf("Timeout: %u ms%s, hangs confirmed with %u ms (%llu not confirmed)\n",
+             (unsigned)timeout, timeout_calibrated ? " (calibrated)" : "",
+             (unsigned)hang_timeout, (unsigned long long)num_hangs_unconfirmed);
+    }
+    printf("Trimming: %llu bytes saved, %llu execs (%llu cached)\n",
+           (unsigned long long)num_trim_bytes_saved, (unsigned long long)num_trim_execs,
+           (unsigned long long)num_trim_cache_hits);
+    PrintStability();
+    UpdateExecTimeStats();
+    if (!thread_cpus.empty()) PrintCpuExecRates(secs_to_sleep);
+    PrintMutatorStats();
+    if (profile) {
+      // shares are relative to the time of the fuzzing threads
+      PrintProfileSummary(thread_profiles.data(), num_threads, run_time_ms * 1000000 * num_threads);
+    }
+    if (cull_interval_secs) {
+      printf("Favored: %llu of %llu measured entries (%llu jobs skipped, %llu ms culling)\n",
+             (unsigned long long)num_favored, (unsigned long long)num_cull_records,
+             (unsigned long long)num_cull_skips, (unsigned long long)cull_time_ms);
+    }
+    if (num_triage_threads) PrintTriageStats();
+
+    secs_since_last_stats += secs_to_sleep;
+    if (secs_since_last_stats >= FUZZER_STATS_INTERVAL) {
+      WriteStats(execs_per_sec);
+      WriteMutatorStats();
+      if (profile) WriteProfileStats();
+      secs_since_last_stats = 0;
+    }
+    secs_since_last_plot += secs_to_sleep;
+    if (secs_since_last_plot >= FUZZER_PLOT_INTERVAL) {
+      AppendPlotData(execs_per_sec);
+      secs_since_last_plot = 0;
+    }
+
+    if ((max_execs && (total_execs >= max_execs)) ||
+        (max_time_secs && ((GetCurTime() - start_time_ms) >= max_time_secs * 1000)))
+    {
+      break;
+    }
+  }
+
+  // tell the fuzzing threads to finish and wait for them
+  should_stop = true;
+  sample_queue.Notify();
+  triage_mutex.Lock();
+  triage_cv.Broadcast();
+  triage_mutex.Unlock();
+  while (num_running_threads > 0) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(10);
+#else
+    usleep(10000);
+#endif
+  }
+
+  SaveState();
+
+  WriteStats(execs_per_sec);
+  WriteMutatorStats();
+  if (profile) WriteProfileStats();
+  fclose(plot_fp);
+}
+
+uint64_t Fuzzer::GetTotalExecs() {
+  uint64_t total = restored_execs;
+  for (size_t i = 0; i < thread_stats.size(); i++) {
+    if (thread_stats[i]) total += thread_stats[i]->execs.load(std::memory_order_relaxed);
   }
+  return total;
 }
 
-RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Coverage *coverage, uint32_t init_timeout, uint32_t timeout) {
-  // not protected by a mutex but not important to be perfectly accurate
-  total_execs++;
+// writes fuzzer_stats as key : value lines, to a temporary
+// file first so readers never see a partially written file
+void Fuzzer::WriteStats(uint64_t execs_per_sec) {
+  std::string stats_file = DirJoin(out_dir, "fuzzer_stats");
+  std::string tmp_file = stats_file + ".tmp";
 
-  if (!tc->sampleDelivery->DeliverSample(sample)) {
-    WARN("Error delivering sample, retrying with a clean target");
-    tc->instrumentation->CleanTarget();
+  FILE *fp = fopen(tmp_file.c_str(), "w");
+  if (!fp) {
+    WARN("Error writing %s", tmp_file.c_str());
+    return;
+  }
+
+  uint64_t run_time = (GetCurTime() - start_time_ms) / 1000;
+  fprintf(fp, "start_time        : %llu\n", (unsigned long long)(time(NULL) - run_time));
+  fprintf(fp, "last_update       : %llu\n", (unsigned long long)time(NULL));
+  fprintf(fp, "run_time          : %llu\n", (unsigned long long)run_time);
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  fprintf(fp, "fuzzer_pid        : %llu\n", (unsigned long long)GetCurrentProcessId());
+#else
+  fprintf(fp, "fuzzer_pid        : %llu\n", (unsigned long long)getpid());
+#endif
+  fprintf(fp, "threads           : %llu\n", (unsigned long long)num_threads);
+  fprintf(fp, "execs_done        : %llu\n", (unsigned long long)GetTotalExecs());
+  fprintf(fp, "execs_per_sec     : %llu\n", (unsigned long long)execs_per_sec);
+  fprintf(fp, "exec_us_median    : %llu\n", (unsigned long long)median_exec_us);
+  fprintf(fp, "corpus_count      : %llu\n", (unsigned long long)num_samples);
+  fprintf(fp, "corpus_discarded  : %llu\n", (unsigned long long)num_samples_discarded);
+  fprintf(fp, "corpus_favored    : %llu\n", (unsigned long long)num_favored);
+  fprintf(fp, "queue_size        : %llu\n", (unsigned long long)sample_queue.Size());
+  fprintf(fp, "offsets           : %llu\n", (unsigned long long)num_offsets);
+  fprintf(fp, "crashes           : %llu\n", (unsigned long long)num_crashes);
+  fprintf(fp, "unique_crashes    : %llu\n", (unsigned long long)num_unique_crashes);
+  fprintf(fp, "hangs             : %llu\n", (unsigned long long)num_hangs);
+  fprintf(fp, "exec_timeout      : %u\n", (unsigned)timeout);
+  fprintf(fp, "calibrations      : %llu\n", (unsigned long long)num_calibrations);
+  fprintf(fp, "calibrations_dedup: %llu\n", (unsigned long long)num_calibrations_deduplicated);
+  fprintf(fp, "calibrations_claim: %llu\n", (unsigned long long)num_calibrations_claimed);
+  fclose(fp);
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  MoveFileExA(tmp_file.c_str(), stats_file.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  rename(tmp_file.c_str(), stats_file.c_str());
+#endif
+}
+
+// picks a cpu for every fuzzing thread, preferring the ones
+// that are idle. Helper threads are not pinned.
+void Fuzzer::AssignCpus() {
+  if (!ThreadAffinitySupported()) {
+    WARN("-cpu_affinity: threads can't be pinned on this platform, ignoring");
+    return;
+  }
+
+  std::vector<int> cpus = GetThreadAffinity();
+  if (cpus.size() < num_threads) {
+    WARN("-cpu_affinity: %d threads but only %d cpus available, not pinning threads",
+         (int)num_threads, (int)cpus.size());
+    return;
+  }
+
+  std::vector<double> load = GetCpuLoad(CPU_LOAD_INTERVAL_MS);
+  auto cpu_load = [&load](int cpu) {
+    return ((size_t)cpu < load.size()) ? load[cpu] : 0.0;
+  };
+  // idle cpus keep their order, busy ones are used least busy first
+  std::stable_sort(cpus.begin(), cpus.end(), [&cpu_load](int a, int b) {
+    bool a_busy = cpu_load(a) > CPU_BUSY_THRESHOLD;
+    bool b_busy = cpu_load(b) > CPU_BUSY_THRESHOLD;
+    if (a_busy != b_busy) return b_busy;
+    return a_busy && (cpu_load(a) < cpu_load(b));
+  });
+
+  thread_cpus.assign(cpus.begin(), cpus.begin() + num_threads);
+  last_thread_execs.resize(num_threads);
+
+  size_t num_busy = 0;
+  for (size_t i = 0; i < thread_cpus.size(); i++) {
+    if (cpu_load(thread_cpus[i]) > CPU_BUSY_THRESHOLD) num_busy++;
+  }
+  if (num_busy) {
+    WARN("-cpu_affinity: %d of the assigned cpus are busy", (int)num_busy);
+  }
+}
+
+// threads that couldn't be pinned have -1 in thread_cpus
+void Fuzzer::ReportPinnedThreads() {
+  size_t num_pinned = 0;
+  std::string cpu_list;
+  for (size_t i = 0; i < thread_cpus.size(); i++) {
+    if (thread_cpus[i] < 0) continue;
+    if (num_pinned) cpu_list += ",";
+    cpu_list += std::to_string(thread_cpus[i]);
+    num_pinned++;
+  }
+  if (num_pinned < thread_cpus.size()) {
+    WARN("-cpu_affinity: %d of %d fuzzing threads could not be pinned",
+         (int)(thread_cpus.size() - num_pinned), (int)thread_cpus.size());
+  }
+  if (!num_pinned) {
+    // no per-cpu rates either
+    thread_cpus.clear();
+    return;
+  }
+  SAY("Fuzzing threads pinned to cpus %s\n", cpu_list.c_str());
+}
+
+void Fuzzer::PrintCpuExecRates(uint32_t secs) {
+  std::string rates;
+  for (size_t i = 0; i < thread_cpus.size(); i++) {
+    if (thread_cpus[i] < 0) continue;
+    uint64_t execs = thread_stats[i] ? thread_stats[i]->execs.load(std::memory_order_relaxed) : 0;
+    rates += " " + std::to_string(thread_cpus[i]) + ":" + std::to_string((execs - last_thread_execs[i]) / secs);
+    last_thread_execs[i] = execs;
+  }
+  printf("Execs/s per cpu:%s\n", rates.c_str());
+}
+
+// called by fuzzing threads after every fuzz job
+void Fuzzer::PublishMutatorState(ThreadContext *tc) {
+  std::string state;
+  if (!tc->mutator->SaveState(state)) return;
+  std::vector<MutatorStats> stats;
+  tc->mutator->GetStats(stats);
+
+  journal_mutex.Lock();
+  mutator_states[tc->thread_id] = state;
+  mutator_stats[tc->thread_id] = stats;
+  mutator_states_changed = true;
+  journal_mutex.Unlock();
+}
+
+// sums over the threads, weights are averaged
+void Fuzzer::MergeMutatorStats(std::vector<MutatorStats> &stats) {
+  std::map<std::string, size_t> index;
+  journal_mutex.Lock();
+  for (auto iter = mutator_stats.begin(); iter != mutator_stats.end(); iter++) {
+    for (auto &thread_stats : iter->second) {
+      auto index_iter = index.find(thread_stats.name);
+      if (index_iter == index.end()) {
+        index[thread_stats.name] = stats.size();
+        stats.push_back(thread_stats);
+        continue;
+      }
+      MutatorStats &merged = stats[index_iter->second];
+      merged.execs += thread_stats.execs;
+      merged.finds += thread_stats.finds;
+      merged.weight += thread_stats.weight;
+    }
+  }
+  size_t num_threads_published = mutator_stats.size();
+  journal_mutex.Unlock();
+
+  for (auto &merged : stats) merged.weight /= num_threads_published;
+}
+
+void Fuzzer::PrintMutatorStats() {
+  std::vector<MutatorStats> stats;
+  MergeMutatorStats(stats);
+  if (stats.empty()) return;
+
+  std::string line;
+  char buf[128];
+  for (auto &merged : stats) {
+    snprintf(buf, sizeof(buf), " %s %llu/%llu %.0f%%", merged.name.c_str(),
+             (unsigned long long)merged.finds, (unsigned long long)merged.execs,
+             merged.weight * 100);
+    line += buf;
+  }
+  printf("Mutators (finds/execs, weight):%s\n", line.c_str());
+}
+
+// per-operator yield, rewritten like fuzzer_stats
+void Fuzzer::WriteMutatorStats() {
+  std::vector<MutatorStats> stats;
+  MergeMutatorStats(stats);
+  if (stats.empty()) return;
+
+  std::string stats_file = DirJoin(out_dir, "mutator_stats");
+  std::string tmp_file = stats_file + ".tmp";
+
+  FILE *fp = fopen(tmp_file.c_str(), "w");
+  if (!fp) {
+    WARN("Error writing %s", tmp_file.c_str());
+    return;
+  }
+  fprintf(fp, "# mutator execs finds finds_per_million weight\n");
+  for (auto &merged : stats) {
+    fprintf(fp, "%-24s %14llu %10llu %12.2f %8.4f\n", merged.name.c_str(),
+            (unsigned long long)merged.execs, (unsigned long long)merged.finds,
+            merged.execs ? merged.finds * 1000000.0 / merged.execs : 0.0, merged.weight);
+  }
+  fclose(fp);
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  MoveFileExA(tmp_file.c_str(), stats_file.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  rename(tmp_file.c_str(), stats_file.c_str());
+#endif
+}
+
+// full per-thread phase histograms, rewritten like fuzzer_stats
+void Fuzzer::WriteProfileStats() {
+  std::string profile_file = DirJoin(out_dir, "profile_stats");
+  std::string tmp_file = profile_file + ".tmp";
+
+  FILE *fp = fopen(tmp_file.c_str(), "w");
+  if (!fp) {
+    WARN("Error writing %s", tmp_file.c_str());
+    return;
+  }
+  WriteProfile(fp, thread_profiles.data(), thread_profiles.size());
+  fclose(fp);
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  MoveFileExA(tmp_file.c_str(), profile_file.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  rename(tmp_file.c_str(), profile_file.c_str());
+#endif
+}
+
+void Fuzzer::AppendPlotData(uint64_t execs_per_sec) {
+  fprintf(plot_fp, "%llu, %llu, %llu, %llu, %llu, %llu, %llu, %llu, %llu, %llu, %llu\n",
+          (unsigned long long)time(NULL),
+          (unsigned long long)((GetCurTime() - start_time_ms) / 1000),
+          (unsigned long long)GetTotalExecs(), (unsigned long long)execs_per_sec,
+          (unsigned long long)num_samples, (unsigned long long)num_favored,
+          (unsigned long long)num_offsets, (unsigned long long)num_crashes,
+          (unsigned long long)num_unique_crashes, (unsigned long long)num_hangs,
+          (unsigned long long)sample_queue.Size());
+  fflush(plot_fp);
+}
+
+// microsecond timer for measuring individual executions
+static uint64_t GetCurTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Fuzzer::ShouldStop() {
+  return should_stop;
+}
+
+RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, CoverageBitmap *coverage, uint32_t init_timeout, uint32_t timeout) {
+  tc->stats->AddExecs(1);
+
+  uint64_t exec_start_us = GetCurTimeUs();
+
+  {
+    ProfileScope scope(tc->profile, PHASE_DELIVER);
     if (!tc->sampleDelivery->DeliverSample(sample)) {
-      FATAL("Repeatedly failed to deliver sample");
+      WARN("Error delivering sample, retrying with a clean target");
+      tc->instrumentation->CleanTarget();
+      if (!tc->sampleDelivery->DeliverSample(sample)) {
+        FATAL("Repeatedly failed to deliver sample");
+      }
     }
   }
 
+  uint64_t run_start_ns = tc->profile ? ProfileNow() : 0;
+
   RunResult result = tc->instrumentation->Run(tc->target_argc, tc->target_argv, init_timeout, timeout);
-  tc->instrumentation->GetCoverage(*coverage, true);
+
+  if (tc->profile) {
+    uint64_t run_ns = ProfileNow() - run_start_ns;
+    uint64_t start_ns = tc->instrumentation->GetTargetStartTime();
+    if (start_ns) tc->profile->Add(PHASE_TARGET_START, start_ns);
+    tc->profile->Add(PHASE_RUN, (run_ns > start_ns) ? (run_ns - start_ns) : 0);
+  }
+
+  tc->last_exec_us = GetCurTimeUs() - exec_start_us;
+  tc->exec_time_histogram->Add(tc->last_exec_us);
+
+  // most executions find nothing new, only materialize
+  // the coverage (the rest of the fuzzer works on bitmaps) when they do
+  {
+    ProfileScope scope(tc->profile, PHASE_COVERAGE);
+    if (tc->instrumentation->HasNewCoverage()) {
+      Coverage instrumentation_coverage;
+      tc->instrumentation->GetCoverage(instrumentation_coverage, true);
+      CoverageToBitmap(instrumentation_coverage, *coverage);
+    } else {
+      tc->instrumentation->ClearCoverage();
+      coverage->clear();
+    }
+  }
 
   // save crashes and hangs immediately when they are detected
   if (result == CRASH) {
     string crash_desc = tc->instrumentation->GetCrashName();
-
-    if (TryReproduceCrash(tc, sample, init_timeout, timeout) == CRASH) {
-      // get a hopefully better name
-      crash_desc = tc->instrumentation->GetCrashName();
+    if (num_triage_threads) {
+      QueueCrash(tc, sample, crash_desc, init_timeout, timeout);
     } else {
-      crash_desc = "flaky_" + crash_desc;
+      TriageCrash(tc, sample, crash_desc, init_timeout, timeout);
     }
-    
-    bool should_save_crash = false;
-    int duplicates = 0;
-    
-    crash_mutex.Lock();
-    num_crashes++;
+  }
 
-    auto crash_it = unique_crashes.find(crash_desc);
-    if(crash_it == unique_crashes.end()) {
-      should_save_crash = true;
-      duplicates = 1;
-      unique_crashes[crash_desc] = 1;
-      num_unique_crashes++;
-    } else {
-      if(crash_it->second < MAX_IDENTICAL_CRASHES) {
-        should_save_crash = true;
-        crash_it->second++;
-        duplicates = crash_it->second;
+  if (result == HANG) {
+    if (hang_timeout > timeout) {
+      // only a suspected hang with the tight fuzzing timeout
+      if (num_triage_threads) {
+        QueueHang(tc, sample, init_timeout, timeout);
+      } else {
+        ConfirmHang(tc, sample, init_timeout);
       }
+    } else {
+      SaveHang(sample);
     }
-    crash_mutex.Unlock();
+  }
 
-    if(should_save_crash) {
-      string crash_filename = crash_desc + "_" + std::to_string(duplicates);
-      
-      output_mutex.Lock();
-      string outfile = DirJoin(crash_dir, crash_filename);
-      sample->Save(outfile.c_str());
-      output_mutex.Unlock();
+  return result;
+}
 
-      if (server) {
-        server_mutex.Lock();
-        server->ReportCrash(sample, crash_desc);
-        server_mutex.Unlock();
-      }
+void Fuzzer::SaveHang(Sample *sample) {
+  output_mutex.Lock();
+  if (save_hangs) {
+    string outfile = DirJoin(hangs_dir, string("hang_") + std::to_string(num_hangs));
+    sample->Save(outfile.c_str());
+  }
+  num_hangs++;
+  output_mutex.Unlock();
+}
+
+// reruns a suspected hang with the longer timeout
+void Fuzzer::ConfirmHang(ThreadContext *tc, Sample *sample, uint32_t init_timeout) {
+  tc->stats->AddExecs(1);
+
+  if (!tc->sampleDelivery->DeliverSample(sample)) {
+    WARN("Error delivering sample, retrying with a clean target");
+    tc->instrumentation->CleanTarget();
+    if (!tc->sampleDelivery->DeliverSample(sample)) {
+      FATAL("Repeatedly failed to deliver sample");
     }
   }
 
+  RunResult result = tc->instrumentation->Run(tc->target_argc, tc->target_argv, init_timeout, hang_timeout);
+  tc->instrumentation->ClearCoverage();
+
   if (result == HANG) {
-    output_mutex.Lock();
-    if (save_hangs) {
-      string outfile = DirJoin(hangs_dir, string("hang_") + std::to_string(num_hangs));
-      sample->Save(outfile.c_str());
+    SaveHang(sample);
+  } else {
+    num_hangs_unconfirmed++;
+  }
+}
+
+// reproduces, names, deduplicates and saves a crash
+// and reports it to the server
+void Fuzzer::TriageCrash(ThreadContext *tc, Sample *sample, std::string crash_desc, uint32_t init_timeout, uint32_t timeout) {
+  if (TryReproduceCrash(tc, sample, init_timeout, timeout) == CRASH) {
+    // get a hopefully better name
+    crash_desc = tc->instrumentation->GetCrashName();
+  } else {
+    crash_desc = "flaky_" + crash_desc;
+  }
+  
+  bool should_save_crash = false;
+  int duplicates = 0;
+  
+  crash_mutex.Lock();
+  num_crashes++;
+
+  auto crash_it = unique_crashes.find(crash_desc);
+  if(crash_it == unique_crashes.end()) {
+    should_save_crash = true;
+    duplicates = 1;
+    unique_crashes[crash_desc] = 1;
+    num_unique_crashes++;
+  } else {
+    if(crash_it->second < MAX_IDENTICAL_CRASHES) {
+      should_save_crash = true;
+      crash_it->second++;
+      duplicates = crash_it->second;
     }
-    num_hangs++;
+  }
+  crash_mutex.Unlock();
+
+  if(should_save_crash) {
+    string crash_filename = crash_desc + "_" + std::to_string(duplicates);
+    
+    output_mutex.Lock();
+    string outfile = DirJoin(crash_dir, crash_filename);
+    sample->Save(outfile.c_str());
     output_mutex.Unlock();
+
+    if (server) {
+      server_mutex.Lock();
+      server->ReportCrash(sample, crash_desc);
+      server_mutex.Unlock();
+    }
   }
+}
 
-  return result;
+// returns false if the triage threads are gone or too far behind,
+// and the caller has to handle the job itself
+bool Fuzzer::EnqueueTriageJob(Sample *sample, const std::string &crash_desc, bool is_hang, uint32_t init_timeout, uint32_t timeout) {
+  triage_mutex.Lock();
+
+  if (triage_closed) {
+    triage_mutex.Unlock();
+    return false;
+  }
+
+  // backpressure, the fuzzing thread triages this one inline
+  // rather than queueing without bound
+  if (triage_queue.size() >= TRIAGE_MAX_PENDING) {
+    triage_mutex.Unlock();
+    num_triaged_inline++;
+    return false;
+  }
+
+  TriageJob *job = new TriageJob();
+  job->sample = new Sample(*sample);
+  job->crash_desc = crash_desc;
+  job->is_hang = is_hang;
+  job->queued_time_us = GetCurTimeUs();
+  job->init_timeout = init_timeout;
+  job->timeout = timeout;
+  triage_queue.push_back(job);
+  if (triage_queue.size() > triage_max_pending) triage_max_pending = triage_queue.size();
+  triage_cv.Signal();
+
+  triage_mutex.Unlock();
+  return true;
+}
+
+void Fuzzer::QueueCrash(ThreadContext *tc, Sample *sample, std::string &crash_desc, uint32_t init_timeout, uint32_t timeout) {
+  if (!EnqueueTriageJob(sample, crash_desc, false, init_timeout, timeout)) {
+    TriageCrash(tc, sample, crash_desc, init_timeout, timeout);
+  }
+}
+
+void Fuzzer::QueueHang(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout) {
+  if (!EnqueueTriageJob(sample, "", true, init_timeout, timeout)) {
+    ConfirmHang(tc, sample, init_timeout);
+  }
+}
+
+void Fuzzer::RunTriageThread(ThreadContext *tc) {
+  triage_mutex.Lock();
+  while (1) {
+    if (triage_queue.empty()) {
+      // pending crashes are still handled after a stop request
+      if (ShouldStop()) break;
+      triage_cv.Wait(&triage_mutex, 1000);
+      continue;
+    }
+
+    TriageJob *job = triage_queue.front();
+    triage_queue.pop_front();
+    triage_mutex.Unlock();
+
+    if (job->is_hang) {
+      ConfirmHang(tc, job->sample, job->init_timeout);
+    } else {
+      TriageCrash(tc, job->sample, job->crash_desc, job->init_timeout, job->timeout);
+    }
+    num_triaged++;
+
+    triage_mutex.Lock();
+    triage_latency.Add((GetCurTimeUs() - job->queued_time_us) / 1000);
+    delete job->sample;
+    delete job;
+  }
+  triage_closed = true;
+  triage_mutex.Unlock();
+
+  delete tc;
+  num_running_threads--;
+}
+
+void Fuzzer::PrintTriageStats() {
+  triage_mutex.Lock();
+  size_t pending = triage_queue.size();
+  size_t max_pending = triage_max_pending;
+  uint64_t latency_p50 = triage_latency.Percentile(0.5);
+  uint64_t latency_p99 = triage_latency.Percentile(0.99);
+  triage_mutex.Unlock();
+
+  printf("Crash triage: %zu pending (max %zu), %llu done, %llu inline, latency p50 %llu ms, p99 %llu ms\n",
+         pending, max_pending, (unsigned long long)num_triaged,
+         (unsigned long long)num_triaged_inline,
+         (unsigned long long)latency_p50, (unsigned long long)latency_p99);
 }
 
 RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t init_timeout, uint32_t timeout) {
   RunResult result;
 
   for (int i = 0; i < CRASH_REPRODUCE_TIMES; i++) {
-    total_execs++;
+    tc->stats->AddExecs(1);
 
     if (!tc->sampleDelivery->DeliverSample(sample)) {
       WARN("Error delivering sample, retrying with a clean target");
@@ -298,18 +985,20 @@ RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t
 }
 
 RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_coverage, bool trim, bool report_to_server, uint32_t init_timeout, uint32_t timeout) {
-  Sample filteredSample;
-  if (OutputFilter(sample, &filteredSample)) {
-    sample = &filteredSample;
+  if (OutputFilter(sample, &tc->filtered_sample)) {
+    sample = &tc->filtered_sample;
   }
 
   if (has_new_coverage) {
     *has_new_coverage = 0;
   }
 
-  Coverage initialCoverage;
+  SyncIgnoredCoverage(tc);
+
+  CoverageBitmap initialCoverage;
 
   RunResult result = RunSampleAndGetCoverage(tc, sample, &initialCoverage, init_timeout, timeout);
+  tc->sample_exec_us = tc->last_exec_us;
 
   if (result != OK) return result;
 
@@ -320,28 +1009,103 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
 
   // the sample returned new coverage
 
-  Coverage stableCoverage = initialCoverage;
-  Coverage totalCoverage = initialCoverage;
+  // offsets already known to be variable don't need calibration,
+  // if that's all the sample hit, just stop seeing them in this thread
+  // the same goes for offsets that another thread found since
+  // this thread last caught up with the coverage log
+  CoverageBitmap unknownCoverage;
+  CoverageBitmap claimCoverage;
+  bool already_found = false;
+  bool claimed_elsewhere = false;
+  LockProfiled(tc, coverage_mutex);
+  CoverageDifference(variable_coverage, initialCoverage, unknownCoverage);
+  if (!unknownCoverage.empty() && tc->follows_coverage_log) {
+    already_found = CoverageContains(fuzzer_coverage, unknownCoverage);
+  }
+  if (!unknownCoverage.empty() && !already_found) {
+    // claim the offsets nobody else is calibrating at the moment,
+    // if there aren't any, the other thread takes care of the sample
+    CoverageBitmap newCoverage;
+    CoverageDifference(fuzzer_coverage, unknownCoverage, newCoverage);
+    CoverageDifference(claimed_coverage, newCoverage, claimCoverage);
+    if (claimCoverage.empty()) {
+      claimed_elsewhere = !newCoverage.empty();
+    } else {
+      MergeCoverage(claimed_coverage, claimCoverage);
+    }
+  }
+  coverage_mutex.Unlock();
+  if (claimed_elsewhere) {
+    // not ignored, in case the other thread's calibration fails
+    num_calibrations_claimed++;
+    return result;
+  }
+  if (unknownCoverage.empty() || already_found) {
+    if (already_found) {
+      num_calibrations_deduplicated++;
+    } else {
+      num_calibrations_skipped++;
+    }
+    ProfileScope scope(tc->profile, PHASE_IGNORE_COVERAGE);
+    Coverage ignore_coverage;
+    BitmapToCoverage(initialCoverage, ignore_coverage);
+    tc->instrumentation->IgnoreCoverage(ignore_coverage);
+    return result;
+  }
+
+  CoverageBitmap stableCoverage = initialCoverage;
+  CoverageBitmap totalCoverage = initialCoverage;
+
+  uint64_t calibration_start = GetCurTime();
+  uint64_t calibration_start_ns = tc->profile ? ProfileNow() : 0;
+  uint64_t reruns_exec_us = 0;
+  num_calibrations++;
 
   // have a clean target before retrying the sample
   tc->instrumentation->CleanTarget();
 
+  // rerun until neither stable nor total coverage changed
+  // for calibration_converge_runs consecutive runs
+  int num_reruns = 0;
+  int unchanged_runs = 0;
   for (int i = 0; i < SAMPLE_RETRY_TIMES; i++) {
-    Coverage retryCoverage, tmpCoverage;
+    CoverageBitmap retryCoverage, tmpCoverage;
 
     result = RunSampleAndGetCoverage(tc, sample, &retryCoverage, init_timeout, timeout);
-    if (result != OK) return result;
+    reruns_exec_us += tc->last_exec_us;
+    num_reruns++;
+    if (result != OK) break;
 
     // printf("Retry %d, coverage:\n", i);
     // PrintCoverage(retryCoverage);
 
+    if (CoverageContains(totalCoverage, retryCoverage) &&
+        CoverageContains(retryCoverage, stableCoverage))
+    {
+      unchanged_runs++;
+      if (unchanged_runs >= calibration_converge_runs) break;
+      continue;
+    }
+    unchanged_runs = 0;
+
     MergeCoverage(totalCoverage, retryCoverage);
     CoverageIntersection(stableCoverage, retryCoverage, tmpCoverage);
 
-    stableCoverage = tmpCoverage;
+    stableCoverage.swap(tmpCoverage);
   }
 
-  Coverage variableCoverage;
+  uint64_t exec_us = reruns_exec_us / num_reruns;
+  num_calibration_runs += num_reruns;
+  num_calibration_runs_saved += SAMPLE_RETRY_TIMES - num_reruns;
+  calibration_time_ms += GetCurTime() - calibration_start;
+  if (tc->profile) tc->profile->Add(PHASE_CALIBRATE, ProfileNow() - calibration_start_ns);
+
+  if (result != OK) {
+    ReleaseCoverageClaim(claimCoverage);
+    return result;
+  }
+
+  CoverageBitmap variableCoverage;
   CoverageDifference(stableCoverage, totalCoverage, variableCoverage);
 
   // printf("Stable coverage:\n");
@@ -349,12 +1113,19 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
   // printf("Variable coverage:\n");
   // PrintCoverage(variableCoverage);
 
-  if (InterestingSample(tc, sample, &stableCoverage, &variableCoverage)) {
+  int interesting = InterestingSample(tc, sample, &stableCoverage, &variableCoverage);
+  // whatever was new is in fuzzer_coverage now
+  ReleaseCoverageClaim(claimCoverage);
+
+  if (interesting) {
     if (has_new_coverage) {
       *has_new_coverage = 1;
     }
 
-    if (trim) TrimSample(tc, sample, &stableCoverage, init_timeout, timeout);
+    if (trim) {
+      ProfileScope scope(tc->profile, PHASE_TRIM);
+      TrimSample(tc, sample, &stableCoverage, init_timeout, timeout);
+    }
 
     output_mutex.Lock();
     char fileindex[20];
@@ -365,8 +1136,10 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
     output_mutex.Unlock();
 
     if (server && report_to_server) {
+      Coverage server_coverage;
+      BitmapToCoverage(stableCoverage, server_coverage);
       server_mutex.Lock();
-      server->ReportNewCoverage(&stableCoverage, sample);
+      server->ReportNewCoverage(&server_coverage, sample);
       server_mutex.Unlock();
     }
 
@@ -375,80 +1148,209 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
     new_entry->sample = new_sample;
     new_entry->context = tc->mutator->CreateSampleContext(new_entry->sample);
     new_entry->context_initialized = true;
-    new_entry->priority = 0;
     new_entry->sample_index = num_samples - 1;
+    new_entry->exec_us = exec_us;
+    new_entry->total_exec_us = reruns_exec_us;
+    new_entry->num_timed_runs = num_reruns;
+    new_entry->num_new_offsets = CoverageCount(stableCoverage);
+    schedule->AddEntry(new_entry);
+    AddCullCandidate(new_sample, new_entry->sample_index);
 
     queue_mutex.Lock();
     all_samples.push_back(new_sample);
-    sample_queue.push(new_entry);
+    num_all_samples = all_samples.size();
     queue_mutex.Unlock();
+
+    JournalEntryState(new_entry);
+
+    // new entries go to the shard of the thread that found them
+    sample_queue.Push(tc->thread_id - 1, new_entry);
   } 
   
   if (!variableCoverage.empty() && server && report_to_server) {
+    Coverage server_coverage;
+    BitmapToCoverage(variableCoverage, server_coverage);
     server_mutex.Lock();
-    server->ReportNewCoverage(&variableCoverage, NULL);
+    server->ReportNewCoverage(&server_coverage, NULL);
     server_mutex.Unlock();
   }
 
   // printf("Total coverage:\n");
   // PrintCoverage(totalCoverage);
 
-  tc->instrumentation->IgnoreCoverage(totalCoverage);
+  {
+    ProfileScope scope(tc->profile, PHASE_IGNORE_COVERAGE);
+    Coverage ignore_coverage;
+    BitmapToCoverage(totalCoverage, ignore_coverage);
+    tc->instrumentation->IgnoreCoverage(ignore_coverage);
+  }
+
+  return result;
+}
 
-  return result;
+bool Fuzzer::TrimBudgetExceeded(TrimState *trim_state) {
+  if (trim_max_execs && (trim_state->num_execs >= trim_max_execs)) return true;
+  if (trim_max_time_ms && ((GetCurTime() - trim_state->start_time) >= trim_max_time_ms)) return true;
+  return false;
 }
 
-void Fuzzer::TrimSample(ThreadContext *tc, Sample *sample, Coverage* stable_coverage, uint32_t init_timeout, uint32_t timeout) {
-  if (sample->size <= 1) return;
+// returns true if the candidate runs without issues
+// and still hits all of the stable coverage
+bool Fuzzer::TryTrimCandidate(ThreadContext *tc, Sample *candidate, TrimState *trim_state, uint32_t init_timeout, uint32_t timeout) {
+  uint64_t hash = candidate->Hash();
+  auto iter = trim_state->tested.find(hash);
+  // hashes can collide, so the samples are compared as well
+  if ((iter != trim_state->tested.end()) &&
+      (iter->second.sample.size == candidate->size) &&
+      !memcmp(iter->second.sample.bytes, candidate->bytes, candidate->size)) {
+    num_trim_cache_hits++;
+    return iter->second.result;
+  }
 
-  int trim_step = TRIM_STEP_INITIAL;
+  CoverageBitmap test_coverage;
+  RunResult result = RunSampleAndGetCoverage(tc, candidate, &test_coverage, init_timeout, timeout);
+  trim_state->num_execs++;
+  num_trim_execs++;
+
+  bool ret = (result == OK) && CoverageContains(test_coverage, *trim_state->stable_coverage);
+  // once the cache is full (or on a collision), the
+  // candidate just runs again if it comes up again
+  if ((iter == trim_state->tested.end()) &&
+      (trim_state->tested_size + candidate->size <= TRIM_CACHE_MAX_SIZE)) {
+    TrimCacheEntry &entry = trim_state->tested[hash];
+    entry.sample = *candidate;
+    entry.result = ret;
+    trim_state->tested_size += candidate->size;
+  }
+  return ret;
+}
 
-  size_t trimmed_size = sample->size;
-  Sample test_sample = *sample;
+// delta-debugging style minimization, removes chunks
+// from anywhere in the sample at decreasing granularity
+// and then tries to normalize the remaining bytes,
+// every step has to preserve stable_coverage
+void Fuzzer::TrimSample(ThreadContext *tc, Sample *sample, CoverageBitmap* stable_coverage, uint32_t init_timeout, uint32_t timeout) {
+  if (sample->size <= 1) return;
 
-  while (1) {
-    if (test_sample.size <= 1) break;
-    while (trim_step >= test_sample.size) {
-      trim_step /= 2;
+  TrimState trim_state;
+  trim_state.stable_coverage = stable_coverage;
+  trim_state.num_execs = 0;
+  trim_state.start_time = GetCurTime();
+
+  size_t original_size = sample->size;
+  Sample current = *sample;
+  TrimCacheEntry &entry = trim_state.tested[current.Hash()];
+  entry.sample = current;
+  entry.result = true;
+  trim_state.tested_size = current.size;
+  // the buffers of both get reused for all candidates
+  Sample candidate;
+
+  // start with half of the sample, rounded up to a power of two
+  size_t chunk_size = 1;
+  while (chunk_size * 2 < current.size) chunk_size *= 2;
+
+  while (chunk_size >= 1) {
+    size_t pos = 0;
+    while ((pos < current.size) && (current.size > 1)) {
+      if (TrimBudgetExceeded(&trim_state)) break;
+
+      size_t remove_size = chunk_size;
+      if (pos + remove_size > current.size) remove_size = current.size - pos;
+      if (remove_size == current.size) break;
+
+      candidate = current;
+      candidate.Remove(pos, remove_size);
+
+      if (TryTrimCandidate(tc, &candidate, &trim_state, init_timeout, timeout)) {
+        // keep pos, the next chunk moved here
+        current = candidate;
+      } else {
+        pos += chunk_size;
+      }
     }
-    if (trim_step == 0) break;
+    if (TrimBudgetExceeded(&trim_state)) break;
+    chunk_size /= 2;
+  }
 
-    test_sample.Trim(test_sample.size - trim_step);
+  if (trim_normalize) {
+    chunk_size = 1;
+    while (chunk_size * 2 < current.size) chunk_size *= 2;
 
-    Coverage test_coverage;
+    while ((chunk_size >= 1) && !TrimBudgetExceeded(&trim_state)) {
+      for (size_t pos = 0; pos < current.size; pos += chunk_size) {
+        if (TrimBudgetExceeded(&trim_state)) break;
 
-    RunResult result = RunSampleAndGetCoverage(tc, &test_sample, &test_coverage, init_timeout, timeout);
-    if (result != OK) break;
+        size_t normalize_size = chunk_size;
+        if (pos + normalize_size > current.size) normalize_size = current.size - pos;
 
-    if (!CoverageContains(test_coverage, *stable_coverage)) {
-      trim_step /= 2;
-      if (trim_step == 0) break;
+        bool already_normalized = true;
+        for (size_t i = pos; i < pos + normalize_size; i++) {
+          if (current.bytes[i] != TRIM_NORMALIZE_BYTE) {
+            already_normalized = false;
+            break;
+          }
+        }
+        if (already_normalized) continue;
 
-      test_sample = *sample;
-      test_sample.Trim(trimmed_size);
-      continue;
-    }
+        candidate = current;
+        memset(candidate.bytes + pos, TRIM_NORMALIZE_BYTE, normalize_size);
 
-    trimmed_size = test_sample.size;
+        if (TryTrimCandidate(tc, &candidate, &trim_state, init_timeout, timeout)) {
+          current = candidate;
+        }
+      }
+      chunk_size /= 2;
+    }
   }
 
-  if (trimmed_size < sample->size) {
-    sample->Trim(trimmed_size);
-  }
+  *sample = current;
+  num_trim_bytes_saved += original_size - current.size;
 }
 
 
-int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage) {
-  coverage_mutex.Lock();
+int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, CoverageBitmap *stableCoverage, CoverageBitmap *variableCoverage) {
+  LockProfiled(tc, coverage_mutex);
 
-  Coverage new_stable_coverage;
-  Coverage new_variable_coverage;
+  CoverageBitmap new_stable_coverage;
+  CoverageBitmap new_variable_coverage;
 
   CoverageDifference(fuzzer_coverage, *stableCoverage, new_stable_coverage);
   CoverageDifference(fuzzer_coverage, *variableCoverage, new_variable_coverage);
 
   MergeCoverage(fuzzer_coverage, new_stable_coverage);
   MergeCoverage(fuzzer_coverage, new_variable_coverage);
+  num_offsets += CoverageCount(new_stable_coverage) + CoverageCount(new_variable_coverage);
+
+  if (!new_stable_coverage.empty() || !new_variable_coverage.empty()) {
+    coverage_log.emplace_back(new_stable_coverage);
+    MergeCoverage(coverage_log.back(), new_variable_coverage);
+    coverage_log_size = coverage_log_start + coverage_log.size();
+  }
+
+  // remember flaky offsets, including ones previously
+  // believed to be stable
+  MergeCoverage(variable_coverage, *variableCoverage);
+
+  if (!new_stable_coverage.empty() || !new_variable_coverage.empty() || !variableCoverage->empty()) {
+    std::string data;
+    journal_mutex.Lock();
+    if (!new_stable_coverage.empty()) {
+      WriteCoverageBinary(new_stable_coverage, data);
+      journal.Append(JOURNAL_COVERAGE, data);
+      data.clear();
+    }
+    if (!new_variable_coverage.empty()) {
+      WriteCoverageBinary(new_variable_coverage, data);
+      journal.Append(JOURNAL_COVERAGE, data);
+      data.clear();
+    }
+    if (!variableCoverage->empty()) {
+      WriteCoverageBinary(*variableCoverage, data);
+      journal.Append(JOURNAL_VARIABLE_COVERAGE, data);
+    }
+    journal_mutex.Unlock();
+  }
 
   coverage_mutex.Unlock();
 
@@ -457,74 +1359,239 @@ int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stabl
   // printf("New variable coverage:\n");
   // PrintCoverage(new_variable_coverage);
 
-  *stableCoverage = new_stable_coverage;
-  *variableCoverage = new_variable_coverage;
+  stableCoverage->swap(new_stable_coverage);
+  variableCoverage->swap(new_variable_coverage);
 
-  if (!new_stable_coverage.empty()) return 1;
+  if (!stableCoverage->empty()) return 1;
 
   return 0;
 }
 
+// merges the per-thread histograms, prints them and
+// makes the median available to the fuzzing threads and the schedule
+void Fuzzer::UpdateExecTimeStats() {
+  Histogram total;
+  std::string per_thread;
+  for (size_t i = 0; i < exec_time_histograms.size(); i++) {
+    Histogram *histogram = exec_time_histograms[i];
+    if (!histogram || !histogram->Count()) continue;
+    total.Merge(*histogram);
+    per_thread += " " + std::to_string(i + 1) + ":" +
+                  std::to_string(histogram->Percentile(0.5)) + "/" +
+                  std::to_string(histogram->Percentile(0.99));
+  }
+  if (!total.Count()) return;
+
+  median_exec_us = total.Percentile(0.5);
+  schedule->SetReferenceExecTime(median_exec_us);
+
+  printf("Exec time (us): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+         (unsigned long long)median_exec_us, (unsigned long long)total.Percentile(0.9),
+         (unsigned long long)total.Percentile(0.99), (unsigned long long)total.Max());
+  printf("Exec time per thread (p50/p99):%s\n", per_thread.c_str());
+  printf("Slow entries: %llu jobs with reduced energy, %llu discarded\n",
+         (unsigned long long)num_slow_jobs, (unsigned long long)num_quarantined);
+}
+
+void Fuzzer::PrintStability() {
+  coverage_mutex.Lock();
+  for (auto iter = fuzzer_coverage.begin(); iter != fuzzer_coverage.end(); iter++) {
+    size_t num_offsets = iter->Count();
+    size_t num_variable = 0;
+    ModuleCoverageBitmap *module_variable = GetModuleCoverage(variable_coverage, iter->module_name);
+    if (module_variable) num_variable = module_variable->Count();
+    printf("  %s: %zu offsets, %zu variable, %.2f%% stable\n",
+           iter->module_name.c_str(), num_offsets, num_variable,
+           num_offsets ? 100.0 * (num_offsets - num_variable) / num_offsets : 100.0);
+  }
+  coverage_mutex.Unlock();
+}
+
+void Fuzzer::CalibrateTimeout() {
+  if (!auto_timeout || timeout_calibrated) return;
+
+  Histogram total;
+  for (size_t i = 0; i < exec_time_histograms.size(); i++) {
+    if (exec_time_histograms[i]) total.Merge(*exec_time_histograms[i]);
+  }
+  if (!total.Count()) {
+    WARN("No execution times to calibrate the timeout from");
+    return;
+  }
+
+  uint64_t new_timeout = (total.Percentile(0.99) * timeout_factor + 999) / 1000;
+  if (new_timeout < AUTO_TIMEOUT_MIN_MS) new_timeout = AUTO_TIMEOUT_MIN_MS;
+  if (new_timeout > corpus_timeout) new_timeout = corpus_timeout;
+  SetTimeout((uint32_t)new_timeout);
+  timeout_calibrated = true;
+
+  printf("Timeout calibrated to %u ms, hangs confirmed with %u ms\n",
+         (unsigned)timeout, (unsigned)hang_timeout);
+
+  uint32_t calibrated_timeout = timeout;
+  journal_mutex.Lock();
+  journal.Append(JOURNAL_TIMEOUT, &calibrated_timeout, sizeof(calibrated_timeout));
+  journal_mutex.Unlock();
+}
+
+void Fuzzer::SetTimeout(uint32_t new_timeout) {
+  timeout = new_timeout;
+  if (hang_timeout_set) return;
+  uint64_t confirm_timeout = (uint64_t)new_timeout * HANG_CONFIRM_FACTOR;
+  if (confirm_timeout < HANG_CONFIRM_MIN_MS) confirm_timeout = HANG_CONFIRM_MIN_MS;
+  if (confirm_timeout > corpus_timeout) confirm_timeout = corpus_timeout;
+  hang_timeout = (uint32_t)confirm_timeout;
+}
+
+// entries that are known to be slow get proportionally more time
+uint32_t Fuzzer::GetEntryTimeout(SampleQueueEntry *entry) {
+  uint32_t entry_timeout = timeout;
+  if (!timeout_calibrated) return entry_timeout;
+  uint64_t slow_timeout = (entry->exec_us * timeout_factor + 999) / 1000;
+  uint32_t max_timeout = hang_timeout;
+  if (slow_timeout > max_timeout) slow_timeout = max_timeout;
+  if (slow_timeout > entry_timeout) entry_timeout = (uint32_t)slow_timeout;
+  return entry_timeout;
+}
+
+void Fuzzer::LockProfiled(ThreadContext *tc, Mutex &mutex) {
+  ProfileScope scope(tc->profile, PHASE_LOCK_WAIT);
+  mutex.Lock();
+}
+
+void Fuzzer::ReleaseCoverageClaim(CoverageBitmap &claim) {
+  if (claim.empty()) return;
+  CoverageBitmap remaining;
+  coverage_mutex.Lock();
+  CoverageDifference(claim, claimed_coverage, remaining);
+  claimed_coverage.swap(remaining);
+  coverage_mutex.Unlock();
+}
+
+void Fuzzer::SyncIgnoredCoverage(ThreadContext *tc) {
+  if (!tc->follows_coverage_log) return;
+  if (coverage_log_size == tc->coverage_log_pos) return;
+
+  CoverageBitmap new_coverage;
+  LockProfiled(tc, coverage_mutex);
+  for (size_t i = tc->coverage_log_pos - coverage_log_start; i < coverage_log.size(); i++) {
+    MergeCoverage(new_coverage, coverage_log[i]);
+  }
+  // only the threads furthest behind hold on to the front entries
+  bool was_behind = (tc->coverage_log_pos == coverage_log_start);
+  tc->coverage_log_pos = coverage_log_start + coverage_log.size();
+  coverage_log_positions[tc->thread_id - 1] = tc->coverage_log_pos;
+  if (was_behind) TrimCoverageLog();
+  coverage_mutex.Unlock();
+
+  // includes what this thread found itself, ignoring that again is harmless
+  ProfileScope scope(tc->profile, PHASE_IGNORE_COVERAGE);
+  Coverage ignore_coverage;
+  BitmapToCoverage(new_coverage, ignore_coverage);
+  tc->instrumentation->IgnoreCoverage(ignore_coverage);
+}
+
+void Fuzzer::TrimCoverageLog() {
+  size_t min_pos = coverage_log_start + coverage_log.size();
+  for (size_t i = 0; i < coverage_log_positions.size(); i++) {
+    if (coverage_log_positions[i] < min_pos) min_pos = coverage_log_positions[i];
+  }
+  while (coverage_log_start < min_pos) {
+    coverage_log.pop_front();
+    coverage_log_start++;
+  }
+}
+
+bool Fuzzer::ServerUpdateDue() {
+  return server &&
+    (GetCurTime() > (last_server_update_time_ms + server_update_interval_ms));
+}
+
+void Fuzzer::UpdateMinPriority(double priority) {
+  double cur_min = min_priority;
+  while (priority < cur_min) {
+    if (min_priority.compare_exchange_weak(cur_min, priority)) break;
+  }
+}
+
 void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
-  queue_mutex.Lock();
+  // read before looking for work, so that a WAIT job
+  // doesn't miss a wakeup that happens in between
+  job->queue_version = sample_queue.GetVersion();
 
   // sync all_samples_local with all_samples
-  if (all_samples.size() > tc->all_samples_local.size()) {
+  if (num_all_samples > tc->all_samples_local.size()) {
+    LockProfiled(tc, queue_mutex);
     size_t old_size = tc->all_samples_local.size();
     tc->all_samples_local.resize(all_samples.size());
     for (size_t i = old_size; i < all_samples.size(); i++) {
       tc->all_samples_local[i] = all_samples[i];
     }
+    queue_mutex.Unlock();
+  }
+
+  // fast path, while fuzzing jobs are taken from the sharded
+  // queue and the global queue lock isn't needed
+  if ((state == FUZZING) && !ServerUpdateDue()) {
+    if (sample_queue.Pop(tc->thread_id - 1, &job->entry)) {
+      job->type = FUZZ;
+      UpdateMinPriority(job->entry->priority);
+    } else {
+      job->type = WAIT;
+    }
+    return;
   }
 
+  LockProfiled(tc, queue_mutex);
+
   // change state if needed
 
-  if ((state == FUZZING) && server &&
-    (GetCurTime() > (last_server_update_time_ms + server_update_interval_ms)))
-  {
+  if ((state == FUZZING) && ServerUpdateDue()) {
     last_server_update_time_ms = GetCurTime();
     server_mutex.Lock();
-    server->GetUpdates(&server_samples, total_execs);
+    server->GetUpdates(&server_samples, GetTotalExecs());
     server_mutex.Unlock();
     state = SERVER_SAMPLE_PROCESSING;
   }
 
   if (state == INPUT_SAMPLE_PROCESSING) {
     if (input_files.empty() && !samples_pending) {
-      if (sample_queue.empty()) {
+      if (sample_queue.Empty()) {
         FATAL("No interesting input files\n");
       }
       if (server) {
-        server_mutex.Lock();
+        Coverage server_coverage;
         coverage_mutex.Lock();
-        server->ReportNewCoverage(&fuzzer_coverage, NULL);
+        BitmapToCoverage(fuzzer_coverage, server_coverage);
         coverage_mutex.Unlock();
+        server_mutex.Lock();
+        server->ReportNewCoverage(&server_coverage, NULL);
         last_server_update_time_ms = GetCurTime();
-        server->GetUpdates(&server_samples, total_execs);
+        server->GetUpdates(&server_samples, GetTotalExecs());
         server_mutex.Unlock();
         state = SERVER_SAMPLE_PROCESSING;
       } else {
+        CalibrateTimeout();
         state = FUZZING;
       }
+      sample_queue.Notify();
     }
   }
   
   if (state == SERVER_SAMPLE_PROCESSING) {
     if (server_samples.empty() && !samples_pending) {
+      CalibrateTimeout();
       state = FUZZING;
+      sample_queue.Notify();
     }
   }
 
   if (state == FUZZING) {
-    if (sample_queue.empty()) {
-      job->type = WAIT;
-    } else {
+    if (sample_queue.Pop(tc->thread_id - 1, &job->entry)) {
       job->type = FUZZ;
-      job->entry = sample_queue.top();
-      sample_queue.pop();
-      if(job->entry->priority < min_priority) {
-        min_priority = job->entry->priority;
-      }
+      UpdateMinPriority(job->entry->priority);
+    } else {
+      job->type = WAIT;
     }
   } else if (state == INPUT_SAMPLE_PROCESSING) {
     if (input_files.empty()) {
@@ -559,26 +1626,44 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   queue_mutex.Unlock();
 }
 
-void Fuzzer::JobDone(FuzzerJob* job) {
-  queue_mutex.Lock();
-
+void Fuzzer::JobDone(ThreadContext* tc, FuzzerJob* job) {
   if (job->type == FUZZ) {
     if (job->discard_sample) {
+      JournalEntryDiscarded(job->entry->sample_index);
+      // the sample stays in all_samples for splicing
+      if (job->entry->context) delete job->entry->context;
       delete job->entry;
+      queue_mutex.Lock();
       num_samples_discarded++;
+      queue_mutex.Unlock();
     } else {
-      sample_queue.push(job->entry);
+      JournalEntryState(job->entry);
+      sample_queue.Push(tc->thread_id - 1, job->entry);
     }
+    PublishMutatorState(tc);
   } else if (job->type == PROCESS_SAMPLE) {
     delete job->sample;
+    queue_mutex.Lock();
     samples_pending--;
+    queue_mutex.Unlock();
+    // waiting threads might be able to change state now
+    sample_queue.Notify();
   }
-
-  queue_mutex.Unlock();
 }
 
 void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
   SampleQueueEntry* entry = job->entry;
+
+  if (cull_interval_secs) {
+    entry->favored = IsFavored(tc, entry->sample_index);
+    if (!entry->favored && (tc->prng->RandReal() < CULL_SKIP_PROBABILITY)) {
+      // move behind everything else in the queue
+      entry->priority = min_priority - 1;
+      num_cull_skips++;
+      job->discard_sample = false;
+      return;
+    }
+  }
   
   if(!entry->context_initialized) {
     entry->context = tc->mutator->CreateSampleContext(entry->sample);
@@ -586,27 +1671,56 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
   }
 
   tc->mutator->InitRound(entry->sample, entry->context);
+  double energy = schedule->GetEnergy(entry);
+
+  // entries much slower than the median get proportionally
+  // fewer rounds so they can't dominate the CPU time
+  uint64_t median = median_exec_us;
+  if (slow_factor && median && (entry->exec_us > median * slow_factor)) {
+    energy *= (double)(median * slow_factor) / entry->exec_us;
+    num_slow_jobs++;
+  }
+
+  tc->mutator->SetEnergy(energy);
+  entry->num_jobs++;
+
+  uint32_t entry_timeout = GetEntryTimeout(entry);
 
   printf("Fuzzing sample %05lld\n", entry->sample_index);
 
   job->discard_sample = false;
 
   while (1) {
-    Sample mutated_sample = *entry->sample;
-    if (!tc->mutator->Mutate(&mutated_sample, tc->prng, tc->all_samples_local)) break;
-    if (mutated_sample.size > MAX_SAMPLE_SIZE) {
-      mutated_sample.Trim(MAX_SAMPLE_SIZE);
+    // reuses the buffer from the previous iteration
+    Sample *mutated_sample = &tc->mutated_sample;
+    *mutated_sample = *entry->sample;
+    {
+      ProfileScope scope(tc->profile, PHASE_MUTATE);
+      if (!tc->mutator->Mutate(mutated_sample, tc->prng, tc->all_samples_local)) break;
+    }
+    if (mutated_sample->size > MAX_SAMPLE_SIZE) {
+      mutated_sample->Trim(MAX_SAMPLE_SIZE);
     }
 
     int has_new_coverage;
-    RunResult result = RunSample(tc, &mutated_sample, &has_new_coverage, true, true, init_timeout, timeout);
-    AdjustSamplePriority(tc, entry, has_new_coverage);
+    if (ShouldStop()) break;
+
+    RunResult result = RunSample(tc, mutated_sample, &has_new_coverage, true, true, init_timeout, entry_timeout);
     tc->mutator->NotifyResult(result, has_new_coverage);
 
     entry->num_runs++;
-    if (has_new_coverage) entry->num_newcoverage++;
     if (result == HANG) entry->num_hangs++;
     if (result == CRASH) entry->num_crashes++;
+    // hangs run for the whole timeout and crashes stop early,
+    // neither says how long the entry's mutants usually take
+    if ((result != HANG) && (result != CRASH)) {
+      entry->total_exec_us += tc->sample_exec_us;
+      entry->num_timed_runs++;
+      entry->exec_us = entry->total_exec_us / entry->num_timed_runs;
+    }
+    uint64_t num_timed_mutants = entry->num_runs - entry->num_hangs - entry->num_crashes;
+    if (has_new_coverage) entry->num_newcoverage++;
+    AdjustSamplePriority(tc, entry, has_new_coverage);
     if ((entry->num_hangs > 10) &&
       (entry->num_hangs > (entry->num_runs * acceptable_hang_ratio)))
     {
@@ -621,23 +1735,30 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
       job->discard_sample = true;
       break;
     }
+    if (quarantine_factor && median && (num_timed_mutants >= SLOW_MIN_RUNS) &&
+      (entry->exec_us > median * quarantine_factor))
+    {
+      WARN("Sample %lld is too slow (%llu us, median %llu us). Discarding\n",
+           entry->sample_index, (unsigned long long)entry->exec_us, (unsigned long long)median);
+      num_quarantined++;
+      job->discard_sample = true;
+      break;
+    }
   }
 }
 
 
 void Fuzzer::RunFuzzerThread(ThreadContext *tc) {
-  while (1) {
+  while (!ShouldStop()) {
     FuzzerJob job;
 
     SynchronizeAndGetJob(tc, &job);
 
     switch (job.type) {
     case WAIT:
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
-      Sleep(1000);
-#else
-      usleep(1000000);
-#endif
+      // woken up as soon as there is new work,
+      // the timeout is only a safety net
+      sample_queue.WaitForChange(job.queue_version, 1000);
       break;
     case PROCESS_SAMPLE:
       RunSample(tc, job.sample, NULL, false, false, init_timeout, corpus_timeout);
@@ -650,8 +1771,221 @@ void Fuzzer::RunFuzzerThread(ThreadContext *tc) {
       break;
     }
 
-    JobDone(&job);
+    JobDone(tc, &job);
+  }
+
+  delete tc;
+  num_running_threads--;
+}
+
+void Fuzzer::RunCullThread(ThreadContext *tc) {
+  uint64_t last_cull_time = GetCurTime();
+  bool records_changed = false;
+
+  while (!ShouldStop()) {
+    if (records_changed && (GetCurTime() - last_cull_time >= cull_interval_secs * 1000)) {
+      CullQueue();
+      records_changed = false;
+      last_cull_time = GetCurTime();
+      continue;
+    }
+
+    bool have_record = false;
+    CullRecord record;
+    cull_mutex.Lock();
+    if (!cull_pending.empty()) {
+      record = cull_pending.front();
+      cull_pending.pop_front();
+      have_record = true;
+    }
+    cull_mutex.Unlock();
+
+    if (!have_record) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(100);
+#else
+      usleep(100000);
+#endif
+      continue;
+    }
+
+    // entries that can't be measured (e.g. crash when run
+    // on their own) stay favored
+    if (MeasureCullRecord(tc, &record)) {
+      cull_records.push_back(record);
+      num_cull_records = cull_records.size();
+      records_changed = true;
+    }
+  }
+
+  delete tc;
+  num_running_threads--;
+}
+
+void Fuzzer::AddCullCandidate(Sample *sample, uint64_t sample_index) {
+  if (!cull_interval_secs) return;
+  cull_mutex.Lock();
+  cull_pending.push_back({ sample_index, sample, 0, {} });
+  cull_mutex.Unlock();
+}
+
+bool Fuzzer::MeasureCullRecord(ThreadContext *tc, CullRecord *record) {
+  uint64_t total_exec_us = 0;
+
+  for (int i = 0; i < CULL_RUNS; i++) {
+    CoverageBitmap run_coverage, tmp_coverage;
+    RunResult result = RunSampleAndGetCoverage(tc, record->sample, &run_coverage, init_timeout, timeout);
+    if (result != OK) return false;
+    total_exec_us += tc->last_exec_us;
+
+    if (i == 0) {
+      record->coverage.swap(run_coverage);
+    } else {
+      CoverageIntersection(record->coverage, run_coverage, tmp_coverage);
+      record->coverage.swap(tmp_coverage);
+    }
+  }
+
+  record->exec_us = total_exec_us / CULL_RUNS;
+
+  // variable offsets don't say anything about the entry
+  CoverageBitmap stable_coverage;
+  coverage_mutex.Lock();
+  CoverageDifference(variable_coverage, record->coverage, stable_coverage);
+  coverage_mutex.Unlock();
+  record->coverage.swap(stable_coverage);
+
+  return true;
+}
+
+// Lazy greedy weighted set cover: repeatedly picks the entry
+// with the most not-yet-covered offsets per unit of cost
+// (exec time * size). Gains only ever decrease, so an entry
+// whose recomputed score is still the best can be taken
+// without recomputing the others.
+void Fuzzer::CullQueue() {
+  uint64_t cull_start = GetCurTime();
+
+  struct CullCandidate {
+    double score;
+    size_t index;
+    bool operator<(const CullCandidate &other) const {
+      return score < other.score;
+    }
+  };
+
+  std::vector<double> costs(cull_records.size());
+  std::vector<bool> favored(cull_records.size(), false);
+  std::priority_queue<CullCandidate> candidates;
+
+  for (size_t i = 0; i < cull_records.size(); i++) {
+    CullRecord &record = cull_records[i];
+    costs[i] = (double)(record.exec_us + 1) * (record.sample->size + 1);
+    size_t count = CoverageCount(record.coverage);
+    if (count) candidates.push({ count / costs[i], i });
+  }
+
+  CoverageBitmap covered;
+  uint64_t favored_count = 0;
+  while (!candidates.empty()) {
+    CullCandidate candidate = candidates.top();
+    candidates.pop();
+
+    CoverageBitmap gain_coverage;
+    CoverageDifference(covered, cull_records[candidate.index].coverage, gain_coverage);
+    size_t gain = CoverageCount(gain_coverage);
+    if (!gain) continue;
+
+    double score = gain / costs[candidate.index];
+    if (!candidates.empty() && (score < candidates.top().score)) {
+      candidates.push({ score, candidate.index });
+      continue;
+    }
+
+    favored[candidate.index] = true;
+    favored_count++;
+    MergeCoverage(covered, gain_coverage);
+  }
+
+  // records are never removed, so they cover every earlier cull
+  std::shared_ptr<std::vector<bool>> not_favored = std::make_shared<std::vector<bool>>();
+  for (size_t i = 0; i < cull_records.size(); i++) {
+    uint64_t sample_index = cull_records[i].sample_index;
+    if (not_favored->size() <= sample_index) not_favored->resize(sample_index + 1, false);
+    (*not_favored)[sample_index] = !favored[i];
+  }
+  cull_mutex.Lock();
+  cull_not_favored = not_favored;
+  cull_generation++;
+  cull_mutex.Unlock();
+
+  num_favored = favored_count;
+  cull_time_ms += GetCurTime() - cull_start;
+}
+
+// fuzzing threads only take cull_mutex to pick up a new favored set
+bool Fuzzer::IsFavored(ThreadContext *tc, uint64_t sample_index) {
+  if (tc->cull_generation != cull_generation) {
+    cull_mutex.Lock();
+    tc->not_favored = cull_not_favored;
+    tc->cull_generation = cull_generation;
+    cull_mutex.Unlock();
+  }
+  if (!tc->not_favored || (sample_index >= tc->not_favored->size())) return true;
+  return !(*tc->not_favored)[sample_index];
+}
+
+// parses the rest of fp, size bytes, as coverage in the format of
+// TinyInst's WriteCoverageBinary, returns false unless it is exactly
+// one such coverage
+static bool ParseOffsetCoverage(Coverage &coverage, FILE *fp, uint64_t size) {
+  auto read = [&](void *dst, uint64_t n) {
+    if (size < n) return false;
+    if (n && (fread(dst, 1, (size_t)n, fp) != n)) return false;
+    size -= n;
+    return true;
+  };
+
+  uint64_t num_modules;
+  if (!read(&num_modules, sizeof(num_modules))) return false;
+  for (uint64_t m = 0; m < num_modules; m++) {
+    uint64_t name_size;
+    if (!read(&name_size, sizeof(name_size))) return false;
+    if (name_size > size) return false;
+    std::string name((size_t)name_size, '\0');
+    if (!read(&name[0], name_size)) return false;
+    uint64_t num_offsets;
+    if (!read(&num_offsets, sizeof(num_offsets))) return false;
+    if (num_offsets > size / sizeof(uint64_t)) return false;
+    std::set<uint64_t> offsets;
+    for (uint64_t i = 0; i < num_offsets; i++) {
+      uint64_t offset;
+      if (!read(&offset, sizeof(offset))) return false;
+      offsets.insert(offset);
+    }
+    coverage.push_back(ModuleCoverage(name, offsets));
+  }
+  return size == 0;
+}
+
+// state.dat written before the coverage bitmap stores the coverage
+// as offsets (a TinyInst Coverage). Reads the rest of fp in that
+// layout if it parses exactly, otherwise returns false and leaves
+// fp where it was.
+static bool ReadOffsetCoverage(CoverageBitmap &result, FILE *fp) {
+  long start = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  long end = ftell(fp);
+  fseek(fp, start, SEEK_SET);
+  if ((start < 0) || (end < start)) return false;
+
+  Coverage coverage;
+  if (!ParseOffsetCoverage(coverage, fp, (uint64_t)(end - start))) {
+    fseek(fp, start, SEEK_SET);
+    return false;
   }
+  CoverageToBitmap(coverage, result);
+  return true;
 }
 
 void Fuzzer::SaveState() {
@@ -660,43 +1994,208 @@ void Fuzzer::SaveState() {
   
   output_mutex.Lock();
   coverage_mutex.Lock();
-  
-  std::string out_file = DirJoin(out_dir, std::string("state.dat"));
-  FILE *fp = fopen(out_file.c_str(), "wb");
-  if (!fp) {
-    FATAL("Error saving state");
+  journal_mutex.Lock();
+
+  JournalCounters counters;
+  counters.num_samples = num_samples;
+  counters.total_execs = GetTotalExecs();
+  counters.min_priority = min_priority;
+  journal.Append(JOURNAL_COUNTERS, &counters, sizeof(counters));
+
+  if (mutator_states_changed) {
+    std::string data;
+    for (auto iter = mutator_states.begin(); iter != mutator_states.end(); iter++) {
+      uint32_t thread_id = iter->first;
+      data.assign((char *)&thread_id, sizeof(thread_id));
+      data += iter->second;
+      journal.Append(JOURNAL_MUTATOR_STATE, data);
+    }
+    mutator_states_changed = false;
   }
 
-  fwrite(&num_samples, sizeof(num_samples), 1, fp);
-  fwrite(&total_execs, sizeof(total_execs), 1, fp);
-  fwrite(&min_priority, sizeof(min_priority), 1, fp);
-
-  WriteCoverageBinary(fuzzer_coverage, fp);
+  uint64_t compact_size = journal_compacted_size * JOURNAL_COMPACT_RATIO;
+  if (compact_size < JOURNAL_COMPACT_MIN_SIZE) compact_size = JOURNAL_COMPACT_MIN_SIZE;
 
-  fclose(fp);
+  if (journal.Size() >= compact_size) {
+    CompactJournal();
+  } else if (!journal.Flush()) {
+    FATAL("Error saving state");
+  }
 
+  journal_mutex.Unlock();
   coverage_mutex.Unlock();
   output_mutex.Unlock();
 }
 
+// replaces the journal with a snapshot of the current state,
+// called with coverage_mutex and journal_mutex held
+void Fuzzer::CompactJournal() {
+  std::string snapshot;
+  std::string data;
+
+  JournalCounters counters;
+  counters.num_samples = num_samples;
+  counters.total_execs = GetTotalExecs();
+  counters.min_priority = min_priority;
+  Journal::EncodeRecord(snapshot, JOURNAL_COUNTERS, &counters, sizeof(counters));
+
+  WriteCoverageBinary(fuzzer_coverage, data);
+  Journal::EncodeRecord(snapshot, JOURNAL_COVERAGE, data.data(), data.size());
+  data.clear();
+  WriteCoverageBinary(variable_coverage, data);
+  Journal::EncodeRecord(snapshot, JOURNAL_VARIABLE_COVERAGE, data.data(), data.size());
+
+  for (auto iter = journal_entries.begin(); iter != journal_entries.end(); iter++) {
+    Journal::EncodeRecord(snapshot, JOURNAL_ENTRY, &iter->second, sizeof(JournalEntry));
+  }
+
+  if (auto_timeout && timeout_calibrated) {
+    uint32_t calibrated_timeout = timeout;
+    Journal::EncodeRecord(snapshot, JOURNAL_TIMEOUT, &calibrated_timeout, sizeof(calibrated_timeout));
+  }
+
+  for (auto iter = mutator_states.begin(); iter != mutator_states.end(); iter++) {
+    uint32_t thread_id = iter->first;
+    data.assign((char *)&thread_id, sizeof(thread_id));
+    data += iter->second;
+    Journal::EncodeRecord(snapshot, JOURNAL_MUTATOR_STATE, data.data(), data.size());
+  }
+
+  if (!journal.Compact(snapshot)) {
+    FATAL("Error saving state");
+  }
+  journal_compacted_size = journal.Size();
+}
+
+void Fuzzer::JournalEntryState(SampleQueueEntry *entry) {
+  JournalEntry journal_entry;
+  journal_entry.sample_index = entry->sample_index;
+  journal_entry.priority = entry->priority;
+  journal_entry.num_runs = entry->num_runs;
+  journal_entry.num_crashes = entry->num_crashes;
+  journal_entry.num_hangs = entry->num_hangs;
+  journal_entry.num_newcoverage = entry->num_newcoverage;
+  journal_entry.num_jobs = entry->num_jobs;
+  journal_entry.exec_us = entry->exec_us;
+  journal_entry.total_exec_us = entry->total_exec_us;
+  journal_entry.num_new_offsets = entry->num_new_offsets;
+  journal_entry.num_timed_runs = entry->num_timed_runs;
+
+  journal_mutex.Lock();
+  journal_entries[entry->sample_index] = journal_entry;
+  journal.Append(JOURNAL_ENTRY, &journal_entry, sizeof(journal_entry));
+  journal_mutex.Unlock();
+}
+
+void Fuzzer::JournalEntryDiscarded(uint64_t sample_index) {
+  journal_mutex.Lock();
+  journal_entries.erase(sample_index);
+  journal.Append(JOURNAL_ENTRY_DISCARDED, &sample_index, sizeof(sample_index));
+  journal_mutex.Unlock();
+}
+
+// reads state.dat written by versions without the journal,
+// in the offset or the bitmap layout (see ReadOffsetCoverage)
+bool Fuzzer::ReadLegacyState(JournalCounters *counters) {
+  std::string out_file = DirJoin(out_dir, std::string("state.dat"));
+  FILE *fp = fopen(out_file.c_str(), "rb");
+  if (!fp) return false;
+
+  fread(&counters->num_samples, sizeof(counters->num_samples), 1, fp);
+  fread(&counters->total_execs, sizeof(counters->total_execs), 1, fp);
+  fread(&counters->min_priority, sizeof(counters->min_priority), 1, fp);
+
+  if (!ReadOffsetCoverage(fuzzer_coverage, fp)) {
+    ReadCoverageBinary(fuzzer_coverage, fp);
+    ReadCoverageBinary(variable_coverage, fp);
+  }
+
+  fclose(fp);
+  return true;
+}
+
 void Fuzzer::RestoreState() {
   output_mutex.Lock();
   coverage_mutex.Lock();
   queue_mutex.Lock();
-  
-  std::string out_file = DirJoin(out_dir, std::string("state.dat"));
-  FILE *fp = fopen(out_file.c_str(), "rb");
-  if (!fp) {
+  journal_mutex.Lock();
+
+  JournalCounters counters = { 0, 0, min_priority };
+  std::unordered_map<uint64_t, bool> discarded;
+  uint32_t restored_timeout = 0;
+
+  std::string journal_file = DirJoin(out_dir, std::string("state.journal"));
+  bool found = Journal::Read(journal_file, [&](uint32_t type, const char *data, uint32_t size) {
+    CoverageBitmap coverage;
+    switch (type) {
+    case JOURNAL_COUNTERS:
+      if (size != sizeof(counters)) break;
+      memcpy(&counters, data, size);
+      return;
+    case JOURNAL_COVERAGE:
+      if (!ReadCoverageBinary(coverage, data, size)) break;
+      MergeCoverage(fuzzer_coverage, coverage);
+      return;
+    case JOURNAL_VARIABLE_COVERAGE:
+      if (!ReadCoverageBinary(coverage, data, size)) break;
+      MergeCoverage(variable_coverage, coverage);
+      return;
+    case JOURNAL_ENTRY: {
+      size_t old_size = offsetof(JournalEntry, num_timed_runs);
+      if ((size != sizeof(JournalEntry)) && (size != old_size)) break;
+      JournalEntry journal_entry;
+      memcpy(&journal_entry, data, size);
+      if (size == old_size) {
+        // only the mutants were timed
+        journal_entry.num_timed_runs = journal_entry.num_runs -
+          journal_entry.num_hangs - journal_entry.num_crashes;
+      }
+      journal_entries[journal_entry.sample_index] = journal_entry;
+      discarded.erase(journal_entry.sample_index);
+      return;
+    }
+    case JOURNAL_ENTRY_DISCARDED: {
+      if (size != sizeof(uint64_t)) break;
+      uint64_t sample_index;
+      memcpy(&sample_index, data, size);
+      journal_entries.erase(sample_index);
+      discarded[sample_index] = true;
+      return;
+    }
+    case JOURNAL_TIMEOUT:
+      if (size != sizeof(restored_timeout)) break;
+      memcpy(&restored_timeout, data, size);
+      return;
+    case JOURNAL_MUTATOR_STATE: {
+      if (size < sizeof(uint32_t)) break;
+      uint32_t thread_id;
+      memcpy(&thread_id, data, sizeof(thread_id));
+      mutator_states[thread_id].assign(data + sizeof(thread_id), size - sizeof(thread_id));
+      return;
+    }
+    default:
+      break;
+    }
+    WARN("Skipping malformed journal record of type %u", type);
+  });
+
+  if (!found) found = ReadLegacyState(&counters);
+
+  if (!found) {
     FATAL("Error restoring state. Did the previous session run long enough for state to be saved?");
   }
 
-  fread(&num_samples, sizeof(num_samples), 1, fp);
-  fread(&total_execs, sizeof(total_execs), 1, fp);
-  fread(&min_priority, sizeof(min_priority), 1, fp);
+  num_samples = counters.num_samples;
+  restored_execs = counters.total_execs;
+  min_priority = counters.min_priority;
+  num_offsets = CoverageCount(fuzzer_coverage);
 
-  ReadCoverageBinary(fuzzer_coverage, fp);
-
-  fclose(fp);
+  // an explicit -t overrides the timeout calibrated in a previous session
+  if (auto_timeout && restored_timeout) {
+    SetTimeout(restored_timeout);
+    timeout_calibrated = true;
+    printf("Restored timeout: %u ms\n", restored_timeout);
+  }
   
   for (uint64_t i = 0; i < num_samples; i++) {
     Sample *sample = new Sample();
@@ -704,28 +2203,79 @@ void Fuzzer::RestoreState() {
     sprintf(fileindex, "%05lld", i);
     string outfile = DirJoin(sample_dir, string("sample_") + fileindex);
     sample->Load(outfile.c_str());
+    // discarded samples can still be used for splicing
+    all_samples.push_back(sample);
+    if (discarded.find(i) != discarded.end()) {
+      num_samples_discarded++;
+      continue;
+    }
+
     SampleQueueEntry *new_entry = new SampleQueueEntry();
     new_entry->sample = sample;
     new_entry->context = NULL;
     new_entry->context_initialized = false;
-    // we don't save priorities per-sample so this is an approximation
-    new_entry->priority = min_priority;
     new_entry->sample_index = i;
-    all_samples.push_back(sample);
-    sample_queue.push(new_entry);
+
+    auto journal_iter = journal_entries.find(i);
+    if (journal_iter != journal_entries.end()) {
+      JournalEntry &journal_entry = journal_iter->second;
+      new_entry->num_runs = journal_entry.num_runs;
+      new_entry->num_crashes = journal_entry.num_crashes;
+      new_entry->num_hangs = journal_entry.num_hangs;
+      new_entry->num_newcoverage = journal_entry.num_newcoverage;
+      new_entry->num_jobs = journal_entry.num_jobs;
+      new_entry->exec_us = journal_entry.exec_us;
+      new_entry->total_exec_us = journal_entry.total_exec_us;
+      new_entry->num_new_offsets = journal_entry.num_new_offsets;
+      new_entry->num_timed_runs = journal_entry.num_timed_runs;
+      schedule->AddEntry(new_entry);
+      new_entry->priority = journal_entry.priority;
+    } else {
+      // no saved state for the entry (e.g. restoring from state.dat),
+      // so this is an approximation
+      schedule->AddEntry(new_entry);
+      new_entry->priority = min_priority;
+      JournalEntry &journal_entry = journal_entries[i];
+      memset(&journal_entry, 0, sizeof(journal_entry));
+      journal_entry.sample_index = i;
+      journal_entry.priority = new_entry->priority;
+    }
+
+    AddCullCandidate(sample, i);
+    sample_queue.Push(i, new_entry);
   }
-  
+  num_all_samples = all_samples.size();
+
+  // start the new session from a compacted journal, this also
+  // drops anything left behind by an interrupted write
+  if (!journal.Open(journal_file)) {
+    FATAL("Error opening state journal");
+  }
+  CompactJournal();
+
+  journal_mutex.Unlock();
   queue_mutex.Unlock();
   coverage_mutex.Unlock();
   output_mutex.Unlock();
 }
 
 void Fuzzer::AdjustSamplePriority(ThreadContext *tc, SampleQueueEntry *entry, int found_new_coverage) {
-  if (found_new_coverage) entry->priority = 0;
-  else entry->priority--;
+  schedule->OnRun(entry, found_new_coverage != 0);
+}
+
+PowerSchedule *Fuzzer::CreatePowerSchedule(int argc, char **argv) {
+  char *option = GetOption("-schedule", argc, argv);
+  if (!option) option = (char *)"explore";
+
+  PowerSchedule *power_schedule = PowerSchedule::Create(option);
+  if (!power_schedule) {
+    FATAL("Unknown power schedule %s", option);
+  }
+  power_schedule->Init(argc, argv);
+  return power_schedule;
 }
 
-Fuzzer::ThreadContext *Fuzzer::CreateThreadContext(int argc, char **argv, int thread_id) {
+Fuzzer::ThreadContext *Fuzzer::CreateThreadContext(int argc, char **argv, uint64_t thread_id, bool ignore_corpus_coverage) {
   ThreadContext *tc = new ThreadContext();
 
   // copy arguments for each thread
@@ -740,13 +2290,45 @@ Fuzzer::ThreadContext *Fuzzer::CreateThreadContext(int argc, char **argv, int th
   tc->fuzzer = this;
   tc->prng = CreatePRNG(argc, argv, tc);
   tc->mutator = CreateMutator(argc, argv, tc);
+  // threads beyond those of the previous session start
+  // from the state of the first one
+  if (thread_id <= num_threads) {
+    journal_mutex.Lock();
+    auto state_iter = mutator_states.find(thread_id);
+    if (state_iter == mutator_states.end()) state_iter = mutator_states.begin();
+    if (state_iter != mutator_states.end()) tc->mutator->LoadState(state_iter->second);
+    journal_mutex.Unlock();
+  }
   tc->instrumentation = CreateInstrumentation(argc, argv, tc);
   tc->sampleDelivery = CreateSampleDelivery(argc, argv, tc);
 
-  // ignore coverage from the corpus
-  coverage_mutex.Lock();
-  tc->instrumentation->IgnoreCoverage(fuzzer_coverage);
-  coverage_mutex.Unlock();
+  tc->stats = new ThreadStats();
+  tc->exec_time_histogram = new Histogram();
+  thread_stats[thread_id - 1] = tc->stats;
+  exec_time_histograms[thread_id - 1] = tc->exec_time_histogram;
+  tc->profile = profile ? new ThreadProfile() : NULL;
+  thread_profiles[thread_id - 1] = tc->profile;
+  tc->last_exec_us = 0;
+  tc->sample_exec_us = 0;
+
+  // the mutation arena of fuzzing threads, mutators never need to
+  // grow it. Pages are only committed once the thread touches them.
+  if (thread_id <= num_threads) tc->mutated_sample.Reserve(MAX_SAMPLE_SIZE);
+
+  // ignore coverage from the corpus, and
+  // later whatever the other threads find
+  tc->follows_coverage_log = ignore_corpus_coverage;
+  tc->coverage_log_pos = 0;
+  tc->cull_generation = 0;
+  if (ignore_corpus_coverage) {
+    Coverage ignore_coverage;
+    coverage_mutex.Lock();
+    BitmapToCoverage(fuzzer_coverage, ignore_coverage);
+    tc->coverage_log_pos = coverage_log_start + coverage_log.size();
+    coverage_log_positions[thread_id - 1] = tc->coverage_log_pos;
+    coverage_mutex.Unlock();
+    tc->instrumentation->IgnoreCoverage(ignore_coverage);
+  }
 
   return tc;
 }
@@ -781,12 +2363,41 @@ PRNG *Fuzzer::CreatePRNG(int argc, char **argv, ThreadContext *tc) {
 }
 
 Instrumentation *Fuzzer::CreateInstrumentation(int argc, char **argv, ThreadContext *tc) {
-  TinyInstInstrumentation *instrumentation = new TinyInstInstrumentation();
-  instrumentation->Init(argc, argv);
-  return instrumentation;
+  char *option = GetOption("-instrumentation", argc, argv);
+  if (!option || !strcmp(option, "tinyinst")) {
+    TinyInstInstrumentation *instrumentation = new TinyInstInstrumentation();
+    instrumentation->Init(argc, argv);
+    return instrumentation;
+#if defined(__linux__)
+  } else if (!strcmp(option, "inprocess")) {
+    InProcessInstrumentation *instrumentation = new InProcessInstrumentation();
+    instrumentation->Init(argc, argv);
+    return instrumentation;
+  } else if (!strcmp(option, "forkserver")) {
+    ForkserverInstrumentation *instrumentation = new ForkserverInstrumentation();
+    instrumentation->Init(argc, argv);
+    return instrumentation;
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+  } else if (!strcmp(option, "ptrace")) {
+    PtraceInstrumentation *instrumentation = new PtraceInstrumentation();
+    instrumentation->Init(argc, argv);
+    return instrumentation;
+#endif
+  } else {
+    FATAL("Unknown instrumentation option");
+  }
 }
 
 SampleDelivery *Fuzzer::CreateSampleDelivery(int argc, char **argv, ThreadContext *tc) {
+#if defined(__linux__)
+  // the harness runs in the fuzzer process, samples are passed directly
+  char *instrumentation = GetOption("-instrumentation", argc, argv);
+  if (instrumentation && !strcmp(instrumentation, "inprocess")) {
+    return new InProcessSampleDelivery((InProcessInstrumentation *)tc->instrumentation);
+  }
+#endif
+
   char *option = GetOption("-delivery", argc, argv);
   if (!option || !strcmp(option, "file")) {
 
@@ -796,6 +2407,8 @@ SampleDelivery *Fuzzer::CreateSampleDelivery(int argc, char **argv, ThreadContex
     FileSampleDelivery* sampleDelivery = new FileSampleDelivery();
     sampleDelivery->Init(argc, argv);
     sampleDelivery->SetFilename(outfile);
+    // the input file is also the target's stdin
+    tc->instrumentation->SetInputFile(outfile);
     return sampleDelivery;
 
   } else if (!strcmp(option, "shmem")) {
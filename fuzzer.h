@@ -18,38 +18,124 @@ limitations under the License.
 
 #include <string>
 #include <list>
+#include <deque>
+#include <map>
 #include <vector>
 #include <queue>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include "prng.h"
 #include "mutex.h"
+#include "shardedqueue.h"
 #include "coverage.h"
+#include "coveragebitmap.h"
+#include "histogram.h"
+#include "profiler.h"
+#include "journal.h"
 #include "instrumentation.h"
+#include "mutator.h"
+#include "dictionary.h"
+#include "sample.h"
 
 class PRNG;
 class Mutator;
 class Instrumentation;
 class SampleDelivery;
 class MutatorSampleContext;
-class Sample;
 class CoverageClient;
+class PowerSchedule;
 
 #define CRASH_REPRODUCE_TIMES 10
+// maximum number of reruns when calibrating a sample with new coverage
 #define SAMPLE_RETRY_TIMES 10
-#define TRIM_STEP_INITIAL 16
+// calibration stops early after this many reruns without any change
+#define CALIBRATION_CONVERGE_RUNS 3
+// trimming budget per sample, 0 means unlimited
+#define TRIM_MAX_EXECS 1000
+#define TRIM_MAX_TIME_MS 10000
+// bytes are normalized to this value when it doesn't change coverage
+#define TRIM_NORMALIZE_BYTE '0'
+// total size of the candidates remembered while trimming a sample
+#define TRIM_CACHE_MAX_SIZE (16 * 1024 * 1024)
 
 #define MAX_IDENTICAL_CRASHES 4
 
-// save state every 5 minutes
-#define FUZZER_SAVE_INERVAL (5 * 60)
+// number of threads reproducing and saving crashes,
+// 0 means fuzzing threads do it themselves
+#define TRIAGE_THREADS 1
+// crashes found while this many are waiting for triage are
+// triaged by the fuzzing thread that found them
+#define TRIAGE_MAX_PENDING 256
+
+// entries whose mutants take more than SLOW_FACTOR times the median
+// execution time get proportionally less energy, above
+// QUARANTINE_FACTOR times the median they are discarded
+#define SLOW_FACTOR 10
+#define QUARANTINE_FACTOR 100
+#define SLOW_MIN_RUNS 16
+
+// how often (in seconds) the favored set is recomputed, culling
+// is off unless enabled with -cull_interval
+#define CULL_INTERVAL 0
+// number of runs used to measure an entry's stable coverage
+#define CULL_RUNS 2
+// chance that a fuzz job on an entry outside the favored set is skipped
+#define CULL_SKIP_PROBABILITY 0.9
+
+// without -t, the fuzzing timeout is derived from execution times
+// measured while processing the corpus (p99 times AUTO_TIMEOUT_FACTOR,
+// at least AUTO_TIMEOUT_MIN_MS)
+#define AUTO_TIMEOUT_FACTOR 5
+#define AUTO_TIMEOUT_MIN_MS 20
+// with a calibrated timeout, hangs only count if they persist with
+// HANG_CONFIRM_FACTOR times the timeout (at least HANG_CONFIRM_MIN_MS)
+#define HANG_CONFIRM_FACTOR 10
+#define HANG_CONFIRM_MIN_MS 1000
+
+// with -cpu_affinity, cpus busier than CPU_BUSY_THRESHOLD over
+// CPU_LOAD_INTERVAL_MS at startup are only used if there aren't
+// enough idle ones
+#define CPU_BUSY_THRESHOLD 0.5
+#define CPU_LOAD_INTERVAL_MS 250
+
+// saving only appends recent changes to the journal,
+// so it can be done often
+#define FUZZER_SAVE_INERVAL 30
+
+// the journal is rewritten from a snapshot once it grows to
+// JOURNAL_COMPACT_RATIO times its size after the last compaction
+#define JOURNAL_COMPACT_RATIO 4
+#define JOURNAL_COMPACT_MIN_SIZE (1024 * 1024)
+
+// fuzzer_stats is rewritten and plot_data appended to
+// at these intervals (in seconds)
+#define FUZZER_STATS_INTERVAL 1
+#define FUZZER_PLOT_INTERVAL 5
 
 class Fuzzer {
 public:
+  // out of line, PowerSchedule is incomplete here
+  Fuzzer();
+  virtual ~Fuzzer();
+
   void Run(int argc, char **argv);
 
+  // counters updated by a single thread and summed up by the
+  // status loop, padded so threads don't share cache lines
+  struct alignas(64) ThreadStats {
+    ThreadStats() : execs(0) { }
+
+    void AddExecs(uint64_t n) {
+      execs.store(execs.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> execs;
+  };
+
   class ThreadContext {
   public:
-    int thread_id;
+    uint64_t thread_id;
     Fuzzer *fuzzer;
     SampleDelivery *sampleDelivery;
     PRNG *prng;
@@ -63,30 +149,45 @@ public:
     // a thread-local copy of all samples vector
     std::vector<Sample *> all_samples_local;
 
+    // statistics of this thread, owned by the Fuzzer
+    ThreadStats *stats;
+    Histogram *exec_time_histogram;
+    // NULL unless profiling with -profile
+    ThreadProfile *profile;
+    // wall time of the last execution
+    uint64_t last_exec_us;
+    // wall time of the first execution in the last RunSample call
+    uint64_t sample_exec_us;
+
+    // scratch buffers reused across iterations so that
+    // uninteresting executions don't touch the heap,
+    // mutated_sample has room for MAX_SAMPLE_SIZE bytes
+    Sample mutated_sample;
+    Sample filtered_sample;
+
+    // whether coverage found by other threads is ignored, and up
+    // to which position of coverage_log that has been done
+    bool follows_coverage_log;
+    size_t coverage_log_pos;
+
+    // the favored set as of cull_generation
+    std::shared_ptr<const std::vector<bool>> not_favored;
+    uint64_t cull_generation;
+
     ~ThreadContext();
   };
 
   void RunFuzzerThread(ThreadContext *tc);
-
-private:
-
-  enum FuzzerState {
-    INPUT_SAMPLE_PROCESSING,
-    SERVER_SAMPLE_PROCESSING,
-    FUZZING,
-  };
-
-  enum JobType {
-    PROCESS_SAMPLE,
-    FUZZ,
-    WAIT,
-  };
+  void RunCullThread(ThreadContext *tc);
+  void RunTriageThread(ThreadContext *tc);
 
   class SampleQueueEntry {
   public:
     SampleQueueEntry() : sample(NULL), context(NULL),
       priority(0), sample_index(0), num_runs(0),
-      num_crashes(0), num_hangs(0), num_newcoverage(0) {}
+      num_crashes(0), num_hangs(0), num_newcoverage(0),
+      num_jobs(0), exec_us(0), total_exec_us(0), num_timed_runs(0), num_new_offsets(0),
+      favored(true) {}
 
     Sample *sample;
     MutatorSampleContext *context;
@@ -97,8 +198,42 @@ private:
     uint64_t num_crashes;
     uint64_t num_hangs;
     uint64_t num_newcoverage;
+    // number of fuzz jobs the entry got so far
+    uint64_t num_jobs;
+    // average execution time, measured during calibration
+    // and then over the entry's mutants, 0 if unknown
+    uint64_t exec_us;
+    uint64_t total_exec_us;
+    // runs in total_exec_us: the calibration runs and
+    // the mutants that didn't hang or crash
+    uint64_t num_timed_runs;
+    // number of stable offsets the entry was the first to reach
+    uint64_t num_new_offsets;
+    // in the favored set, or not measured yet
+    bool favored;
   };
-  
+
+  // polled by all threads, subclasses can add stop conditions
+  virtual bool ShouldStop();
+
+  // tokens from -dict files and the corpus, filled before
+  // the fuzzing threads start, for use in CreateMutator
+  const Dictionary *GetDictionary() { return &dictionary; }
+
+private:
+
+  enum FuzzerState {
+    INPUT_SAMPLE_PROCESSING,
+    SERVER_SAMPLE_PROCESSING,
+    FUZZING,
+  };
+
+  enum JobType {
+    PROCESS_SAMPLE,
+    FUZZ,
+    WAIT,
+  };
+
   struct CmpEntryPtrs
   {
     bool operator()(const SampleQueueEntry* lhs, const SampleQueueEntry* rhs) const {
@@ -111,7 +246,11 @@ private:
   };
 
   std::vector<Sample *> all_samples;
-  std::priority_queue<SampleQueueEntry *, std::vector<SampleQueueEntry *>, CmpEntryPtrs> sample_queue;
+  // size of all_samples, readable without holding queue_mutex
+  std::atomic<size_t> num_all_samples;
+
+  // one shard per fuzzing thread, see shardedqueue.h
+  ShardedQueue<SampleQueueEntry *, CmpEntryPtrs> sample_queue;
 
   struct FuzzerJob {
     JobType type;
@@ -120,14 +259,18 @@ private:
       SampleQueueEntry* entry;
     };
     bool discard_sample;
+    // sample_queue version observed when the job was assigned,
+    // WAIT jobs sleep until it changes
+    uint64_t queue_version;
   };
 
   void PrintUsage();
   void ParseOptions(int argc, char **argv);
 
   void SetupDirectories();
+  void SetupDictionary();
 
-  ThreadContext *CreateThreadContext(int argc, char **argv, int thread_id);
+  ThreadContext *CreateThreadContext(int argc, char **argv, uint64_t thread_id, bool ignore_corpus_coverage = true);
   
   virtual Mutator *CreateMutator(int argc, char **argv, ThreadContext *tc) = 0;
   virtual PRNG *CreatePRNG(int argc, char **argv, ThreadContext *tc);
@@ -135,67 +278,322 @@ private:
   virtual SampleDelivery *CreateSampleDelivery(int argc, char **argv, ThreadContext *tc);
   virtual bool OutputFilter(Sample *original_sample, Sample *output_sample);
   virtual void AdjustSamplePriority(ThreadContext *tc, SampleQueueEntry *entry, int found_new_coverage);
+  virtual PowerSchedule *CreatePowerSchedule(int argc, char **argv);
 
   void ReplaceTargetCmdArg(ThreadContext *tc, const char *search, const char *replace);
   
   bool MagicOutputFilter(Sample *original_sample, Sample *output_sample, const char *magic, size_t magic_size);
 
   RunResult RunSample(ThreadContext *tc, Sample *sample, int *has_new_coverage, bool trim, bool report_to_server, uint32_t init_timeout, uint32_t timeout);
-  RunResult RunSampleAndGetCoverage(ThreadContext* tc, Sample* sample, Coverage* coverage, uint32_t init_timeout, uint32_t timeout);
+  RunResult RunSampleAndGetCoverage(ThreadContext* tc, Sample* sample, CoverageBitmap* coverage, uint32_t init_timeout, uint32_t timeout);
   RunResult TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t init_timeout, uint32_t timeout);
-  void TrimSample(ThreadContext *tc, Sample *sample, Coverage* stable_coverage, uint32_t init_timeout, uint32_t timeout);
 
-  int InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage);
+  // triage threads also confirm suspected hangs
+  struct TriageJob {
+    Sample *sample;
+    std::string crash_desc;
+    bool is_hang;
+    uint64_t queued_time_us;
+    // of the run that found the crash or hang
+    uint32_t init_timeout;
+    uint32_t timeout;
+  };
+  bool EnqueueTriageJob(Sample *sample, const std::string &crash_desc, bool is_hang, uint32_t init_timeout, uint32_t timeout);
+  void QueueCrash(ThreadContext *tc, Sample *sample, std::string &crash_desc, uint32_t init_timeout, uint32_t timeout);
+  void QueueHang(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout);
+  void TriageCrash(ThreadContext *tc, Sample *sample, std::string crash_desc, uint32_t init_timeout, uint32_t timeout);
+  void ConfirmHang(ThreadContext *tc, Sample *sample, uint32_t init_timeout);
+  void SaveHang(Sample *sample);
+  void PrintTriageStats();
+  void TrimSample(ThreadContext *tc, Sample *sample, CoverageBitmap* stable_coverage, uint32_t init_timeout, uint32_t timeout);
+
+  struct TrimCacheEntry {
+    Sample sample;
+    bool result;
+  };
+  struct TrimState {
+    CoverageBitmap *stable_coverage;
+    // candidates that were already run and their results, by hash
+    std::unordered_map<uint64_t, TrimCacheEntry> tested;
+    size_t tested_size;
+    uint64_t num_execs;
+    uint64_t start_time;
+  };
+  bool TrimBudgetExceeded(TrimState *trim_state);
+  bool TryTrimCandidate(ThreadContext *tc, Sample *candidate, TrimState *trim_state, uint32_t init_timeout, uint32_t timeout);
+
+  int InterestingSample(ThreadContext *tc, Sample *sample, CoverageBitmap *stableCoverage, CoverageBitmap *variableCoverage);
+
+  // Mutex::Lock, with the wait counted as PHASE_LOCK_WAIT
+  void LockProfiled(ThreadContext *tc, Mutex &mutex);
+
+  // releases offsets claimed for calibration
+  void ReleaseCoverageClaim(CoverageBitmap &claim);
+
+  // passes coverage that other threads added to fuzzer_coverage
+  // since the last call to the thread's instrumentation
+  void SyncIgnoredCoverage(ThreadContext *tc);
+  // drops the coverage_log entries every fuzzing thread has
+  // caught up on, called with coverage_mutex held
+  void TrimCoverageLog();
+
+  void PrintStability();
+  void UpdateExecTimeStats();
+  void AssignCpus();
+  void ReportPinnedThreads();
+  void PrintCpuExecRates(uint32_t secs);
+
+  // Corpus culling. A separate thread with its own, non-ignoring
+  // instrumentation measures the full stable coverage of every
+  // entry and periodically picks a small subset of entries
+  // (preferring small and fast samples) that covers everything.
+  // Entries outside of that set are mostly skipped.
+  struct CullRecord {
+    uint64_t sample_index;
+    Sample *sample;
+    uint64_t exec_us;
+    CoverageBitmap coverage;
+  };
+  void AddCullCandidate(Sample *sample, uint64_t sample_index);
+  bool MeasureCullRecord(ThreadContext *tc, CullRecord *record);
+  void CullQueue();
+  bool IsFavored(ThreadContext *tc, uint64_t sample_index);
 
   void SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job);
-  void JobDone(FuzzerJob* job);
+  void JobDone(ThreadContext* tc, FuzzerJob* job);
   void FuzzJob(ThreadContext* tc, FuzzerJob* job);
 
+  bool ServerUpdateDue();
+  void UpdateMinPriority(double priority);
+
+  uint64_t GetTotalExecs();
+  void WriteStats(uint64_t execs_per_sec);
+  void WriteProfileStats();
+  void PublishMutatorState(ThreadContext *tc);
+  void MergeMutatorStats(std::vector<MutatorStats> &stats);
+  void PrintMutatorStats();
+  void WriteMutatorStats();
+  void AppendPlotData(uint64_t execs_per_sec);
+
   uint64_t num_crashes;
   uint64_t num_unique_crashes;
   uint64_t num_hangs;
   uint64_t num_samples;
   uint64_t num_samples_discarded;
   uint64_t num_threads;
-  uint64_t total_execs;
+  // execs from previous sessions, see GetTotalExecs()
+  uint64_t restored_execs;
+  // number of offsets in fuzzer_coverage (written with coverage_mutex held)
+  std::atomic<uint64_t> num_offsets;
+
+  // stop conditions, 0 means unlimited
+  uint64_t max_execs;
+  uint64_t max_time_secs;
+  std::atomic<bool> should_stop;
+  std::atomic<int> num_running_threads;
   
+  // State is kept in an append-only journal (state.journal in
+  // out_dir) of coverage deltas, new entries and entry updates.
+  // Sessions saved before the journal existed have state.dat.
+  enum JournalRecordType {
+    JOURNAL_COUNTERS = 1,
+    // offsets added to fuzzer_coverage
+    JOURNAL_COVERAGE,
+    // offsets added to variable_coverage
+    JOURNAL_VARIABLE_COVERAGE,
+    // a new entry or the latest state of an existing one
+    JOURNAL_ENTRY,
+    JOURNAL_ENTRY_DISCARDED,
+    // the calibrated timeout
+    JOURNAL_TIMEOUT,
+    // learned state of a fuzzing thread's mutator,
+    // a uint32_t thread_id followed by the state
+    JOURNAL_MUTATOR_STATE,
+  };
+
+  struct JournalCounters {
+    uint64_t num_samples;
+    uint64_t total_execs;
+    double min_priority;
+  };
+
+  struct JournalEntry {
+    uint64_t sample_index;
+    double priority;
+    uint64_t num_runs;
+    uint64_t num_crashes;
+    uint64_t num_hangs;
+    uint64_t num_newcoverage;
+    uint64_t num_jobs;
+    uint64_t exec_us;
+    uint64_t total_exec_us;
+    uint64_t num_new_offsets;
+    // not in records written before it was added
+    uint64_t num_timed_runs;
+  };
+
   void SaveState();
   void RestoreState();
+  bool ReadLegacyState(JournalCounters *counters);
+  void JournalEntryState(SampleQueueEntry *entry);
+  void JournalEntryDiscarded(uint64_t sample_index);
+  void CompactJournal();
+
+  // called once corpus processing is done, with queue_mutex held
+  void CalibrateTimeout();
+  void SetTimeout(uint32_t new_timeout);
+  uint32_t GetEntryTimeout(SampleQueueEntry *entry);
 
   std::string in_dir;
   std::string out_dir;
+
+  std::list<char *> dict_files;
+  bool dict_auto;
+  Dictionary dictionary;
   std::string sample_dir;
   std::string crash_dir;
   std::string hangs_dir;
 
+  uint64_t start_time_ms;
+  FILE *plot_fp;
+
   //std::string target_cmd;
   int target_argc;
   char **target_argv;
-  uint32_t timeout;
+  std::atomic<uint32_t> timeout;
   uint32_t init_timeout;
   uint32_t corpus_timeout;
+  // longer timeout for confirming hangs and reproducing crashes,
+  // the same as timeout unless it is calibrated or given with -t_hang
+  std::atomic<uint32_t> hang_timeout;
+  bool hang_timeout_set;
+  bool auto_timeout;
+  uint64_t timeout_factor;
+  std::atomic<bool> timeout_calibrated;
+  std::atomic<uint64_t> num_hangs_unconfirmed;
 
   Mutex queue_mutex;
   Mutex output_mutex;
   Mutex coverage_mutex;
 
-  Coverage fuzzer_coverage;
+  // protects journal and journal_entries, if coverage_mutex
+  // is also needed, it must be locked first
+  Mutex journal_mutex;
+  Journal journal;
+  uint64_t journal_compacted_size;
+  // latest state of every entry that wasn't discarded, by sample_index
+  std::map<uint64_t, JournalEntry> journal_entries;
+  // latest mutator state and statistics of every fuzzing thread
+  // by thread_id, published at the end of each fuzz job
+  std::map<int, std::string> mutator_states;
+  std::map<int, std::vector<MutatorStats>> mutator_stats;
+  bool mutator_states_changed;
+
+  CoverageBitmap fuzzer_coverage;
+  // every addition to fuzzer_coverage, in order (protected by
+  // coverage_mutex), fuzzing threads catch up on it between samples
+  // so they don't calibrate offsets another thread already found.
+  // Positions count from the first addition, entries that every
+  // fuzzing thread caught up on are dropped from the front.
+  std::deque<CoverageBitmap> coverage_log;
+  // position of coverage_log.front()
+  size_t coverage_log_start;
+  // position after the last entry
+  std::atomic<size_t> coverage_log_size;
+  // coverage_log_pos of every fuzzing thread that follows the log,
+  // SIZE_MAX for the others, by thread_id - 1 (protected by coverage_mutex)
+  std::vector<size_t> coverage_log_positions;
+  // new offsets a thread is currently calibrating (protected by
+  // coverage_mutex), other threads drop samples that only hit these
+  CoverageBitmap claimed_coverage;
+  // offsets that were ever seen to be variable, these never
+  // trigger calibration again (protected by coverage_mutex)
+  CoverageBitmap variable_coverage;
+
+  // trimming options and statistics
+  uint64_t trim_max_execs;
+  uint64_t trim_max_time_ms;
+  bool trim_normalize;
+  std::atomic<uint64_t> num_trim_execs;
+  std::atomic<uint64_t> num_trim_cache_hits;
+  std::atomic<uint64_t> num_trim_bytes_saved;
+
+  // calibration statistics
+  int calibration_converge_runs;
+  std::atomic<uint64_t> num_calibrations;
+  std::atomic<uint64_t> num_calibrations_skipped;
+  // new coverage of a sample that turned out to be in fuzzer_coverage
+  std::atomic<uint64_t> num_calibrations_deduplicated;
+  // new coverage of a sample that another thread was calibrating
+  std::atomic<uint64_t> num_calibrations_claimed;
+  std::atomic<uint64_t> num_calibration_runs;
+  std::atomic<uint64_t> num_calibration_runs_saved;
+  std::atomic<uint64_t> calibration_time_ms;
+
+  // per-thread counters and execution time histograms, indexed by thread_id - 1
+  std::vector<ThreadStats *> thread_stats;
+  std::vector<Histogram *> exec_time_histograms;
+  bool profile;
+  std::vector<ThreadProfile *> thread_profiles;
+  // cpu of each fuzzing thread with -cpu_affinity (-1 if it
+  // couldn't be pinned), empty otherwise
+  bool cpu_affinity;
+  std::vector<int> thread_cpus;
+  std::vector<uint64_t> last_thread_execs;
+  // median over all threads, updated by the status loop
+  std::atomic<uint64_t> median_exec_us;
+  uint64_t slow_factor;
+  uint64_t quarantine_factor;
+  std::atomic<uint64_t> num_slow_jobs;
+  std::atomic<uint64_t> num_quarantined;
+
+  int num_triage_threads;
+  Mutex triage_mutex;
+  ConditionVariable triage_cv;
+  // protected by triage_mutex
+  std::list<TriageJob *> triage_queue;
+  // set when the triage threads exit, crashes are triaged inline after that
+  bool triage_closed;
+  size_t triage_max_pending;
+  Histogram triage_latency;
+  std::atomic<uint64_t> num_triaged;
+  // jobs handled by fuzzing threads as the queue was full
+  std::atomic<uint64_t> num_triaged_inline;
+
+  uint64_t cull_interval_secs;
+  Mutex cull_mutex;
+  // entries waiting to be measured (protected by cull_mutex)
+  std::list<CullRecord> cull_pending;
+  // entries outside the favored set, by sample_index, replaced
+  // rather than modified by every cull (protected by cull_mutex)
+  std::shared_ptr<const std::vector<bool>> cull_not_favored;
+  // incremented whenever cull_not_favored is replaced
+  std::atomic<uint64_t> cull_generation;
+  // only accessed from the culling thread
+  std::vector<CullRecord> cull_records;
+  std::atomic<uint64_t> num_cull_records;
+  std::atomic<uint64_t> num_favored;
+  std::atomic<uint64_t> num_cull_skips;
+  std::atomic<uint64_t> cull_time_ms;
 
   Mutex server_mutex;
   CoverageClient *server;
-  uint64_t last_server_update_time_ms;
+  std::atomic<uint64_t> last_server_update_time_ms;
   uint64_t server_update_interval_ms;
 
   std::list<std::string> input_files;
   std::list<Sample> server_samples;
-  FuzzerState state;
+  std::atomic<FuzzerState> state;
   size_t samples_pending;
 
   bool save_hangs;
   double acceptable_hang_ratio;
   double acceptable_crash_ratio;
   
-  double min_priority;
+  std::atomic<double> min_priority;
+
+  // decides entry priorities and energy per fuzz job
+  std::unique_ptr<PowerSchedule> schedule;
   
   bool should_restore_state;
   
@@ -0,0 +1,81 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "histogram.h"
+
+int Histogram::BucketIndex(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+
+#if defined(_MSC_VER)
+  unsigned long msb;
+  _BitScanReverse64(&msb, value);
+#else
+  int msb = 63 - __builtin_clzll(value);
+#endif
+
+  int shift = (int)msb - HISTOGRAM_SUB_BITS;
+  int sub = (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::BucketValue(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) return index;
+  int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  int sub = index % HISTOGRAM_SUB_BUCKETS;
+  return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << shift;
+}
+
+void Histogram::Merge(Histogram &other) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t other_count = other.counts[i].load(std::memory_order_relaxed);
+    if (other_count) counts[i].fetch_add(other_count, std::memory_order_relaxed);
+  }
+  count.fetch_add(other.Count(), std::memory_order_relaxed);
+  uint64_t other_max = other.Max();
+  if (other_max > Max()) max_value.store(other_max, std::memory_order_relaxed);
+}
+
+void Histogram::Clear() {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    counts[i].store(0, std::memory_order_relaxed);
+  }
+  count.store(0, std::memory_order_relaxed);
+  max_value.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Percentile(double p) {
+  // count the buckets instead of using count, which
+  // might be slightly off while another thread is writing
+  uint64_t total = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    total += counts[i].load(std::memory_order_relaxed);
+  }
+  if (!total) return 0;
+
+  uint64_t target = (uint64_t)(p * total);
+  if (target >= total) target = total - 1;
+
+  uint64_t sum = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    sum += counts[i].load(std::memory_order_relaxed);
+    if (sum > target) return BucketValue(i);
+  }
+  return Max();
+}
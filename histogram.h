@@ -0,0 +1,64 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+
+// Log-linear histogram of non-negative values (e.g. microseconds).
+// Every power of two is split into HISTOGRAM_SUB_BUCKETS buckets,
+// so the relative error of a reported value is below 1/8.
+//
+// Meant to have a single writer (the thread that owns it), other
+// threads can read or merge it at any time without locking.
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+class alignas(64) Histogram {
+public:
+  Histogram() { Clear(); }
+
+  void Add(uint64_t value) {
+    int index = BucketIndex(value);
+    counts[index].store(counts[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (value > max_value.load(std::memory_order_relaxed)) {
+      max_value.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  // adds all values from other to this histogram
+  void Merge(Histogram &other);
+  void Clear();
+
+  uint64_t Count() { return count.load(std::memory_order_relaxed); }
+  uint64_t Max() { return max_value.load(std::memory_order_relaxed); }
+
+  // p in [0, 1], returns the lower bound of the bucket
+  // the percentile falls into, 0 for an empty histogram
+  uint64_t Percentile(double p);
+
+  static int BucketIndex(uint64_t value);
+  static uint64_t BucketValue(int index);
+
+protected:
+  std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> max_value;
+};
@@ -0,0 +1,534 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(__linux__)
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <unordered_map>
+#include "common.h"
+#include "mutex.h"
+#include "inprocessinstrumentation.h"
+
+// a module (the executable or a shared library)
+// compiled with trace-pc-guard
+struct SanCovModule {
+  std::string name;
+  uintptr_t base;
+  uint32_t *guards_start;
+  uint32_t *guards_stop;
+  uint32_t first_index;
+  // pc table (pc, flags pairs), NULL if built without pc-table
+  const uintptr_t *pcs;
+  std::unordered_map<uint64_t, uint32_t> offset_to_index;
+};
+
+// process-wide state, the coverage callbacks can run before main()
+// so this is only accessed through GetRegistry()
+struct SanCovRegistry {
+  SanCovRegistry() : num_guards(1), test_one_input(NULL) { }
+
+  SanCovModule *FindModule(uint32_t index);
+  SanCovModule *FindModule(const std::string &name);
+
+  // protects modules
+  Mutex mutex;
+  // ordered by first_index
+  std::vector<SanCovModule *> modules;
+  // index 0 is never used, a zero guard is disabled
+  std::atomic<uint32_t> num_guards;
+
+  // loading the harness runs the module constructors,
+  // which need the mutex above
+  Mutex load_mutex;
+  TestOneInputFunc test_one_input;
+
+  // held from creating a child's socket until the fuzzer
+  // closed the child's end, so no other child inherits it
+  Mutex spawn_mutex;
+};
+
+static SanCovRegistry &GetRegistry() {
+  static SanCovRegistry registry;
+  return registry;
+}
+
+SanCovModule *SanCovRegistry::FindModule(uint32_t index) {
+  auto iter = std::upper_bound(modules.begin(), modules.end(), index,
+    [](uint32_t index, SanCovModule *module) { return index < module->first_index; });
+  if (iter == modules.begin()) return NULL;
+  SanCovModule *module = *(iter - 1);
+  if (index >= module->first_index + (module->guards_stop - module->guards_start)) return NULL;
+  return module;
+}
+
+SanCovModule *SanCovRegistry::FindModule(const std::string &name) {
+  for (auto iter = modules.begin(); iter != modules.end(); iter++) {
+    if ((*iter)->name == name) return *iter;
+  }
+  return NULL;
+}
+
+// the instance that forked this process, only set in children
+static InProcessInstrumentation *current_instrumentation;
+
+extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+  // may be called more than once for the same module
+  if ((start == stop) || *start) return;
+
+  SanCovRegistry &registry = GetRegistry();
+  registry.mutex.Lock();
+
+  SanCovModule *module = new SanCovModule();
+  Dl_info info;
+  if (dladdr(start, &info) && info.dli_fname && info.dli_fname[0]) {
+    const char *name = strrchr(info.dli_fname, '/');
+    module->name = name ? name + 1 : info.dli_fname;
+    module->base = (uintptr_t)info.dli_fbase;
+  } else {
+    module->name = "main";
+    module->base = 0;
+  }
+  module->guards_start = start;
+  module->guards_stop = stop;
+  module->first_index = registry.num_guards;
+  module->pcs = NULL;
+
+  uint32_t index = module->first_index;
+  for (uint32_t *guard = start; guard < stop; guard++) {
+    *guard = index++;
+  }
+
+  registry.modules.push_back(module);
+  registry.num_guards = index;
+
+  registry.mutex.Unlock();
+}
+
+// called right after the guards of the same module were initialized
+extern "C" void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg, const uintptr_t *pcs_end) {
+  SanCovRegistry &registry = GetRegistry();
+  registry.mutex.Lock();
+
+  Dl_info info;
+  uintptr_t base = 0;
+  if (dladdr(pcs_beg, &info)) base = (uintptr_t)info.dli_fbase;
+
+  for (auto iter = registry.modules.rbegin(); iter != registry.modules.rend(); iter++) {
+    SanCovModule *module = *iter;
+    if (module->pcs || (module->base != base)) continue;
+    size_t num_pcs = (pcs_end - pcs_beg) / 2;
+    if (num_pcs != (size_t)(module->guards_stop - module->guards_start)) break;
+    module->pcs = pcs_beg;
+    for (size_t i = 0; i < num_pcs; i++) {
+      module->offset_to_index[pcs_beg[i * 2] - module->base] = module->first_index + (uint32_t)i;
+    }
+    break;
+  }
+
+  registry.mutex.Unlock();
+}
+
+extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+  if (!*guard) return;
+  InProcessInstrumentation *instrumentation = current_instrumentation;
+  if (!instrumentation) return;
+  instrumentation->OnGuard(guard, (uintptr_t)__builtin_return_address(0));
+}
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+#define NUM_CRASH_SIGNALS (sizeof(crash_signals) / sizeof(crash_signals[0]))
+
+static void *GetSignalPC(void *context) {
+  ucontext_t *uc = (ucontext_t *)context;
+#if defined(__x86_64__)
+  return (void *)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+  return (void *)uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+  return (void *)uc->uc_mcontext.pc;
+#else
+  return NULL;
+#endif
+}
+
+// records the crash, then lets the child die of the signal
+static void CrashSignalHandler(int sig, siginfo_t *info, void *context) {
+  InProcessInstrumentation *instrumentation = current_instrumentation;
+  if (instrumentation) instrumentation->OnCrash(sig, GetSignalPC(context), info->si_addr);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+// in the child only, the handlers don't block their
+// signal (SA_NODEFER) so that raising it again is fatal
+static void InstallCrashHandlers() {
+  // lets stack overflows in the harness be handled
+  stack_t ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.ss_sp = malloc(INPROCESS_ALT_STACK_SIZE);
+  ss.ss_size = INPROCESS_ALT_STACK_SIZE;
+  if (sigaltstack(&ss, NULL)) _exit(1);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+  action.sa_sigaction = CrashSignalHandler;
+  for (size_t i = 0; i < NUM_CRASH_SIGNALS; i++) {
+    sigaction(crash_signals[i], &action, NULL);
+  }
+}
+
+static bool ReadAll(int fd, void *buf, size_t size) {
+  char *ptr = (char *)buf;
+  while (size) {
+    ssize_t ret = recv(fd, ptr, size, 0);
+    if ((ret < 0) && (errno == EINTR)) continue;
+    if (ret <= 0) return false;
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+// the other side being gone is reported, not raised as SIGPIPE
+static bool WriteAll(int fd, const void *buf, size_t size) {
+  const char *ptr = (const char *)buf;
+  while (size) {
+    ssize_t ret = send(fd, ptr, size, MSG_NOSIGNAL);
+    if ((ret < 0) && (errno == EINTR)) continue;
+    if (ret <= 0) return false;
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static uint64_t GetTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+InProcessInstrumentation::InProcessInstrumentation() :
+  test_one_input(NULL), shared(NULL), shared_size(0), child_pid(0), child_fd(-1),
+  crash_signal(0), crash_pc(NULL), crash_address(NULL), crash_exit_code(0) { }
+
+InProcessInstrumentation::~InProcessInstrumentation() {
+  StopChild();
+  if (shared) munmap(shared, shared_size);
+}
+
+void InProcessInstrumentation::Init(int argc, char **argv) {
+  SanCovRegistry &registry = GetRegistry();
+
+  // the harness is shared by all instances
+  registry.load_mutex.Lock();
+  if (!registry.test_one_input) {
+    void *handle = RTLD_DEFAULT;
+    char *harness = GetOption("-harness", argc, argv);
+    if (harness) {
+      handle = dlopen(harness, RTLD_NOW);
+      if (!handle) FATAL("Error loading harness %s: %s", harness, dlerror());
+    }
+    registry.test_one_input = (TestOneInputFunc)dlsym(handle, "LLVMFuzzerTestOneInput");
+    if (!registry.test_one_input) {
+      FATAL("LLVMFuzzerTestOneInput not found, use -harness or link the harness in");
+    }
+
+    typedef int (*InitializeFunc)(int *argc, char ***argv);
+    InitializeFunc initialize = (InitializeFunc)dlsym(handle, "LLVMFuzzerInitialize");
+    if (initialize) initialize(&argc, &argv);
+
+    if (registry.num_guards <= 1) {
+      WARN("No coverage guards found, was the harness compiled with -fsanitize-coverage=trace-pc-guard?");
+    }
+  }
+  test_one_input = registry.test_one_input;
+  registry.load_mutex.Unlock();
+
+  UpdateGuards();
+}
+
+// modules loaded by the harness add new guards, the shared
+// state grows with them and the child is restarted to see it
+void InProcessInstrumentation::UpdateGuards() {
+  uint32_t num_guards = GetRegistry().num_guards;
+  if (shared && (shared->num_guards >= num_guards)) return;
+
+  StopChild();
+
+  size_t guard_state_size = (num_guards + sizeof(GuardHit) - 1) / sizeof(GuardHit) * sizeof(GuardHit);
+  size_t size = sizeof(SharedState) + guard_state_size + (size_t)num_guards * sizeof(GuardHit);
+  SharedState *new_shared = (SharedState *)mmap(NULL, size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (new_shared == MAP_FAILED) FATAL("Error allocating shared memory");
+  memset(new_shared, 0, sizeof(SharedState));
+  new_shared->num_guards = num_guards;
+  uint8_t *guard_state = (uint8_t *)(new_shared + 1);
+  memset(guard_state, GUARD_NOT_HIT, num_guards);
+
+  if (shared) {
+    // keep the ignored guards, coverage isn't kept
+    uint8_t *old_guard_state = GetGuardState();
+    for (uint32_t i = 0; i < shared->num_guards; i++) {
+      if (old_guard_state[i] == GUARD_IGNORED) guard_state[i] = GUARD_IGNORED;
+    }
+    munmap(shared, shared_size);
+  }
+
+  shared = new_shared;
+  shared_size = size;
+}
+
+void InProcessInstrumentation::StartChild() {
+  SanCovRegistry &registry = GetRegistry();
+  registry.spawn_mutex.Lock();
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    FATAL("Error creating a socket pair");
+  }
+
+  pid_t parent_pid = getpid();
+  pid_t pid = fork();
+  if (pid < 0) FATAL("Error creating a child process");
+
+  if (!pid) {
+    close(fds[0]);
+    child_fd = fds[1];
+    // don't outlive the fuzzer
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent_pid) _exit(0);
+    RunChild();
+  }
+
+  close(fds[1]);
+  registry.spawn_mutex.Unlock();
+
+  child_pid = pid;
+  child_fd = fds[0];
+}
+
+void InProcessInstrumentation::StopChild() {
+  if (!child_pid) return;
+  kill(child_pid, SIGKILL);
+  int status;
+  waitpid(child_pid, &status, 0);
+  close(child_fd);
+  child_pid = 0;
+  child_fd = -1;
+}
+
+// the child's loop: receives a sample, runs the harness on it
+// and reports back, until the fuzzer goes away or it crashes
+void InProcessInstrumentation::RunChild() {
+  current_instrumentation = this;
+  InstallCrashHandlers();
+
+  std::vector<uint8_t> data;
+  while (1) {
+    uint32_t size;
+    if (!ReadAll(child_fd, &size, sizeof(size))) _exit(0);
+    data.resize(size ? size : 1);
+    if (size && !ReadAll(child_fd, data.data(), size)) _exit(0);
+
+    test_one_input(data.data(), size);
+
+    uint32_t done = 0;
+    if (!WriteAll(child_fd, &done, sizeof(done))) _exit(0);
+  }
+}
+
+RunResult InProcessInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  UpdateGuards();
+  ClearCoverage();
+
+  crash_signal = 0;
+  crash_exit_code = 0;
+  crash_pc = NULL;
+  crash_address = NULL;
+  shared->crash_signal = 0;
+
+  uint32_t size = (uint32_t)current_sample.size;
+  bool sent = false;
+  // a child that was killed since the last run
+  // (e.g. with the thread that forked it) is replaced once
+  for (int attempt = 0; (attempt < 2) && !sent; attempt++) {
+    if (attempt) StopChild();
+    if (!child_pid) StartChild();
+    sent = WriteAll(child_fd, &size, sizeof(size)) &&
+           WriteAll(child_fd, current_sample.bytes, size);
+  }
+  if (!sent) FATAL("Error sending the sample to the child process");
+
+  uint64_t deadline = GetTimeUs() + (uint64_t)timeout * 1000;
+  while (1) {
+    uint64_t now = GetTimeUs();
+    if (now >= deadline) {
+      StopChild();
+      return HANG;
+    }
+    uint64_t remaining_ms = (deadline - now + 999) / 1000;
+
+    struct pollfd pfd;
+    pfd.fd = child_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, (remaining_ms > 0x7FFFFFFF) ? -1 : (int)remaining_ms);
+    if ((ret < 0) && (errno != EINTR)) FATAL("Error waiting for the child process");
+    if (ret <= 0) continue;
+
+    uint32_t done;
+    if (ReadAll(child_fd, &done, sizeof(done))) return OK;
+
+    // the child is gone
+    int status;
+    waitpid(child_pid, &status, 0);
+    close(child_fd);
+    child_pid = 0;
+    child_fd = -1;
+    return OnChildExit(status);
+  }
+}
+
+RunResult InProcessInstrumentation::OnChildExit(int status) {
+  if (WIFSIGNALED(status)) {
+    crash_signal = shared->crash_signal ? shared->crash_signal : WTERMSIG(status);
+    crash_pc = shared->crash_pc;
+    crash_address = shared->crash_address;
+    return CRASH;
+  }
+
+  // sanitizers report errors by exiting with an error code
+  if (WIFEXITED(status) && WEXITSTATUS(status)) {
+    crash_exit_code = WEXITSTATUS(status);
+    return CRASH;
+  }
+
+  return OK;
+}
+
+void InProcessInstrumentation::OnCrash(int sig, void *pc, void *address) {
+  shared->crash_signal = sig;
+  shared->crash_pc = pc;
+  shared->crash_address = address;
+}
+
+// in a fresh child, so that earlier runs can't affect the result
+RunResult InProcessInstrumentation::RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  StopChild();
+  return Run(argc, argv, init_timeout, timeout);
+}
+
+bool InProcessInstrumentation::HasNewCoverage() {
+  return shared->num_hits != 0;
+}
+
+void InProcessInstrumentation::GetCoverage(Coverage &coverage, bool clear_coverage) {
+  if (shared->num_hits) {
+    GuardHit *hits = GetHits();
+    SanCovRegistry &registry = GetRegistry();
+    registry.mutex.Lock();
+    for (GuardHit *iter = hits; iter != hits + shared->num_hits; iter++) {
+      SanCovModule *module = registry.FindModule(iter->index);
+      if (!module) continue;
+
+      uint64_t offset;
+      if (module->pcs) {
+        offset = module->pcs[(iter->index - module->first_index) * 2] - module->base;
+      } else {
+        // without a pc table, the return address of the callback
+        // identifies the block, remember it for IgnoreCoverage
+        offset = iter->pc - module->base;
+        module->offset_to_index[offset] = iter->index;
+      }
+
+      ModuleCoverage *module_coverage = GetModuleCoverage(coverage, module->name);
+      if (!module_coverage) {
+        coverage.push_back({ module->name, {} });
+        module_coverage = &coverage.back();
+      }
+      module_coverage->offsets.insert(offset);
+    }
+    registry.mutex.Unlock();
+  }
+
+  if (clear_coverage) ClearCoverage();
+}
+
+// only while the child is idle
+void InProcessInstrumentation::ClearCoverage() {
+  uint8_t *guard_state = GetGuardState();
+  GuardHit *hits = GetHits();
+  for (uint32_t i = 0; i < shared->num_hits; i++) {
+    if (guard_state[hits[i].index] == GUARD_HIT) guard_state[hits[i].index] = GUARD_NOT_HIT;
+  }
+  shared->num_hits = 0;
+}
+
+void InProcessInstrumentation::IgnoreCoverage(Coverage &coverage) {
+  UpdateGuards();
+  uint8_t *guard_state = GetGuardState();
+
+  SanCovRegistry &registry = GetRegistry();
+  registry.mutex.Lock();
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    SanCovModule *module = registry.FindModule(iter->module_name);
+    if (!module) continue;
+
+    for (auto offset : iter->offsets) {
+      auto found = module->offset_to_index.find(offset);
+      if (found == module->offset_to_index.end()) continue;
+
+      // the child disables the guard the next time it is hit
+      uint32_t index = found->second;
+      if (index < shared->num_guards) guard_state[index] = GUARD_IGNORED;
+    }
+  }
+  registry.mutex.Unlock();
+}
+
+std::string InProcessInstrumentation::GetCrashName() {
+  std::stringstream stream;
+  if (crash_exit_code) {
+    stream << "exit_" << crash_exit_code;
+    return stream.str();
+  }
+  stream << GetSignalName(crash_signal) << "_";
+  stream << AnonymizeAddress(crash_pc);
+  // the fault address is only meaningful for memory errors
+  if ((crash_signal == SIGSEGV) || (crash_signal == SIGBUS)) {
+    stream << "_";
+    stream << AnonymizeAddress(crash_address);
+  }
+  return stream.str();
+}
+
+#endif
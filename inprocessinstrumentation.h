@@ -0,0 +1,159 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "instrumentation.h"
+#include "sampledelivery.h"
+#include "sample.h"
+
+typedef int (*TestOneInputFunc)(const uint8_t *data, size_t size);
+
+// Runs an LLVMFuzzerTestOneInput-style harness without a separate
+// target binary.
+//
+// The harness is either a shared library given with -harness
+// or linked into the fuzzer. It has to be compiled with
+// -fsanitize-coverage=trace-pc-guard (pc-table is recommended,
+// it makes offsets point to basic block starts and lets coverage
+// restored from a previous session be ignored right away).
+// The fuzzer implements the coverage callbacks, each guard is
+// mapped to a module/offset pair.
+//
+// A crash or a timeout leaves the harness in an unknown state,
+// so the harness never runs in the fuzzer process itself. Each
+// instance forks a persistent child from the fuzzer (which has
+// the harness loaded and initialized) and sends it one sample per
+// run over a socket. The child records hit guards in memory shared
+// with the instance, and disables guards the instance ignores in
+// its own address space. A child that crashes or times out is gone
+// for good, the next run starts a fresh one, as does crash analysis.
+// Since every instance has its own child, the harness doesn't need
+// to be thread-safe.
+#define INPROCESS_ALT_STACK_SIZE (256 * 1024)
+
+#define GUARD_NOT_HIT 0
+#define GUARD_HIT 1
+#define GUARD_IGNORED 2
+
+class InProcessInstrumentation : public Instrumentation {
+public:
+  InProcessInstrumentation();
+  ~InProcessInstrumentation();
+
+  void Init(int argc, char **argv) override;
+
+  RunResult Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+  RunResult RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+
+  void CleanTarget() override { StopChild(); }
+
+  bool HasNewCoverage() override;
+  void GetCoverage(Coverage &coverage, bool clear_coverage) override;
+  void ClearCoverage() override;
+  void IgnoreCoverage(Coverage &coverage) override;
+
+  std::string GetCrashName() override;
+
+  // the sample is copied, a harness may keep modifying its input
+  void SetSample(Sample *sample) { current_sample = *sample; }
+
+  // called from the coverage callback in the child
+  void OnGuard(uint32_t *guard, uintptr_t pc) {
+    uint32_t index = *guard;
+    if (index >= shared->num_guards) return;
+    uint8_t *guard_state = GetGuardState();
+    if (guard_state[index] == GUARD_IGNORED) {
+      // only in the child's address space
+      *guard = 0;
+      return;
+    }
+    if (guard_state[index] != GUARD_NOT_HIT) return;
+    guard_state[index] = GUARD_HIT;
+    GetHits()[shared->num_hits++] = { index, pc };
+  }
+
+  // called from the crash signal handler in the child
+  void OnCrash(int sig, void *pc, void *address);
+
+protected:
+  struct GuardHit {
+    uint32_t index;
+    uintptr_t pc;
+  };
+
+  // shared with the child, followed by the guard
+  // states and by room for a hit on every guard
+  struct SharedState {
+    uint32_t num_guards;
+    uint32_t num_hits;
+    // written by the child's crash signal handler
+    int crash_signal;
+    void *crash_pc;
+    void *crash_address;
+  };
+
+  uint8_t *GetGuardState() {
+    return (uint8_t *)(shared + 1);
+  }
+  GuardHit *GetHits() {
+    size_t offset = (shared->num_guards + sizeof(GuardHit) - 1) / sizeof(GuardHit);
+    return (GuardHit *)GetGuardState() + offset;
+  }
+
+  void UpdateGuards();
+  void StartChild();
+  void StopChild();
+  void RunChild();
+  RunResult OnChildExit(int status);
+
+  TestOneInputFunc test_one_input;
+  Sample current_sample;
+
+  SharedState *shared;
+  size_t shared_size;
+
+  pid_t child_pid;
+  int child_fd;
+
+  int crash_signal;
+  void *crash_pc;
+  void *crash_address;
+  // set when the child exited with an error code
+  int crash_exit_code;
+};
+
+// hands the sample to the thread's InProcessInstrumentation
+class InProcessSampleDelivery : public SampleDelivery {
+public:
+  InProcessSampleDelivery(InProcessInstrumentation *instrumentation) :
+    instrumentation(instrumentation) { }
+
+  int DeliverSample(Sample *sample) override {
+    instrumentation->SetSample(sample);
+    return 1;
+  }
+
+protected:
+  InProcessInstrumentation *instrumentation;
+};
+
+#endif
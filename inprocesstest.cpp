@@ -0,0 +1,121 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Checks the in-process instrumentation: coverage of a trivial
+// harness, ignored coverage staying ignored only for the instance
+// that ignores it, and crashes and hangs ending the run (and the
+// child running the harness) but not the fuzzer.
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "sample.h"
+#include "inprocessinstrumentation.h"
+
+#define NUM_TEST_GUARDS 4
+#define TEST_TIMEOUT 1000
+#define TEST_HANG_TIMEOUT 200
+
+extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t *guard);
+extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop);
+
+// the harness, instrumented by hand so that
+// this builds without -fsanitize-coverage
+static uint32_t guards[NUM_TEST_GUARDS];
+
+__attribute__((constructor)) static void InitGuards() {
+  __sanitizer_cov_trace_pc_guard_init(guards, guards + NUM_TEST_GUARDS);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  __sanitizer_cov_trace_pc_guard(&guards[0]);
+  if (size && (data[0] == 'A')) {
+    __sanitizer_cov_trace_pc_guard(&guards[1]);
+  }
+  if (size && (data[0] == 'C')) {
+    __sanitizer_cov_trace_pc_guard(&guards[2]);
+    *(volatile int *)NULL = 0;
+  }
+  if (size && (data[0] == 'H')) {
+    __sanitizer_cov_trace_pc_guard(&guards[3]);
+    while (1) usleep(1000);
+  }
+  return 0;
+}
+
+static RunResult RunSample(InProcessInstrumentation *instrumentation, const char *input, uint32_t timeout) {
+  Sample sample;
+  sample.Init(input, strlen(input));
+  instrumentation->SetSample(&sample);
+  return instrumentation->Run(0, NULL, timeout, timeout);
+}
+
+static size_t RunAndCount(InProcessInstrumentation *instrumentation, const char *input) {
+  if (RunSample(instrumentation, input, TEST_TIMEOUT) != OK) {
+    FATAL("Unexpected run result");
+  }
+  Coverage coverage;
+  instrumentation->GetCoverage(coverage, true);
+  size_t num_offsets = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    num_offsets += iter->offsets.size();
+  }
+  return num_offsets;
+}
+
+int main(int argc, char **argv) {
+  InProcessInstrumentation *fuzzing = new InProcessInstrumentation();
+  fuzzing->Init(argc, argv);
+  // like the culling and triage threads, never ignores coverage
+  InProcessInstrumentation *helper = new InProcessInstrumentation();
+  helper->Init(argc, argv);
+
+  if (RunAndCount(fuzzing, "A") != 2) FATAL("Missed coverage");
+
+  Coverage coverage;
+  RunSample(fuzzing, "A", TEST_TIMEOUT);
+  fuzzing->GetCoverage(coverage, true);
+  fuzzing->IgnoreCoverage(coverage);
+  if (RunAndCount(fuzzing, "A") != 0) FATAL("Ignored coverage reported");
+  if (RunAndCount(helper, "A") != 2) FATAL("Helper missed coverage ignored by another instance");
+
+  if (RunSample(fuzzing, "C", TEST_TIMEOUT) != CRASH) FATAL("Crash not detected");
+  std::string crash_name = fuzzing->GetCrashName();
+  if (crash_name.compare(0, strlen("access_violation_"), "access_violation_")) {
+    FATAL("Unexpected crash name %s", crash_name.c_str());
+  }
+  fuzzing->ClearCoverage();
+
+  if (RunSample(fuzzing, "H", TEST_HANG_TIMEOUT) != HANG) FATAL("Hang not detected");
+  fuzzing->ClearCoverage();
+
+  // runs after a crash or a hang start from a fresh
+  // child that still ignores the ignored coverage
+  if (RunAndCount(fuzzing, "A") != 0) FATAL("Ignored coverage reported after a crash");
+  if (RunAndCount(fuzzing, "B") != 0) FATAL("Ignored coverage reported after a crash");
+
+  if (fuzzing->RunWithCrashAnalysis(0, NULL, TEST_TIMEOUT, TEST_TIMEOUT) != OK) {
+    FATAL("Unexpected crash analysis result");
+  }
+
+  delete helper;
+  delete fuzzing;
+
+  printf("OK\n");
+  return 0;
+}
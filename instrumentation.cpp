@@ -19,9 +19,16 @@ limitations under the License.
 #include "common.h"
 #include "instrumentation.h"
 #include "litecov.h"
+#include "profiler.h"
 
+#include <signal.h>
 #include <sstream>
 
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 std::string Instrumentation::AnonymizeAddress(void* addr) {
   char buf[20];
   sprintf(buf, "%p", addr);
@@ -39,9 +46,57 @@ std::string Instrumentation::AnonymizeAddress(void* addr) {
   return std::string(buf);
 }
 
+char **Instrumentation::GetTargetArgv(int argc, char **argv) {
+  for (int i = 1; i < argc - 1; i++) {
+    if (!strcmp(argv[i], "--")) return argv + i + 1;
+  }
+  FATAL("No target command line given");
+  return NULL;
+}
+
+std::string Instrumentation::GetSignalName(int signal) {
+  switch (signal) {
+  case SIGSEGV:
+#ifdef SIGBUS
+  case SIGBUS:
+#endif
+    return "access_violation";
+  case SIGILL:
+    return "illegal_instruction";
+  case SIGFPE:
+    return "arithmetic_error";
+  case SIGABRT:
+    return "abort";
+  default:
+    return "signal_" + std::to_string(signal);
+  }
+}
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+void Instrumentation::OpenInputFile(int *fd, const std::string &filename) {
+  if (*fd >= 0) close(*fd);
+  *fd = open(filename.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (*fd < 0) FATAL("Error opening %s", filename.c_str());
+}
+#endif
+
+// records when the target reaches its entry point, where starting
+// ends for targets that run without a target function
+class EntryTimedLiteCov final : public LiteCov {
+public:
+  EntryTimedLiteCov(uint64_t *entry_ns) : entry_ns(entry_ns) { }
+
+protected:
+  void OnEntrypoint() override {
+    *entry_ns = ProfileNow();
+    LiteCov::OnEntrypoint();
+  }
+
+  uint64_t *entry_ns;
+};
 
 void TinyInstInstrumentation::Init(int argc, char **argv) {
-  instrumentation = new LiteCov();
+  instrumentation = new EntryTimedLiteCov(&target_entry_ns);
   instrumentation->Init(argc, argv);
 
   persist = GetBinaryOption("-persist", argc, argv, false);
@@ -51,6 +106,7 @@ void TinyInstInstrumentation::Init(int argc, char **argv) {
 RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
   DebuggerStatus status;
   RunResult ret = OTHER_ERROR;
+  target_start_ns = 0;
 
   if (instrumentation->IsTargetFunctionDefined()) {
     if (cur_iteration == num_iterations) {
@@ -74,7 +130,16 @@ RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_time
   } else {
     instrumentation->Kill();
     cur_iteration = 0;
+    uint64_t start_ns = ProfileNow();
+    target_entry_ns = 0;
     status = instrumentation->Run(argc, argv, timeout1);
+    if (instrumentation->IsTargetFunctionDefined()) {
+      // up to the target function
+      target_start_ns += ProfileNow() - start_ns;
+    } else if (target_entry_ns) {
+      // the run itself starts at the entry point
+      target_start_ns += target_entry_ns - start_ns;
+    }
   }
 
   // if target function is defined,
@@ -85,7 +150,9 @@ RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_time
       WARN("Target function not reached, retrying with a clean process\n");
       instrumentation->Kill();
       cur_iteration = 0;
+      uint64_t start_ns = ProfileNow();
       status = instrumentation->Run(argc, argv, init_timeout);
+      target_start_ns += ProfileNow() - start_ns;
     }
 
     if (status != DEBUGGER_TARGET_START) {
@@ -41,10 +41,27 @@ public:
 
   virtual std::string GetCrashName() { return "crash"; };
 
+  // nanoseconds the last Run spent starting the target (and reaching
+  // the target function), 0 if it reused a running target
+  virtual uint64_t GetTargetStartTime() { return 0; }
+
+  // the sample file, for backends that give it to the target as stdin
+  virtual void SetInputFile(const std::string &filename) { }
+
   std::string AnonymizeAddress(void* addr);
+
+protected:
+  // the target command line after "--", FATAL if there is none
+  static char **GetTargetArgv(int argc, char **argv);
+  // access_violation, abort, ... for the signal that ended the target
+  static std::string GetSignalName(int signal);
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+  // (re)opens *fd read-only on filename
+  static void OpenInputFile(int *fd, const std::string &filename);
+#endif
 };
 
-class LiteCov;
+class EntryTimedLiteCov;
 
 class TinyInstInstrumentation : public Instrumentation {
 public:
@@ -64,9 +81,14 @@ public:
 
   std::string GetCrashName() override;
 
+  uint64_t GetTargetStartTime() override { return target_start_ns; }
+
 protected:
-  LiteCov * instrumentation;
+  EntryTimedLiteCov * instrumentation;
   bool persist;
   int num_iterations;
   int cur_iteration;
+  uint64_t target_start_ns;
+  // when the target last reached its entry point
+  uint64_t target_entry_ns;
 };
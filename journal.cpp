@@ -0,0 +1,129 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include <windows.h>
+#endif
+
+#include <vector>
+#include "common.h"
+#include "journal.h"
+
+struct JournalRecordHeader {
+  uint32_t type;
+  uint32_t size;
+};
+
+bool Journal::Open(const std::string &path) {
+  Close();
+  this->path = path;
+  fp = fopen(path.c_str(), "ab");
+  if (!fp) return false;
+  fseek(fp, 0, SEEK_END);
+  file_size = ftell(fp);
+  return true;
+}
+
+void Journal::Close() {
+  if (!fp) return;
+  Flush();
+  fclose(fp);
+  fp = NULL;
+}
+
+void Journal::EncodeRecord(std::string &out, uint32_t type, const void *data, size_t size) {
+  JournalRecordHeader header;
+  header.type = type;
+  header.size = (uint32_t)size;
+  out.append((char *)&header, sizeof(header));
+  out.append((const char *)data, size);
+}
+
+void Journal::Append(uint32_t type, const void *data, size_t size) {
+  EncodeRecord(buffer, type, data, size);
+}
+
+bool Journal::Flush() {
+  if (!fp) return false;
+  if (buffer.empty()) return true;
+  if (fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size()) return false;
+  if (fflush(fp)) return false;
+  file_size += buffer.size();
+  buffer.clear();
+  return true;
+}
+
+bool Journal::Compact(const std::string &snapshot) {
+  std::string tmp_path = path + ".tmp";
+  FILE *tmp_fp = fopen(tmp_path.c_str(), "wb");
+  if (!tmp_fp) return false;
+  bool ok = (fwrite(snapshot.data(), 1, snapshot.size(), tmp_fp) == snapshot.size());
+  if (fclose(tmp_fp)) ok = false;
+  if (!ok) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+
+  // everything buffered is part of the snapshot
+  buffer.clear();
+  if (fp) fclose(fp);
+  fp = NULL;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  ok = MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  ok = (rename(tmp_path.c_str(), path.c_str()) == 0);
+#endif
+
+  if (!Open(path)) return false;
+  return ok;
+}
+
+bool Journal::Read(const std::string &path,
+                   std::function<void(uint32_t type, const char *data, uint32_t size)> callback)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) return false;
+
+  fseek(fp, 0, SEEK_END);
+  uint64_t size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  uint64_t pos = 0;
+
+  std::vector<char> payload;
+  while (1) {
+    JournalRecordHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1) break;
+    pos += sizeof(header);
+    // checked before allocating, the size of a torn header is garbage
+    if (header.size > size - pos) {
+      WARN("Ignoring incomplete record at the end of %s", path.c_str());
+      break;
+    }
+    payload.resize(header.size);
+    if (header.size && (fread(&payload[0], 1, header.size, fp) != header.size)) {
+      WARN("Ignoring incomplete record at the end of %s", path.c_str());
+      break;
+    }
+    pos += header.size;
+    callback(header.type, header.size ? &payload[0] : NULL, header.size);
+  }
+
+  fclose(fp);
+  return true;
+}
@@ -0,0 +1,72 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <functional>
+
+// Append-only file of typed records. Records are buffered in
+// memory and written out by Flush(), so appending is cheap and
+// a save only costs the size of the changes since the last one.
+// Compact() replaces the whole file with a snapshot.
+//
+// On disk, each record is a {uint32_t type, uint32_t size} header
+// followed by size bytes of payload. A record cut short by a crash
+// at the end of the file is ignored when reading.
+//
+// Not thread safe, callers need to synchronize.
+class Journal {
+public:
+  Journal() : fp(NULL), file_size(0) { }
+  ~Journal() { Close(); }
+
+  // opens (or creates) the journal for appending
+  bool Open(const std::string &path);
+  void Close();
+
+  void Append(uint32_t type, const void *data, size_t size);
+  void Append(uint32_t type, const std::string &data) {
+    Append(type, data.data(), data.size());
+  }
+
+  // writes out buffered records
+  bool Flush();
+
+  // replaces the journal (including anything still buffered)
+  // with the records in snapshot, which should be built with
+  // EncodeRecord(). The old journal stays intact until the
+  // new one is completely written.
+  bool Compact(const std::string &snapshot);
+
+  // bytes on disk plus bytes buffered
+  uint64_t Size() { return file_size + buffer.size(); }
+
+  static void EncodeRecord(std::string &out, uint32_t type, const void *data, size_t size);
+
+  // calls callback for every complete record in the file,
+  // returns false if the file can't be opened
+  static bool Read(const std::string &path,
+                   std::function<void(uint32_t type, const char *data, uint32_t size)> callback);
+
+protected:
+  std::string path;
+  FILE *fp;
+  uint64_t file_size;
+  std::string buffer;
+};
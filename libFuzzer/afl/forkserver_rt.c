@@ -0,0 +1,158 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Target-side fork server runtime for -instrumentation forkserver,
+// a small replacement for AFL's afl-llvm-rt.o that speaks the same
+// protocol. It provides __afl_manual_init and __afl_persistent_loop
+// used by afl_driver.cpp and the trace-pc-guard callbacks, which
+// count guard hits in the shared memory map.
+//
+// Usage:
+//   clang -g -fsanitize-coverage=trace-pc-guard test_fuzzer.cc -c
+//   clang -c forkserver_rt.c
+//   clang++ afl_driver.cpp test_fuzzer.o forkserver_rt.o -o target
+//   fuzzer -in IN -out OUT -instrumentation forkserver -- ./target
+//
+// Guards get map indices in the order they are initialized, so
+// offsets reported by the fuzzer stay the same between runs.
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAP_SIZE (1 << 16)
+#define FORKSRV_FD 198
+
+static uint8_t dummy_area[MAP_SIZE];
+uint8_t *__afl_area_ptr = dummy_area;
+
+static int is_persistent;
+
+static void map_shm(void) {
+  char *id = getenv("__AFL_SHM_ID");
+  if (!id) return;
+  void *area = shmat(atoi(id), NULL, 0);
+  if (area == (void *)-1) _exit(1);
+  __afl_area_ptr = (uint8_t *)area;
+  // tells the fuzzer that the map is used
+  __afl_area_ptr[0] = 1;
+}
+
+static void start_forkserver(void) {
+  static pid_t child_pid;
+  int child_stopped = 0;
+  uint32_t hello = 0;
+
+  // not running under the fuzzer
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
+
+  while (1) {
+    uint32_t was_killed;
+    int status;
+
+    if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
+
+    // the fuzzer killed the stopped child after a timeout
+    if (child_stopped && was_killed) {
+      child_stopped = 0;
+      if (waitpid(child_pid, &status, 0) < 0) _exit(1);
+    }
+
+    if (!child_stopped) {
+      child_pid = fork();
+      if (child_pid < 0) _exit(1);
+      if (!child_pid) {
+        close(FORKSRV_FD);
+        close(FORKSRV_FD + 1);
+        return;
+      }
+    } else {
+      // persistent mode, resume the child for the next iteration
+      kill(child_pid, SIGCONT);
+      child_stopped = 0;
+    }
+
+    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
+    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0) _exit(1);
+    if (WIFSTOPPED(status)) child_stopped = 1;
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+  }
+}
+
+void __afl_manual_init(void) {
+  static int init_done;
+  if (init_done) return;
+  init_done = 1;
+  map_shm();
+  start_forkserver();
+}
+
+// in persistent mode the child stops itself after every
+// iteration and the fork server resumes it for the next one
+int __afl_persistent_loop(unsigned int max_cnt) {
+  static int first_pass = 1;
+  static unsigned int cycle_cnt;
+
+  if (first_pass) {
+    // coverage from initialization doesn't belong to the first sample
+    if (is_persistent) {
+      memset(__afl_area_ptr, 0, MAP_SIZE);
+      __afl_area_ptr[0] = 1;
+    }
+    cycle_cnt = max_cnt;
+    first_pass = 0;
+    return 1;
+  }
+
+  if (is_persistent) {
+    if (--cycle_cnt) {
+      raise(SIGSTOP);
+      __afl_area_ptr[0] = 1;
+      return 1;
+    }
+    // whatever runs until exit doesn't count
+    __afl_area_ptr = dummy_area;
+  }
+
+  return 0;
+}
+
+// has to run after afl_driver's constructor (priority 0), which may
+// clear __AFL_DEFER_FORKSRV, and before unprioritized constructors of
+// the harness. 101 is the first priority not reserved for the toolchain.
+__attribute__((constructor(101))) static void auto_init(void) {
+  is_persistent = getenv("__AFL_PERSISTENT") != NULL;
+  if (getenv("__AFL_DEFER_FORKSRV")) return;
+  __afl_manual_init();
+}
+
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+  __afl_area_ptr[*guard]++;
+}
+
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+  static uint32_t next_index = 1;
+  if ((start == stop) || *start) return;
+  for (uint32_t *guard = start; guard < stop; guard++) {
+    *guard = next_index;
+    next_index = next_index % (MAP_SIZE - 1) + 1;
+  }
+}
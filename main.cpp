@@ -25,27 +25,39 @@ class MyFuzzer : public Fuzzer {
 Mutator *MyFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc) {
   // a pretty simple non-deterministic mutation strategy
 
-  PSelectMutator *pselect = new PSelectMutator();
-
-  // select one of the mutators below with corresponding
-  // probablilities
-  pselect->AddMutator(new ByteFlipMutator(), 1);
-  pselect->AddMutator(new AppendMutator(1, 128), 0.2);
-  pselect->AddMutator(new BlockInsertMutator(1, 128), 0.1);
-  pselect->AddMutator(new BlockFlipMutator(2, 16), 0.1);
-  pselect->AddMutator(new BlockFlipMutator(16, 64), 0.1);
-  pselect->AddMutator(new BlockFlipMutator(1, 64, true), 0.1);
-  pselect->AddMutator(new BlockDuplicateMutator(1, 128, 1, 8), 0.1);
-  pselect->AddMutator(new InterstingValueMutator(true), 0.1);
-  pselect->AddMutator(new SpliceMutator(1, 0.5), 0.1);
-  pselect->AddMutator(new SpliceMutator(2, 0.5), 0.1);
-
-  // potentially repeat the mutation
-  // (do two or more mutations in a single cycle
-  RepeatMutator *repeater = new RepeatMutator(pselect, 0.5);
+  AdaptiveMutator *adaptive = new AdaptiveMutator();
+
+  // select one or more (stacked) of the mutators below, starting
+  // with the corresponding probabilities, which are then adjusted
+  // to how often each one finds new coverage
+  adaptive->AddMutator(new ByteFlipMutator(), 1, "byte_flip");
+  adaptive->AddMutator(new AppendMutator(1, 128), 0.2, "append");
+  adaptive->AddMutator(new BlockInsertMutator(1, 128), 0.1, "block_insert");
+  adaptive->AddMutator(new BlockFlipMutator(2, 16), 0.1, "block_flip_2_16");
+  adaptive->AddMutator(new BlockFlipMutator(16, 64), 0.1, "block_flip_16_64");
+  adaptive->AddMutator(new BlockFlipMutator(1, 64, true), 0.1, "block_flip_uniform");
+  adaptive->AddMutator(new BlockDuplicateMutator(1, 128, 1, 8), 0.1, "block_duplicate");
+  adaptive->AddMutator(new InterstingValueMutator(true), 0.1, "interesting_value");
+  adaptive->AddMutator(new SpliceMutator(1, 0.5), 0.1, "splice_1");
+  adaptive->AddMutator(new SpliceMutator(2, 0.5), 0.1, "splice_2");
+
+  // tokens from -dict files and the input corpus
+  if (GetDictionary()->Size()) {
+    adaptive->AddMutator(new DictionaryMutator(GetDictionary()), 0.2, "dictionary");
+  }
+
+  // new samples first get a deterministic stage (bit and byte flips,
+  // arithmetic, interesting values) in part of each round, after which
+  // havoc favors the bytes where it found something
+  Mutator *havoc = adaptive;
+  if (!GetBinaryOption("-no_deterministic", argc, argv, false)) {
+    havoc = new DeterministicMutator(adaptive,
+                                     GetIntOption("-det_max_size", argc, argv, DET_MAX_SAMPLE_SIZE),
+                                     GetIntOption("-det_max_execs", argc, argv, DET_MAX_EXECS));
+  }
 
   // and have 1000 rounds of this per sample cycle
-  NRoundMutator *mutator = new NRoundMutator(repeater, 1000);
+  NRoundMutator *mutator = new NRoundMutator(havoc, 1000);
 
   return mutator;
 }
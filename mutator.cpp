@@ -14,242 +14,479 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "common.h"
 #include "mutator.h"
 
 int Mutator::GetRandBlock(size_t samplesize, size_t minblocksize, size_t maxblocksize, size_t *blockstart, size_t *blocksize, PRNG *prng) {
-  if (samplesize == 0) return 0;
-  if (samplesize < minblocksize) return 0;
-  if (samplesize < maxblocksize) maxblocksize = samplesize;
-  *blocksize = prng->Rand((int)minblocksize, (int)maxblocksize);
-  *blockstart = prng->Rand(0, (int)(samplesize - (*blocksize)));
-  return 1;
-}
-
-bool ByteFlipMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In ByteFlipMutator::Mutate\n");
-  if (inout_sample->size == 0) return true;
-  int charpos = prng->Rand(0, (int)(inout_sample->size - 1));
-  char c = (char)prng->Rand(0, 255);
-  inout_sample->bytes[charpos] = c;
-  return true;
+  return ::GetRandBlock(samplesize, minblocksize, maxblocksize, blockstart, blocksize, *prng);
+}
+
+// uniform on (0, 1]
+static double RandOpen(PRNG *prng) {
+  return (prng->Rand() + 1.0) / 4294967296.0;
+}
+
+static double RandNormal(PRNG *prng) {
+  // Box-Muller
+  return sqrt(-2.0 * log(RandOpen(prng))) * cos(2 * 3.14159265358979323846 * RandOpen(prng));
+}
+
+// Marsaglia-Tsang, shape >= 1
+static double RandGamma(PRNG *prng, double shape) {
+  double d = shape - 1.0 / 3;
+  double c = 1 / sqrt(9 * d);
+  while (1) {
+    double x = RandNormal(prng);
+    double v = 1 + c * x;
+    if (v <= 0) continue;
+    v = v * v * v;
+    if (log(RandOpen(prng)) < 0.5 * x * x + d - d * v + d * log(v)) return d * v;
+  }
+}
+
+static double RandBeta(PRNG *prng, double a, double b) {
+  double x = RandGamma(prng, a);
+  double y = RandGamma(prng, b);
+  return x / (x + y);
+}
+
+AdaptiveMutator::AdaptiveMutator() {
+  operator_weight_sum = 0;
+  depth_weight_sum = 0;
+  num_results = 0;
+  used_depth = -1;
+  // shallow stacks are favored at first, the prior
+  // halves with every doubling of the depth
+  double p = 0.5;
+  for (int depth = 1; depth <= ADAPTIVE_MAX_STACK; depth *= 2) {
+    if (depth == ADAPTIVE_MAX_STACK) p *= 2;
+    depths.push_back({ "stack_" + std::to_string(depth), p, 0, 0, 0, 0, p, false });
+    depth_weight_sum += p;
+    p /= 2;
+  }
+}
+
+void AdaptiveMutator::AddMutator(Mutator *mutator, double p, const char *name) {
+  child_mutators.push_back(mutator);
+  operators.push_back({ name, p, 0, 0, 0, 0, p, false });
+  operator_weight_sum += p;
+  used_operators.reserve(operators.size());
+}
+
+void AdaptiveMutator::InitRound(Sample *input_sample, MutatorSampleContext *context) {
+  for (size_t i = 0; i < child_mutators.size(); i++) {
+    child_mutators[i]->InitRound(input_sample, ((SampleContextVector *)context)->contexts[i]);
+  }
+}
+
+MutatorSampleContext *AdaptiveMutator::CreateSampleContext(Sample *sample) {
+  SampleContextVector *context = new SampleContextVector;
+  context->contexts.resize(child_mutators.size());
+  for (size_t i = 0; i < child_mutators.size(); i++) {
+    context->contexts[i] = child_mutators[i]->CreateSampleContext(sample);
+  }
+  return context;
+}
+
+void AdaptiveMutator::SetEnergy(double energy) {
+  for (size_t i = 0; i < child_mutators.size(); i++) {
+    child_mutators[i]->SetEnergy(energy);
+  }
+}
+
+void AdaptiveMutator::Resample(PRNG *prng) {
+  operator_weight_sum = 0;
+  for (auto &arm : operators) {
+    arm.weight = arm.prior * RandBeta(prng, arm.finds + 1, arm.execs - arm.finds + 1);
+    operator_weight_sum += arm.weight;
+  }
+  depth_weight_sum = 0;
+  for (auto &arm : depths) {
+    arm.weight = arm.prior * RandBeta(prng, arm.finds + 1, arm.execs - arm.finds + 1);
+    depth_weight_sum += arm.weight;
+  }
+}
+
+int AdaptiveMutator::Select(std::vector<Arm> &arms, double weight_sum, PRNG *prng) {
+  double p = prng->RandReal() * weight_sum;
+  double sum = 0;
+  for (size_t i = 0; i + 1 < arms.size(); i++) {
+    sum += arms[i].weight;
+    if (p < sum) return (int)i;
+  }
+  return (int)arms.size() - 1;
 }
 
-bool BlockFlipMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In BlockFlipMutator::Mutate\n");
-  size_t blocksize, blockpos;
-  if (!GetRandBlock(inout_sample->size, min_block_size, max_block_size, &blockpos, &blocksize, prng)) return true;
-  if (uniform) {
-    char c = (char)prng->Rand(0, 255);
-    for (size_t i = 0; i<blocksize; i++) {
-      inout_sample->bytes[blockpos + i] = c;
+bool AdaptiveMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  if (child_mutators.empty()) return false;
+
+  if ((num_results % ADAPTIVE_RESAMPLE_EXECS) == 0) Resample(prng);
+
+  used_depth = Select(depths, depth_weight_sum, prng);
+  int depth = 1 << used_depth;
+
+  bool ret = true;
+  for (int i = 0; i < depth; i++) {
+    int index = Select(operators, operator_weight_sum, prng);
+    if (!operators[index].used) {
+      operators[index].used = true;
+      used_operators.push_back(index);
     }
-  } else {
-    for (size_t i = 0; i<blocksize; i++) {
-      inout_sample->bytes[blockpos + i] = (char)prng->Rand(0, 255);
+    bool mutated = child_mutators[index]->Mutate(inout_sample, prng, all_samples);
+    // like RepeatMutator, the first mutation decides
+    if (!i) ret = mutated;
+  }
+  return ret;
+}
+
+void AdaptiveMutator::Credit(Arm &arm, bool found) {
+  arm.execs++;
+  arm.total_execs++;
+  if (found) {
+    arm.finds++;
+    arm.total_finds++;
+  }
+}
+
+void AdaptiveMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  // known crashes are hit over and over, crediting
+  // them would reward operators that keep hitting them
+  bool found = has_new_coverage;
+
+  for (auto index : used_operators) {
+    Credit(operators[index], found);
+    operators[index].used = false;
+    child_mutators[index]->NotifyResult(result, has_new_coverage);
+  }
+  used_operators.clear();
+  if (used_depth >= 0) Credit(depths[used_depth], found);
+  used_depth = -1;
+
+  num_results++;
+  if ((num_results % ADAPTIVE_DECAY_EXECS) == 0) {
+    for (auto &arm : operators) {
+      arm.execs *= ADAPTIVE_DECAY;
+      arm.finds *= ADAPTIVE_DECAY;
+    }
+    for (auto &arm : depths) {
+      arm.execs *= ADAPTIVE_DECAY;
+      arm.finds *= ADAPTIVE_DECAY;
+    }
+  }
+}
+
+// one "name execs finds total_execs total_finds" line per arm,
+// arms are matched by name when loading
+bool AdaptiveMutator::SaveState(std::string &state) {
+  char line[256];
+  for (auto arms : { &operators, &depths }) {
+    for (auto &arm : *arms) {
+      snprintf(line, sizeof(line), "%s %.17g %.17g %llu %llu\n", arm.name.c_str(),
+               arm.execs, arm.finds,
+               (unsigned long long)arm.total_execs, (unsigned long long)arm.total_finds);
+      state += line;
     }
   }
   return true;
 }
 
-bool AppendMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In AppendMutator::Mutate\n");
-  size_t old_size = inout_sample->size;
-  if (old_size >= MAX_SAMPLE_SIZE) return true;
-  size_t append = prng->Rand(min_append, max_append);
-  if ((old_size + append) > MAX_SAMPLE_SIZE) {
-    append = MAX_SAMPLE_SIZE - old_size;
+void AdaptiveMutator::LoadState(const std::string &state) {
+  size_t pos = 0;
+  while (pos < state.size()) {
+    size_t end = state.find('\n', pos);
+    if (end == std::string::npos) end = state.size();
+    std::string line = state.substr(pos, end - pos);
+    pos = end + 1;
+
+    char name[128];
+    double execs, finds;
+    unsigned long long total_execs, total_finds;
+    if (sscanf(line.c_str(), "%127s %lg %lg %llu %llu", name, &execs, &finds, &total_execs, &total_finds) != 5) continue;
+    if (finds > execs) continue;
+
+    for (auto arms : { &operators, &depths }) {
+      for (auto &arm : *arms) {
+        if (arm.name != name) continue;
+        arm.execs = execs;
+        arm.finds = finds;
+        arm.total_execs = total_execs;
+        arm.total_finds = total_finds;
+      }
+    }
   }
-  if (append <= 0) return true;
-  size_t new_size = old_size + append;
-  inout_sample->bytes =
-    (char *)realloc(inout_sample->bytes, new_size);
-  inout_sample->size = new_size;
-  for (size_t i = old_size; i < new_size; i++) {
-    inout_sample->bytes[i] = (char)prng->Rand(0, 255);
+}
+
+void AdaptiveMutator::GetStats(std::vector<MutatorStats> &stats) {
+  for (auto &arm : operators) {
+    stats.push_back({ arm.name, arm.total_execs, arm.total_finds,
+                      operator_weight_sum ? arm.weight / operator_weight_sum : 0 });
+  }
+  for (auto &arm : depths) {
+    stats.push_back({ arm.name, arm.total_execs, arm.total_finds,
+                      depth_weight_sum ? arm.weight / depth_weight_sum : 0 });
   }
-  return true;
 }
 
-bool BlockInsertMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In BlockInsertMutator::Mutate\n");
-  size_t old_size = inout_sample->size;
-  if (old_size >= MAX_SAMPLE_SIZE) return true;
-  size_t to_insert = prng->Rand(min_insert, max_insert);
-  if ((old_size + to_insert) > MAX_SAMPLE_SIZE) {
-    to_insert = MAX_SAMPLE_SIZE - old_size;
-  }
-  size_t where = prng->Rand(0, (int)old_size);
-  size_t new_size = old_size + to_insert;
-  if (to_insert <= 0) return true;
-  
-  char *old_bytes = inout_sample->bytes;
-  char *new_bytes = (char *)malloc(new_size);
-  memcpy(new_bytes, old_bytes, where);
-  
-  for (size_t i = 0; i < to_insert; i++) {
-    new_bytes[where + i] = (char)prng->Rand(0, 255);
-  }
-  
-  memcpy(new_bytes + where + to_insert, old_bytes + where, old_size - where);
-
-  if (old_bytes) free(old_bytes);
-  inout_sample->bytes = new_bytes;
-  inout_sample->size = new_size;
-  return true;
+static const int32_t interesting_8[] = {
+  -128, -1, 0, 1, 16, 32, 64, 100, 127
+};
+
+static const int32_t interesting_16[] = {
+  -128, -1, 0, 1, 16, 32, 64, 100, 127,
+  -32768, -129, 128, 255, 256, 512, 1000, 1024, 4096, 32767
+};
+
+static const int32_t interesting_32[] = {
+  -128, -1, 0, 1, 16, 32, 64, 100, 127,
+  -32768, -129, 128, 255, 256, 512, 1000, 1024, 4096, 32767,
+  (int32_t)0x80000000, -100663046, -32769, 32768, 65535, 65536, 100663045, 2147483647
+};
+
+#define NUM_INTERESTING_8 (int)(sizeof(interesting_8) / sizeof(interesting_8[0]))
+#define NUM_INTERESTING_16 (int)(sizeof(interesting_16) / sizeof(interesting_16[0]))
+#define NUM_INTERESTING_32 (int)(sizeof(interesting_32) / sizeof(interesting_32[0]))
+
+// bytes changed by each mutation of a stage
+static size_t StageWidth(int stage) {
+  switch (stage) {
+  case DET_ARITH_16:
+  case DET_INTERESTING_16:
+    return 2;
+  case DET_ARITH_32:
+  case DET_INTERESTING_32:
+    return 4;
+  default:
+    return 1;
+  }
 }
 
-bool BlockDuplicateMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In BlockDuplicateMutator::Mutate\n");
-  if (inout_sample->size >= MAX_SAMPLE_SIZE) return true;
-  size_t blockpos, blocksize;
-  if (!GetRandBlock(inout_sample->size, min_block_size, max_block_size, &blockpos, &blocksize, prng)) return true;
-  int64_t blockcount = prng->Rand(min_duplicate_cnt, max_duplicate_cnt);
-  if ((inout_sample->size + blockcount * blocksize) > MAX_SAMPLE_SIZE)
-    blockcount = (MAX_SAMPLE_SIZE - (int64_t)inout_sample->size) / blocksize;
-  if (blockcount <= 0) return true;
-  char *newbytes;
-  newbytes = (char *)malloc(inout_sample->size + blockcount * blocksize);
-  memcpy(newbytes, inout_sample->bytes, blockpos + blocksize);
-  for (size_t i = 0; i<blockcount; i++) {
-    memcpy(newbytes + blockpos + (i + 1)*blocksize, inout_sample->bytes + blockpos, blocksize);
-  }
-  memcpy(newbytes + blockpos + (blockcount + 1)*blocksize, 
-         inout_sample->bytes + blockpos + blocksize,
-         inout_sample->size - blockpos - blocksize);
-  if (inout_sample->bytes) free(inout_sample->bytes);
-  inout_sample->bytes = newbytes;
-  inout_sample->size = inout_sample->size + blockcount * blocksize;
-  return true;
+// mutations of a stage at each position
+static int StageSteps(int stage) {
+  switch (stage) {
+  case DET_BIT_FLIP: return 8;
+  case DET_BYTE_FLIP: return 1;
+  case DET_ARITH_8: return 2 * DET_ARITH_MAX;
+  case DET_ARITH_16: return 2 * 2 * DET_ARITH_MAX;
+  case DET_ARITH_32: return 2 * 2 * DET_ARITH_MAX;
+  case DET_INTERESTING_8: return NUM_INTERESTING_8;
+  case DET_INTERESTING_16: return 2 * NUM_INTERESTING_16;
+  case DET_INTERESTING_32: return 2 * NUM_INTERESTING_32;
+  default: return 0;
+  }
 }
 
-void InterstingValueMutator::AddInterestingValue(char *data, size_t size) {
-  Sample interesting_sample;
-  interesting_sample.Init(data, size);
-  interesting_values.push_back(interesting_sample);
+static uint32_t ReadValue(const char *bytes, size_t width, bool big_endian) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < width; i++) {
+    uint8_t byte = (uint8_t)bytes[big_endian ? i : (width - 1 - i)];
+    value = (value << 8) | byte;
+  }
+  return value;
 }
 
-bool InterstingValueMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  // printf("In InterstingValueMutator::Mutate\n");
-  if (interesting_values.empty()) return true;
-  Sample *interesting_sample = &interesting_values[prng->Rand(0, (int)interesting_values.size() - 1)];
-  size_t blockstart, blocksize;
-  if (!GetRandBlock(inout_sample->size, interesting_sample->size, interesting_sample->size, &blockstart, &blocksize, prng)) return true;
-  memcpy(inout_sample->bytes + blockstart, interesting_sample->bytes, interesting_sample->size);
-  return true;
+static void WriteValue(char *bytes, size_t width, bool big_endian, uint32_t value) {
+  for (size_t i = 0; i < width; i++) {
+    bytes[big_endian ? (width - 1 - i) : i] = (char)(value & 0xFF);
+    value >>= 8;
+  }
 }
 
-InterstingValueMutator::InterstingValueMutator(bool use_default_values) {
-  if (!use_default_values) return;
-  uint16_t i_word;
-  i_word = 0; AddInterestingValue((char *)(&i_word), sizeof(i_word));
-  i_word = 0xFFFF; AddInterestingValue((char *)(&i_word), sizeof(i_word));
-  i_word = 1;
-  for (int i = 0; i < 16; i++) {
-    AddInterestingValue((char *)(&i_word), sizeof(i_word));
-    i_word = (i_word << 1);
-  }
-  uint32_t i_dword;
-  i_dword = 0; AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
-  i_dword = 0xFFFFFFFF; AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
-  i_dword = 1;
-  for (int i = 0; i < 16; i++) {
-    AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
-    i_dword = (i_dword << 1);
-  }
-  uint64_t i_qword;
-  i_qword = 0; AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
-  i_qword = 0xFFFFFFFFFFFFFFFF; AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
-  i_qword = 1;
-  for (int i = 0; i < 16; i++) {
-    AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
-    i_qword = (i_qword << 1);
-  }
-}
-
-bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
-  if(all_samples.empty()) return true;
-
-  bool displace = false;
-  if(prng->RandReal() < displacement_p) {
-    displace = true;
-  }
-  
-  Sample *other_sample = all_samples[prng->Rand(0, (int)all_samples.size() - 1)];
-
-  if(inout_sample->size == 0) return false;
-  if(other_sample->size == 0) return false;
-
-  if(points == 1) {
-    size_t point1, point2;
-    char *new_bytes;
-    size_t new_sample_size;
-    if(displace) {
-      point1 = prng->Rand(0, (int)(inout_sample->size - 1));
-      point2 = prng->Rand(0, (int)(other_sample->size - 1));
-    } else {
-      size_t minsize = inout_sample->size;
-      if(other_sample->size < minsize) minsize = other_sample->size;
-      point1 = prng->Rand(0, (int)(minsize - 1));
-      point2 = point1;
-    }
-    new_sample_size = point1 + (other_sample->size - point2);
-    if(new_sample_size == inout_sample->size) {
-      memcpy(inout_sample->bytes + point1, other_sample->bytes + point2, other_sample->size - point2);
-      return true;
+// whether the bit and byte flip stages produced the same change
+static bool CouldBeFlip(uint32_t xor_value) {
+  if (!xor_value) return true;
+  if (!(xor_value & (xor_value - 1))) return true;
+  return (xor_value == 0xFF);
+}
+
+DeterministicMutator::DeterministicMutator(Mutator *havoc_mutator, size_t max_sample_size,
+                                           uint64_t max_execs, uint64_t max_round_execs) :
+  havoc_mutator(havoc_mutator), max_sample_size(max_sample_size),
+  max_execs(max_execs), max_round_execs(max_round_execs),
+  context(NULL), round_execs(0), last_pos(0), last_width(0),
+  num_execs(0), num_det_execs(0), num_det_finds(0)
+{
+}
+
+MutatorSampleContext *DeterministicMutator::CreateSampleContext(Sample *sample) {
+  DeterministicSampleContext *new_context = new DeterministicSampleContext();
+  new_context->child_context = havoc_mutator->CreateSampleContext(sample);
+  if (!sample->size || (sample->size > max_sample_size) || !max_execs) {
+    new_context->done = true;
+  } else {
+    new_context->effector_map.resize(sample->size);
+  }
+  return new_context;
+}
+
+void DeterministicMutator::InitRound(Sample *input_sample, MutatorSampleContext *context) {
+  this->context = (DeterministicSampleContext *)context;
+  round_execs = 0;
+  last_width = 0;
+  havoc_mutator->InitRound(input_sample, this->context ? this->context->child_context : NULL);
+}
+
+bool DeterministicMutator::ApplyStep(Sample *sample, int stage, size_t pos, int step) {
+  char *bytes = sample->bytes + pos;
+  size_t width = StageWidth(stage);
+  uint32_t mask = (width == 4) ? 0xFFFFFFFF : ((1U << (width * 8)) - 1);
+
+  switch (stage) {
+  case DET_BIT_FLIP:
+    bytes[0] ^= (char)(0x80 >> step);
+    return true;
+  case DET_BYTE_FLIP:
+    bytes[0] ^= (char)0xFF;
+    return true;
+  case DET_ARITH_8:
+  case DET_ARITH_16:
+  case DET_ARITH_32: {
+    bool big_endian = (step >= 2 * DET_ARITH_MAX);
+    int delta = (step % (2 * DET_ARITH_MAX)) / 2 + 1;
+    if (step & 1) delta = -delta;
+    uint32_t old_value = ReadValue(bytes, width, big_endian);
+    uint32_t new_value = (old_value + delta) & mask;
+    uint32_t changed = old_value ^ new_value;
+    if (width == 1) {
+      if (CouldBeFlip(changed)) return false;
     } else {
-      new_bytes = (char *)malloc(new_sample_size);
-      memcpy(new_bytes, inout_sample->bytes, point1);
-      memcpy(new_bytes + point1, other_sample->bytes + point2, other_sample->size - point2);
-      free(inout_sample->bytes);
-      inout_sample->bytes = new_bytes;
-      inout_sample->size = new_sample_size;
-      if (inout_sample->size > MAX_SAMPLE_SIZE) inout_sample->Trim(MAX_SAMPLE_SIZE);
-      return true;
+      // only the lower half changed, an earlier stage did that
+      if (!(changed >> (width * 4))) return false;
     }
-  } else if(points != 2) {
-    FATAL("Splice mutator can only work with 1 or 2 splice points");
-  }
-  
-  if(displace) {
-    size_t blockstart1, blocksize1;
-    size_t blockstart2, blocksize2;
-    size_t blockstart3, blocksize3;
-    if(!GetRandBlock(inout_sample->size, 1, inout_sample->size, &blockstart1, &blocksize1, prng)) return true;
-    if(!GetRandBlock(other_sample->size, 1, other_sample->size, &blockstart2, &blocksize2, prng)) return true;
-    blockstart3 = blockstart1 + blocksize1;
-    blocksize3 = inout_sample->size - blockstart3;
-    size_t new_sample_size = blockstart1 + blocksize2 + blocksize3;
-    char *new_bytes = (char *)malloc(new_sample_size);
-    memcpy(new_bytes, inout_sample->bytes, blockstart1);
-    memcpy(new_bytes + blockstart1, other_sample->bytes + blockstart2, blocksize2);
-    memcpy(new_bytes + blockstart1 + blocksize2, inout_sample->bytes + blockstart3, blocksize3);
-    if(new_sample_size > MAX_SAMPLE_SIZE) {
-      new_sample_size = MAX_SAMPLE_SIZE;
-      new_bytes = (char *)realloc(new_bytes, MAX_SAMPLE_SIZE);
+    WriteValue(bytes, width, big_endian, new_value);
+    return true;
+  }
+  case DET_INTERESTING_8:
+  case DET_INTERESTING_16:
+  case DET_INTERESTING_32: {
+    const int32_t *values = (width == 1) ? interesting_8 : ((width == 2) ? interesting_16 : interesting_32);
+    int num_values = (width == 1) ? NUM_INTERESTING_8 : ((width == 2) ? NUM_INTERESTING_16 : NUM_INTERESTING_32);
+    bool big_endian = (step >= num_values);
+    uint32_t new_value = (uint32_t)values[step % num_values] & mask;
+    if (big_endian) {
+      // symmetric values are the same in both byte orders
+      char swapped[4];
+      WriteValue(swapped, width, false, new_value);
+      if (ReadValue(swapped, width, true) == new_value) return false;
     }
-    free(inout_sample->bytes);
-    inout_sample->bytes = new_bytes;
-    inout_sample->size = new_sample_size;
+    uint32_t old_value = ReadValue(bytes, width, big_endian);
+    uint32_t changed = old_value ^ new_value;
+    if (CouldBeFlip(changed)) return false;
+    if ((width > 1) && !(changed >> (width * 4))) return false;
+    WriteValue(bytes, width, big_endian, new_value);
     return true;
-  } else {
-    size_t blockstart, blocksize;
-    if(!GetRandBlock(other_sample->size, 2, other_sample->size, &blockstart, &blocksize, prng)) return true;
-    if(blockstart > inout_sample->size) {
-      blocksize += (blockstart - inout_sample->size);
-      blockstart = inout_sample->size;
+  }
+  default:
+    return false;
+  }
+}
+
+bool DeterministicMutator::NextStep(Sample *sample) {
+  while ((context->stage < DET_NUM_STAGES) && (context->num_execs < max_execs)) {
+    int stage = context->stage;
+    size_t pos = context->pos;
+    int step = context->step;
+    size_t width = StageWidth(stage);
+    if (pos + width > sample->size) {
+      context->stage++;
+      context->pos = 0;
+      context->step = 0;
+      continue;
     }
-    if((blockstart + blocksize) <= inout_sample->size) {
-      memcpy(inout_sample->bytes + blockstart, other_sample->bytes + blockstart, blocksize);
+
+    context->step++;
+    if (context->step >= StageSteps(stage)) {
+      context->step = 0;
+      context->pos++;
+    }
+
+    if (ApplyStep(sample, stage, pos, step)) {
+      last_pos = pos;
+      last_width = width;
       return true;
     }
-    size_t new_sample_size = blockstart + blocksize;
-    char *new_bytes = (char *)malloc(new_sample_size);
-    memcpy(new_bytes, inout_sample->bytes, blockstart);
-    memcpy(new_bytes + blockstart, other_sample->bytes + blockstart, blocksize);
-    free(inout_sample->bytes);
-    inout_sample->bytes = new_bytes;
-    inout_sample->size = new_sample_size;
-    return true;
   }
+
+  context->done = true;
+  return false;
+}
+
+// changes a single byte from the effector map
+void DeterministicMutator::MutateEffector(Sample *sample, PRNG *prng) {
+  std::vector<uint32_t> &positions = context->effector_positions;
+  uint32_t pos = positions[prng->Rand() % positions.size()];
+  if (pos >= sample->size) return;
+
+  char *byte = sample->bytes + pos;
+  switch (prng->Rand() % 4) {
+  case 0:
+    *byte = (char)prng->Rand(0, 255);
+    break;
+  case 1:
+    *byte ^= (char)(1 << prng->Rand(0, 7));
+    break;
+  case 2:
+    *byte += (char)(prng->Rand(0, 1) ? prng->Rand(1, DET_ARITH_MAX) : -prng->Rand(1, DET_ARITH_MAX));
+    break;
+  default:
+    *byte = (char)interesting_8[prng->Rand() % NUM_INTERESTING_8];
+    break;
+  }
+}
+
+bool DeterministicMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  num_execs++;
+  last_width = 0;
+
+  if (context && !context->done && (round_execs < max_round_execs)) {
+    if (NextStep(inout_sample)) {
+      round_execs++;
+      context->num_execs++;
+      num_det_execs++;
+      return true;
+    }
+  }
+
+  if (context && !context->effector_positions.empty() && (prng->RandReal() < DET_EFFECTOR_P)) {
+    MutateEffector(inout_sample, prng);
+  }
+  return havoc_mutator->Mutate(inout_sample, prng, all_samples);
+}
+
+void DeterministicMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  if (!last_width) {
+    havoc_mutator->NotifyResult(result, has_new_coverage);
+    return;
+  }
+
+  if (has_new_coverage) {
+    num_det_finds++;
+    for (size_t pos = last_pos; pos < last_pos + last_width; pos++) {
+      if (context->effector_map[pos]) continue;
+      context->effector_map[pos] = 1;
+      context->effector_positions.push_back((uint32_t)pos);
+    }
+  }
+  last_width = 0;
+}
+
+void DeterministicMutator::SetEnergy(double energy) {
+  havoc_mutator->SetEnergy(energy);
+}
+
+bool DeterministicMutator::SaveState(std::string &state) {
+  return havoc_mutator->SaveState(state);
+}
+
+void DeterministicMutator::LoadState(const std::string &state) {
+  havoc_mutator->LoadState(state);
+}
+
+// the weight of the deterministic stage is its share of executions
+void DeterministicMutator::GetStats(std::vector<MutatorStats> &stats) {
+  havoc_mutator->GetStats(stats);
+  stats.push_back({ "deterministic", num_det_execs, num_det_finds,
+                    num_execs ? (double)num_det_execs / num_execs : 0 });
 }
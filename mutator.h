@@ -16,15 +16,37 @@ limitations under the License.
 
 #pragma once
 
+#include <string>
 #include <vector>
 #include "prng.h"
 #include "sample.h"
 #include "runresult.h"
+#include "mutatorops.h"
 
-class MutatorSampleContext { };
+class MutatorSampleContext {
+public:
+  virtual ~MutatorSampleContext() { }
+};
+
+// yield of an operator (or stacking depth) of an adaptive mutator
+struct MutatorStats {
+  std::string name;
+  // executions of samples the operator contributed to
+  uint64_t execs;
+  // how many of those found new coverage
+  uint64_t finds;
+  // current selection probability
+  double weight;
+};
 
 class SampleContextVector : public MutatorSampleContext {
 public:
+  ~SampleContextVector() {
+    for (auto context : contexts) {
+      if (context) delete context;
+    }
+  }
+
   std::vector<MutatorSampleContext *> contexts;
 };
 
@@ -35,6 +57,14 @@ public:
   virtual void InitRound(Sample *input_sample, MutatorSampleContext *context) { }
   virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) = 0;
   virtual void NotifyResult(RunResult result, bool has_new_coverage) { }
+  // scales the amount of work done in a round,
+  // set by the fuzzer's power schedule before each round
+  virtual void SetEnergy(double energy) { }
+  // learned state that the fuzzer persists across restarts,
+  // SaveState returns false if there is none
+  virtual bool SaveState(std::string &state) { return false; }
+  virtual void LoadState(const std::string &state) { }
+  virtual void GetStats(std::vector<MutatorStats> &stats) { }
 protected:
   // a helper function to get a random chunk of sample (with size samplesize)
   // chunk size is between minblocksize and maxblocksize
@@ -48,6 +78,7 @@ public:
   NRoundMutator(Mutator *child_mutator, size_t num_rounds) {
     this->child_mutator = child_mutator;
     this->num_rounds = num_rounds;
+    round_limit = num_rounds;
     current_round = 0;
   }
 
@@ -61,7 +92,7 @@ public:
   }
 
   virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
-    if (current_round == num_rounds) return false;
+    if (current_round >= round_limit) return false;
     child_mutator->Mutate(inout_sample, prng, all_samples);
     current_round++;
     return true;
@@ -71,9 +102,29 @@ public:
     child_mutator->NotifyResult(result, has_new_coverage);
   }
 
+  // energy multiplies the number of rounds, always at least 1
+  // (not passed on, so nested NRoundMutators aren't scaled twice)
+  virtual void SetEnergy(double energy) override {
+    round_limit = (size_t)(num_rounds * energy);
+    if (round_limit < 1) round_limit = 1;
+  }
+
+  virtual bool SaveState(std::string &state) override {
+    return child_mutator->SaveState(state);
+  }
+
+  virtual void LoadState(const std::string &state) override {
+    child_mutator->LoadState(state);
+  }
+
+  virtual void GetStats(std::vector<MutatorStats> &stats) override {
+    child_mutator->GetStats(stats);
+  }
+
 protected:
   size_t current_round;
   size_t num_rounds;
+  size_t round_limit;
   Mutator * child_mutator;
 };
 
@@ -119,6 +170,12 @@ public:
     child_mutators[current_mutator_index]->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void SetEnergy(double energy) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->SetEnergy(energy);
+    }
+  }
+
 protected:
   int current_mutator_index;
   std::vector<Mutator *> child_mutators;
@@ -155,6 +212,12 @@ class SelectMutator : public Mutator {
     child_mutators[last_mutator_index]->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void SetEnergy(double energy) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->SetEnergy(energy);
+    }
+  }
+
 protected:
   int last_mutator_index;
   std::vector<Mutator *> child_mutators;
@@ -212,6 +275,12 @@ public:
     child_mutators[last_mutator_index].mutator->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void SetEnergy(double energy) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i].mutator->SetEnergy(energy);
+    }
+  }
+
 protected:
   double psum;
   int last_mutator_index;
@@ -249,93 +318,291 @@ public:
     child_mutator->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void SetEnergy(double energy) override {
+    child_mutator->SetEnergy(energy);
+  }
+
 public:
   Mutator *child_mutator;
   double repeat_p;
 };
 
+// Thompson sampling over operators, every ADAPTIVE_RESAMPLE_EXECS
+// executions each operator's find rate is drawn from its posterior
+// and scaled by its prior weight
+#define ADAPTIVE_RESAMPLE_EXECS 64
+// operator statistics are scaled by ADAPTIVE_DECAY every
+// ADAPTIVE_DECAY_EXECS executions, so operators that stopped
+// finding anything lose weight
+#define ADAPTIVE_DECAY_EXECS 100000
+#define ADAPTIVE_DECAY 0.5
+// stacking depths are 1, 2, 4, ... up to this
+#define ADAPTIVE_MAX_STACK 16
+
+// Like RepeatMutator over a PSelectMutator, but the probabilities
+// of the child mutators and of each stacking depth are learned from
+// NotifyResult. An execution counts as a find for every operator
+// that contributed to the sample, and for the depth that was used,
+// if it found new coverage.
+class AdaptiveMutator : public Mutator {
+public:
+  AdaptiveMutator();
+
+  // p is the prior weight, name identifies the operator
+  // in statistics and saved state
+  void AddMutator(Mutator *mutator, double p, const char *name);
+
+  virtual void InitRound(Sample *input_sample, MutatorSampleContext *context) override;
+  virtual MutatorSampleContext *CreateSampleContext(Sample *sample) override;
+  virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
+  virtual void SetEnergy(double energy) override;
+
+  virtual bool SaveState(std::string &state) override;
+  virtual void LoadState(const std::string &state) override;
+  virtual void GetStats(std::vector<MutatorStats> &stats) override;
+
+protected:
+  struct Arm {
+    std::string name;
+    double prior;
+    // decayed counts the posterior is drawn from
+    double execs;
+    double finds;
+    // lifetime counts, for statistics
+    uint64_t total_execs;
+    uint64_t total_finds;
+    // prior times the last draw
+    double weight;
+    bool used;
+  };
+
+  void Resample(PRNG *prng);
+  int Select(std::vector<Arm> &arms, double weight_sum, PRNG *prng);
+  void Credit(Arm &arm, bool found);
+
+  std::vector<Mutator *> child_mutators;
+  std::vector<Arm> operators;
+  std::vector<Arm> depths;
+  double operator_weight_sum;
+  double depth_weight_sum;
+  uint64_t num_results;
+  // operators used for the current sample
+  std::vector<int> used_operators;
+  int used_depth;
+};
+
+// samples larger than this skip the deterministic stage
+#define DET_MAX_SAMPLE_SIZE 4096
+// deterministic executions per sample
+#define DET_MAX_EXECS 50000
+// deterministic executions per round (the rest of the round is havoc)
+#define DET_ROUND_EXECS 500
+// probability that a havoc mutation starts with a change
+// to one of the bytes in the effector map
+#define DET_EFFECTOR_P 0.5
+#define DET_ARITH_MAX 35
+
+enum DeterministicStage {
+  DET_BIT_FLIP,
+  DET_BYTE_FLIP,
+  DET_ARITH_8,
+  DET_ARITH_16,
+  DET_ARITH_32,
+  DET_INTERESTING_8,
+  DET_INTERESTING_16,
+  DET_INTERESTING_32,
+  DET_NUM_STAGES
+};
+
+// progress of the deterministic stage on a queue entry
+class DeterministicSampleContext : public MutatorSampleContext {
+public:
+  DeterministicSampleContext() : child_context(NULL), done(false),
+    stage(DET_BIT_FLIP), pos(0), step(0), num_execs(0) { }
+
+  ~DeterministicSampleContext() {
+    if (child_context) delete child_context;
+  }
+
+  MutatorSampleContext *child_context;
+  bool done;
+  // the next mutation to try
+  int stage;
+  size_t pos;
+  int step;
+  uint64_t num_execs;
+  // 1 for bytes whose deterministic mutations
+  // found new coverage
+  std::vector<uint8_t> effector_map;
+  // the bytes set in effector_map, in the order they were found
+  std::vector<uint32_t> effector_positions;
+};
+
+// Runs a deterministic stage on each new entry before handing it to
+// the havoc mutator: walking bit flips, byte flips, arithmetic of up
+// to +-DET_ARITH_MAX on 8, 16 and 32-bit values and interesting-value
+// overwrites (both endiannesses for 16 and 32 bits). Mutations that
+// an earlier stage already covered are skipped. At most
+// DET_ROUND_EXECS mutations of each round are deterministic, progress
+// is kept in the entry's context so the stage resumes in the next
+// round, and it ends after max_execs executions. Samples over
+// max_sample_size bytes skip it.
+//
+// Bytes whose deterministic mutations find new coverage form
+// the entry's effector map. Once there are any, havoc
+// mutations start with a change to one of them with DET_EFFECTOR_P.
+class DeterministicMutator : public Mutator {
+public:
+  DeterministicMutator(Mutator *havoc_mutator,
+                       size_t max_sample_size = DET_MAX_SAMPLE_SIZE,
+                       uint64_t max_execs = DET_MAX_EXECS,
+                       uint64_t max_round_execs = DET_ROUND_EXECS);
+
+  virtual MutatorSampleContext *CreateSampleContext(Sample *sample) override;
+  virtual void InitRound(Sample *input_sample, MutatorSampleContext *context) override;
+  virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
+  virtual void SetEnergy(double energy) override;
+
+  virtual bool SaveState(std::string &state) override;
+  virtual void LoadState(const std::string &state) override;
+  virtual void GetStats(std::vector<MutatorStats> &stats) override;
+
+protected:
+  // applies the next deterministic mutation that isn't
+  // redundant, returns false once the stage is done
+  bool NextStep(Sample *sample);
+  // returns false if the mutation is redundant
+  bool ApplyStep(Sample *sample, int stage, size_t pos, int step);
+  void MutateEffector(Sample *sample, PRNG *prng);
+
+  Mutator *havoc_mutator;
+  size_t max_sample_size;
+  uint64_t max_execs;
+  uint64_t max_round_execs;
+
+  DeterministicSampleContext *context;
+  uint64_t round_execs;
+  // bytes changed by the last deterministic mutation, 0 if it was havoc
+  size_t last_pos;
+  size_t last_width;
+
+  // for statistics
+  uint64_t num_execs;
+  uint64_t num_det_execs;
+  uint64_t num_det_finds;
+};
+
+// The leaf mutators below wrap the operators from mutatorops.h
+
 class ByteFlipMutator : public Mutator {
 public:
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
+
+protected:
+  ByteFlipOp op;
 };
 
 class BlockFlipMutator : public Mutator {
 public:
   BlockFlipMutator(int min_block_size, int max_block_size, bool uniform = false):
-    min_block_size(min_block_size), max_block_size(max_block_size), uniform(uniform)
+    op(min_block_size, max_block_size, uniform)
     { }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
 
 protected:
-
-  bool uniform;
-  int min_block_size;
-  int max_block_size;
+  BlockFlipOp op;
 };
 
 class AppendMutator : public Mutator {
 public:
   AppendMutator(int min_append, int max_append) :
-    min_append(min_append), max_append(max_append)
+    op(min_append, max_append)
     { }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
 
 protected:
-  int min_append;
-  int max_append;
+  AppendOp op;
 };
 
 class BlockInsertMutator : public Mutator {
 public:
   BlockInsertMutator(int min_insert, int max_insert) :
-    min_insert(min_insert), max_insert(max_insert)
+    op(min_insert, max_insert)
     { }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
 
 protected:
-  int min_insert;
-  int max_insert;
+  BlockInsertOp op;
 };
 
 class BlockDuplicateMutator : public Mutator {
 public:
   BlockDuplicateMutator(int min_block_size, int max_block_size,
                         int min_duplicate_cnt, int max_duplicate_cnt) :
-    min_block_size(min_block_size), max_block_size(max_block_size),
-    min_duplicate_cnt(min_duplicate_cnt), max_duplicate_cnt(max_duplicate_cnt)
+    op(min_block_size, max_block_size, min_duplicate_cnt, max_duplicate_cnt)
   { }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
 
 protected:
-  int min_block_size;
-  int max_block_size;
-  int min_duplicate_cnt;
-  int max_duplicate_cnt;
+  BlockDuplicateOp op;
 };
 
 class InterstingValueMutator : public Mutator {
 public:
-  InterstingValueMutator(bool use_default_values = false);
+  InterstingValueMutator(bool use_default_values = false) : op(use_default_values) { }
 
-  void AddInterestingValue(char *data, size_t size);
+  void AddInterestingValue(char *data, size_t size) {
+    op.AddInterestingValue(data, size);
+  }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
 
 protected:
-  std::vector<Sample> interesting_values;
+  InterestingValueOp op;
 };
 
 class SpliceMutator : public Mutator {
 public:
-  SpliceMutator(int points, double displacement_p) : points(points), displacement_p(displacement_p) { }
+  SpliceMutator(int points, double displacement_p) : op(points, displacement_p) { }
 
-  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
+
+protected:
+  SpliceOp op;
+};
+
+class DictionaryMutator : public Mutator {
+public:
+  DictionaryMutator(const Dictionary *dictionary) : op(dictionary) { }
+
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    return op.Mutate(inout_sample, *prng, all_samples);
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) override {
+    op.NotifyResult(result, has_new_coverage);
+  }
 
 protected:
-  int points;
-  double displacement_p;
+  DictionaryOp op;
 };
@@ -0,0 +1,393 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "common.h"
+#include "sample.h"
+#include "runresult.h"
+#include "dictionary.h"
+
+// The leaf mutation operators, as templates over the generator type.
+// Mutator classes in mutator.h use them with PRNG (so every random
+// number is a virtual call), the pipelines in staticmutator.h with
+// a concrete generator, so that the whole mutation can be inlined.
+// A generator only needs uint32_t Rand().
+
+// same as PRNG::Rand(min, max)
+template<class Rng>
+inline int RandRange(Rng &prng, int min, int max) {
+  if (min == max) return min;
+  return ((prng.Rand() % (max - min + 1)) + min);
+}
+
+// same as PRNG::RandReal()
+template<class Rng>
+inline double RandReal(Rng &prng) {
+  return prng.Rand() * (1.0 / 4294967295.0);
+}
+
+// a random chunk of a sample of size samplesize, with a size
+// between minblocksize and maxblocksize, 0 if there is none
+template<class Rng>
+inline int GetRandBlock(size_t samplesize, size_t minblocksize, size_t maxblocksize, size_t *blockstart, size_t *blocksize, Rng &prng) {
+  if (samplesize == 0) return 0;
+  if (samplesize < minblocksize) return 0;
+  if (samplesize < maxblocksize) maxblocksize = samplesize;
+  *blocksize = RandRange(prng, (int)minblocksize, (int)maxblocksize);
+  *blockstart = RandRange(prng, 0, (int)(samplesize - (*blocksize)));
+  return 1;
+}
+
+// the rest of the Mutator interface, for operators
+// used directly in static pipelines
+struct MutatorOp {
+  void InitRound(Sample *input_sample) { }
+  void NotifyResult(RunResult result, bool has_new_coverage) { }
+  void SetEnergy(double energy) { }
+};
+
+struct ByteFlipOp : public MutatorOp {
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if (inout_sample->size == 0) return true;
+    int charpos = RandRange(prng, 0, (int)(inout_sample->size - 1));
+    char c = (char)RandRange(prng, 0, 255);
+    inout_sample->bytes[charpos] = c;
+    return true;
+  }
+};
+
+struct BlockFlipOp : public MutatorOp {
+  BlockFlipOp(int min_block_size, int max_block_size, bool uniform = false):
+    min_block_size(min_block_size), max_block_size(max_block_size), uniform(uniform)
+    { }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    size_t blocksize, blockpos;
+    if (!GetRandBlock(inout_sample->size, min_block_size, max_block_size, &blockpos, &blocksize, prng)) return true;
+    if (uniform) {
+      char c = (char)RandRange(prng, 0, 255);
+      for (size_t i = 0; i<blocksize; i++) {
+        inout_sample->bytes[blockpos + i] = c;
+      }
+    } else {
+      for (size_t i = 0; i<blocksize; i++) {
+        inout_sample->bytes[blockpos + i] = (char)RandRange(prng, 0, 255);
+      }
+    }
+    return true;
+  }
+
+  int min_block_size;
+  int max_block_size;
+  bool uniform;
+};
+
+struct AppendOp : public MutatorOp {
+  AppendOp(int min_append, int max_append) :
+    min_append(min_append), max_append(max_append)
+    { }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    size_t old_size = inout_sample->size;
+    if (old_size >= MAX_SAMPLE_SIZE) return true;
+    size_t append = RandRange(prng, min_append, max_append);
+    if ((old_size + append) > MAX_SAMPLE_SIZE) {
+      append = MAX_SAMPLE_SIZE - old_size;
+    }
+    if (append <= 0) return true;
+    size_t new_size = old_size + append;
+    inout_sample->Resize(new_size);
+    for (size_t i = old_size; i < new_size; i++) {
+      inout_sample->bytes[i] = (char)RandRange(prng, 0, 255);
+    }
+    return true;
+  }
+
+  int min_append;
+  int max_append;
+};
+
+struct BlockInsertOp : public MutatorOp {
+  BlockInsertOp(int min_insert, int max_insert) :
+    min_insert(min_insert), max_insert(max_insert)
+    { }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    size_t old_size = inout_sample->size;
+    if (old_size >= MAX_SAMPLE_SIZE) return true;
+    size_t to_insert = RandRange(prng, min_insert, max_insert);
+    if ((old_size + to_insert) > MAX_SAMPLE_SIZE) {
+      to_insert = MAX_SAMPLE_SIZE - old_size;
+    }
+    size_t where = RandRange(prng, 0, (int)old_size);
+    if (to_insert <= 0) return true;
+
+    inout_sample->Insert(where, to_insert);
+    for (size_t i = 0; i < to_insert; i++) {
+      inout_sample->bytes[where + i] = (char)RandRange(prng, 0, 255);
+    }
+    return true;
+  }
+
+  int min_insert;
+  int max_insert;
+};
+
+struct BlockDuplicateOp : public MutatorOp {
+  BlockDuplicateOp(int min_block_size, int max_block_size,
+                   int min_duplicate_cnt, int max_duplicate_cnt) :
+    min_block_size(min_block_size), max_block_size(max_block_size),
+    min_duplicate_cnt(min_duplicate_cnt), max_duplicate_cnt(max_duplicate_cnt)
+  { }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if (inout_sample->size >= MAX_SAMPLE_SIZE) return true;
+    size_t blockpos, blocksize;
+    if (!GetRandBlock(inout_sample->size, min_block_size, max_block_size, &blockpos, &blocksize, prng)) return true;
+    int64_t blockcount = RandRange(prng, min_duplicate_cnt, max_duplicate_cnt);
+    if ((inout_sample->size + blockcount * blocksize) > MAX_SAMPLE_SIZE)
+      blockcount = (MAX_SAMPLE_SIZE - (int64_t)inout_sample->size) / blocksize;
+    if (blockcount <= 0) return true;
+    // the copies go right after the block, which stays in place
+    inout_sample->Insert(blockpos + blocksize, blockcount * blocksize);
+    for (size_t i = 0; i<blockcount; i++) {
+      memcpy(inout_sample->bytes + blockpos + (i + 1)*blocksize, inout_sample->bytes + blockpos, blocksize);
+    }
+    return true;
+  }
+
+  int min_block_size;
+  int max_block_size;
+  int min_duplicate_cnt;
+  int max_duplicate_cnt;
+};
+
+struct InterestingValueOp : public MutatorOp {
+  InterestingValueOp(bool use_default_values = false) {
+    if (!use_default_values) return;
+    uint16_t i_word;
+    i_word = 0; AddInterestingValue((char *)(&i_word), sizeof(i_word));
+    i_word = 0xFFFF; AddInterestingValue((char *)(&i_word), sizeof(i_word));
+    i_word = 1;
+    for (int i = 0; i < 16; i++) {
+      AddInterestingValue((char *)(&i_word), sizeof(i_word));
+      i_word = (i_word << 1);
+    }
+    uint32_t i_dword;
+    i_dword = 0; AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
+    i_dword = 0xFFFFFFFF; AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
+    i_dword = 1;
+    for (int i = 0; i < 16; i++) {
+      AddInterestingValue((char *)(&i_dword), sizeof(i_dword));
+      i_dword = (i_dword << 1);
+    }
+    uint64_t i_qword;
+    i_qword = 0; AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
+    i_qword = 0xFFFFFFFFFFFFFFFF; AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
+    i_qword = 1;
+    for (int i = 0; i < 16; i++) {
+      AddInterestingValue((char *)(&i_qword), sizeof(i_qword));
+      i_qword = (i_qword << 1);
+    }
+  }
+
+  void AddInterestingValue(char *data, size_t size) {
+    Sample interesting_sample;
+    interesting_sample.Init(data, size);
+    interesting_values.push_back(interesting_sample);
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if (interesting_values.empty()) return true;
+    Sample *interesting_sample = &interesting_values[RandRange(prng, 0, (int)interesting_values.size() - 1)];
+    size_t blockstart, blocksize;
+    if (!GetRandBlock(inout_sample->size, interesting_sample->size, interesting_sample->size, &blockstart, &blocksize, prng)) return true;
+    memcpy(inout_sample->bytes + blockstart, interesting_sample->bytes, interesting_sample->size);
+    return true;
+  }
+
+  std::vector<Sample> interesting_values;
+};
+
+struct SpliceOp : public MutatorOp {
+  SpliceOp(int points, double displacement_p) : points(points), displacement_p(displacement_p) { }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if(all_samples.empty()) return true;
+
+    bool displace = false;
+    if(RandReal(prng) < displacement_p) {
+      displace = true;
+    }
+  
+    Sample *other_sample = all_samples[RandRange(prng, 0, (int)all_samples.size() - 1)];
+
+    if(inout_sample->size == 0) return false;
+    if(other_sample->size == 0) return false;
+
+    if(points == 1) {
+      size_t point1, point2;
+      size_t new_sample_size;
+      if(displace) {
+        point1 = RandRange(prng, 0, (int)(inout_sample->size - 1));
+        point2 = RandRange(prng, 0, (int)(other_sample->size - 1));
+      } else {
+        size_t minsize = inout_sample->size;
+        if(other_sample->size < minsize) minsize = other_sample->size;
+        point1 = RandRange(prng, 0, (int)(minsize - 1));
+        point2 = point1;
+      }
+      new_sample_size = point1 + (other_sample->size - point2);
+      if(new_sample_size == inout_sample->size) {
+        memcpy(inout_sample->bytes + point1, other_sample->bytes + point2, other_sample->size - point2);
+        return true;
+      } else {
+        if (new_sample_size > MAX_SAMPLE_SIZE) new_sample_size = MAX_SAMPLE_SIZE;
+        inout_sample->Resize(new_sample_size);
+        memcpy(inout_sample->bytes + point1, other_sample->bytes + point2, new_sample_size - point1);
+        return true;
+      }
+    } else if(points != 2) {
+      FATAL("Splice mutator can only work with 1 or 2 splice points");
+    }
+  
+    if(displace) {
+      size_t blockstart1, blocksize1;
+      size_t blockstart2, blocksize2;
+      size_t blockstart3, blocksize3;
+      if(!GetRandBlock(inout_sample->size, 1, inout_sample->size, &blockstart1, &blocksize1, prng)) return true;
+      if(!GetRandBlock(other_sample->size, 1, other_sample->size, &blockstart2, &blocksize2, prng)) return true;
+      blockstart3 = blockstart1 + blocksize1;
+      blocksize3 = inout_sample->size - blockstart3;
+      // whatever would end up past MAX_SAMPLE_SIZE is dropped first
+      if(blockstart1 + blocksize2 > MAX_SAMPLE_SIZE) {
+        blocksize2 = MAX_SAMPLE_SIZE - blockstart1;
+        blocksize3 = 0;
+      } else if(blockstart1 + blocksize2 + blocksize3 > MAX_SAMPLE_SIZE) {
+        blocksize3 = MAX_SAMPLE_SIZE - blockstart1 - blocksize2;
+      }
+      inout_sample->Trim(blockstart3 + blocksize3);
+      // replace block 1 with block 2, in place
+      if(blocksize2 > blocksize1) {
+        inout_sample->Insert(blockstart3, blocksize2 - blocksize1);
+      } else {
+        inout_sample->Remove(blockstart1 + blocksize2, blocksize1 - blocksize2);
+      }
+      memcpy(inout_sample->bytes + blockstart1, other_sample->bytes + blockstart2, blocksize2);
+      return true;
+    } else {
+      size_t blockstart, blocksize;
+      if(!GetRandBlock(other_sample->size, 2, other_sample->size, &blockstart, &blocksize, prng)) return true;
+      if(blockstart > inout_sample->size) {
+        blocksize += (blockstart - inout_sample->size);
+        blockstart = inout_sample->size;
+      }
+      if((blockstart + blocksize) <= inout_sample->size) {
+        memcpy(inout_sample->bytes + blockstart, other_sample->bytes + blockstart, blocksize);
+        return true;
+      }
+      inout_sample->Resize(blockstart + blocksize);
+      memcpy(inout_sample->bytes + blockstart, other_sample->bytes + blockstart, blocksize);
+      return true;
+    }
+  }
+
+  int points;
+  double displacement_p;
+};
+
+// the dictionary op reweights tokens every DICT_REWEIGHT_EXECS results
+#define DICT_REWEIGHT_EXECS 256
+
+// Inserts a dictionary token or overwrites part of the sample with
+// it, at a random position or one aligned to the token size. Tokens
+// are picked in proportion to their find rate, (finds + 1) / (uses + 2),
+// so tokens that haven't been tried yet are preferred over ones that
+// never found anything. A use counts as a find if the sample found
+// new coverage (re-hitting a known crash doesn't count). The
+// dictionary has to outlive the op.
+struct DictionaryOp : public MutatorOp {
+  DictionaryOp(const Dictionary *dictionary) : dictionary(dictionary), num_results(0) {
+    uses.resize(dictionary->Size());
+    finds.resize(dictionary->Size());
+    UpdateWeights();
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if (cumulative_weights.empty()) return true;
+
+    double r = RandReal(prng) * cumulative_weights.back();
+    size_t index = std::upper_bound(cumulative_weights.begin(), cumulative_weights.end(), r) - cumulative_weights.begin();
+    if (index >= cumulative_weights.size()) index = cumulative_weights.size() - 1;
+    const Sample &token = dictionary->GetToken(index);
+
+    bool overwrite = (inout_sample->size >= token.size) && RandRange(prng, 0, 1);
+    if (!overwrite && ((inout_sample->size + token.size) > MAX_SAMPLE_SIZE)) return true;
+    size_t last_pos = overwrite ? (inout_sample->size - token.size) : inout_sample->size;
+    size_t pos = RandRange(prng, 0, (int)last_pos);
+    if (RandRange(prng, 0, 1)) {
+      // largest power of two that is <= the token size, up to 8
+      size_t alignment = 1;
+      while ((alignment < 8) && (alignment * 2 <= token.size)) alignment *= 2;
+      pos -= pos % alignment;
+    }
+
+    if (!overwrite) inout_sample->Insert(pos, token.size);
+    memcpy(inout_sample->bytes + pos, token.bytes, token.size);
+    used_tokens.push_back(index);
+    return true;
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) {
+    for (size_t index : used_tokens) {
+      uses[index]++;
+      if (has_new_coverage) finds[index]++;
+    }
+    used_tokens.clear();
+
+    num_results++;
+    if ((num_results % DICT_REWEIGHT_EXECS) == 0) UpdateWeights();
+  }
+
+  void UpdateWeights() {
+    cumulative_weights.resize(uses.size());
+    double sum = 0;
+    for (size_t i = 0; i < uses.size(); i++) {
+      sum += (finds[i] + 1.0) / (uses[i] + 2.0);
+      cumulative_weights[i] = sum;
+    }
+  }
+
+  const Dictionary *dictionary;
+  std::vector<uint64_t> uses;
+  std::vector<uint64_t> finds;
+  std::vector<double> cumulative_weights;
+  // tokens used since the last NotifyResult
+  std::vector<size_t> used_tokens;
+  uint64_t num_results;
+};
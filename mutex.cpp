@@ -38,6 +38,39 @@ void Mutex::Unlock() {
 #endif
 }
 
+ConditionVariable::ConditionVariable() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  InitializeConditionVariable(&cv);
+#endif
+}
+
+void ConditionVariable::Wait(Mutex *mutex, uint32_t timeout_ms) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  SleepConditionVariableCS(&cv, &mutex->cs, timeout_ms);
+#else
+  // the mutex is already locked by the caller, don't take ownership
+  std::unique_lock<std::mutex> lock(mutex->mutex, std::adopt_lock);
+  cv.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+  lock.release();
+#endif
+}
+
+void ConditionVariable::Signal() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  WakeConditionVariable(&cv);
+#else
+  cv.notify_one();
+#endif
+}
+
+void ConditionVariable::Broadcast() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  WakeAllConditionVariable(&cv);
+#else
+  cv.notify_all();
+#endif
+}
+
 ReadWriteMutex::ReadWriteMutex() {
   no_writers = new Mutex();
   no_readers = new Mutex();
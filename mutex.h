@@ -23,8 +23,11 @@ limitations under the License.
 #include <windows.h>
 #else
 #include <mutex>
+#include <condition_variable>
 #endif
 
+#include <inttypes.h>
+
 class Mutex {
 public:
   Mutex();
@@ -32,6 +35,8 @@ public:
   void Unlock();
 
 private:
+  friend class ConditionVariable;
+
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
   CRITICAL_SECTION cs;
 #else
@@ -39,6 +44,27 @@ private:
 #endif
 };
 
+// condition variable used together with Mutex
+class ConditionVariable {
+public:
+  ConditionVariable();
+
+  // atomically releases the mutex and waits until signaled
+  // or until timeout_ms elapses, mutex is held again on return
+  void Wait(Mutex *mutex, uint32_t timeout_ms);
+
+  // wakes up a single / all waiting threads
+  void Signal();
+  void Broadcast();
+
+private:
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  CONDITION_VARIABLE cv;
+#else
+  std::condition_variable cv;
+#endif
+};
+
 //Readers-writers mutex with no thread starvation
 //see http://en.wikipedia.org/wiki/Readers-writers_problem
 class ReadWriteMutex {
@@ -0,0 +1,128 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "sample.h"
+#include "powerschedule.h"
+
+PowerSchedule *PowerSchedule::Create(const char *name) {
+  if (!strcmp(name, "explore")) return new ExploreSchedule();
+  if (!strcmp(name, "fast")) return new FastSchedule();
+  if (!strcmp(name, "entropic")) return new EntropicSchedule();
+  return NULL;
+}
+
+void PowerSchedule::AddEntry(SampleQueueEntry *entry) {
+  entry->priority = 0;
+  num_entries.fetch_add(1, std::memory_order_relaxed);
+  total_exec_us.fetch_add(entry->exec_us, std::memory_order_relaxed);
+  total_size.fetch_add(entry->sample->size, std::memory_order_relaxed);
+}
+
+void PowerSchedule::OnRun(SampleQueueEntry *entry, bool found_new_coverage) {
+  total_runs.fetch_add(1, std::memory_order_relaxed);
+  if (found_new_coverage) total_newcoverage.fetch_add(1, std::memory_order_relaxed);
+}
+
+double PowerSchedule::PerformanceFactor(SampleQueueEntry *entry) {
+  uint64_t entries = num_entries.load(std::memory_order_relaxed);
+  if (!entries) return 1.0;
+
+  double factor = 1.0;
+
+  // entries restored from a previous session have no exec time
+  double avg_exec_us = (double)reference_exec_us.load(std::memory_order_relaxed);
+  if (!avg_exec_us) avg_exec_us = (double)total_exec_us.load(std::memory_order_relaxed) / entries;
+  if (entry->exec_us && (avg_exec_us > 0)) {
+    double ratio = entry->exec_us / avg_exec_us;
+    if (ratio > 4) factor *= 0.1;
+    else if (ratio > 2) factor *= 0.25;
+    else if (ratio > 1.33) factor *= 0.5;
+    else if (ratio < 0.25) factor *= 3;
+    else if (ratio < 0.33) factor *= 2;
+    else if (ratio < 0.5) factor *= 1.5;
+  }
+
+  double avg_size = (double)total_size.load(std::memory_order_relaxed) / entries;
+  if (avg_size > 0) {
+    double ratio = entry->sample->size / avg_size;
+    if (ratio > 4) factor *= 0.5;
+    else if (ratio > 2) factor *= 0.75;
+    else if (ratio < 0.5) factor *= 1.5;
+  }
+
+  return factor;
+}
+
+void ExploreSchedule::OnRun(SampleQueueEntry *entry, bool found_new_coverage) {
+  PowerSchedule::OnRun(entry, found_new_coverage);
+  if (found_new_coverage) entry->priority = 0;
+  else entry->priority--;
+}
+
+double ExploreSchedule::GetEnergy(SampleQueueEntry *entry) {
+  return 1.0;
+}
+
+double FastSchedule::GetEnergy(SampleQueueEntry *entry) {
+  // 2^s overflows long before it matters
+  uint64_t s = entry->num_jobs;
+  if (s > 30) s = 30;
+  double f = entry->num_runs / FAST_RUNS_UNIT + 1;
+
+  double energy = (double)((uint64_t)1 << s) / f;
+  if (energy > FAST_MAX_ENERGY) energy = FAST_MAX_ENERGY;
+
+  return energy * PerformanceFactor(entry);
+}
+
+void EntropicSchedule::AddEntry(SampleQueueEntry *entry) {
+  PowerSchedule::AddEntry(entry);
+  total_new_offsets.fetch_add(entry->num_new_offsets, std::memory_order_relaxed);
+}
+
+void EntropicSchedule::OnRun(SampleQueueEntry *entry, bool found_new_coverage) {
+  PowerSchedule::OnRun(entry, found_new_coverage);
+
+  // stride scheduling: an entry is picked again once its
+  // run count, scaled down by its weight, catches up with others
+  entry->priority = -(double)entry->num_runs / GetWeight(entry);
+}
+
+double EntropicSchedule::GetEnergy(SampleQueueEntry *entry) {
+  return GetWeight(entry) * PerformanceFactor(entry);
+}
+
+double EntropicSchedule::GetWeight(SampleQueueEntry *entry) {
+  double entry_rate = (entry->num_newcoverage + 1) /
+                      (entry->num_runs + ENTROPIC_PRIOR_RUNS);
+  double global_rate = (total_newcoverage.load(std::memory_order_relaxed) + 1) /
+                       (total_runs.load(std::memory_order_relaxed) + ENTROPIC_PRIOR_RUNS);
+  double weight = entry_rate / global_rate;
+
+  // entries that were the first to reach many offsets
+  // cover rarely reached parts of the target
+  uint64_t entries = num_entries.load(std::memory_order_relaxed);
+  if (entries) {
+    double avg_offsets = (double)total_new_offsets.load(std::memory_order_relaxed) / entries;
+    weight *= log2(2 + (double)entry->num_new_offsets) / log2(2 + avg_offsets);
+  }
+
+  if (weight < ENTROPIC_MIN_WEIGHT) weight = ENTROPIC_MIN_WEIGHT;
+  if (weight > ENTROPIC_MAX_WEIGHT) weight = ENTROPIC_MAX_WEIGHT;
+  return weight;
+}
@@ -0,0 +1,114 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <atomic>
+#include "fuzzer.h"
+
+// A power schedule decides which queue entry gets fuzzed next
+// (by setting entry->priority, highest priority goes first)
+// and how much energy the entry gets for a single fuzz job.
+// Energy multiplies the number of rounds the mutator runs,
+// 1.0 keeps the mutator's configured number of rounds.
+//
+// Entries are only modified by the thread that currently owns
+// them, corpus-wide averages are kept in atomics.
+class PowerSchedule {
+public:
+  typedef Fuzzer::SampleQueueEntry SampleQueueEntry;
+
+  PowerSchedule() : num_entries(0), total_exec_us(0), total_size(0),
+    total_runs(0), total_newcoverage(0), reference_exec_us(0) { }
+  virtual ~PowerSchedule() { }
+
+  virtual void Init(int argc, char **argv) { }
+
+  // called once for every new queue entry, before it is queued
+  virtual void AddEntry(SampleQueueEntry *entry);
+
+  // called after every run of a sample mutated from the entry
+  virtual void OnRun(SampleQueueEntry *entry, bool found_new_coverage);
+
+  virtual double GetEnergy(SampleQueueEntry *entry) = 0;
+
+  // typical execution time (the fuzzer passes the median of
+  // all executions), used instead of the corpus average when set
+  void SetReferenceExecTime(uint64_t exec_us) { reference_exec_us = exec_us; }
+
+  // creates the schedule selected by name, NULL if unknown
+  static PowerSchedule *Create(const char *name);
+
+protected:
+  // AFL-style score based on exec time and size
+  // relative to the corpus average
+  double PerformanceFactor(SampleQueueEntry *entry);
+
+  std::atomic<uint64_t> num_entries;
+  std::atomic<uint64_t> total_exec_us;
+  std::atomic<uint64_t> total_size;
+  std::atomic<uint64_t> total_runs;
+  std::atomic<uint64_t> total_newcoverage;
+  std::atomic<uint64_t> reference_exec_us;
+};
+
+// The original strategy: new entries and entries that
+// just found new coverage go first, every other run lowers
+// the priority, energy is constant
+class ExploreSchedule : public PowerSchedule {
+public:
+  void OnRun(SampleQueueEntry *entry, bool found_new_coverage) override;
+  double GetEnergy(SampleQueueEntry *entry) override;
+};
+
+// AFLFast-style exponential schedule. Energy is
+// min(2^s / f, FAST_MAX_ENERGY) where s is the number of times
+// the entry was picked and f the number of runs of its mutants
+// (in units of FAST_RUNS_UNIT), so entries in rarely exercised
+// regions get exponentially more energy the longer they stay
+// in the queue. Ordering is the same as ExploreSchedule.
+#define FAST_MAX_ENERGY 16.0
+#define FAST_RUNS_UNIT 1000.0
+
+class FastSchedule : public ExploreSchedule {
+public:
+  double GetEnergy(SampleQueueEntry *entry) override;
+};
+
+// Entropic-style schedule. Each entry's chance of finding new
+// coverage is estimated from its own history (with a prior of one
+// discovery in ENTROPIC_PRIOR_RUNS runs for new entries) and
+// compared to the corpus-wide rate. Entries are picked in
+// proportion to that weight (stride scheduling on their run count)
+// and get energy proportional to it. Entries that were first to
+// reach more offsets than average get a (logarithmic) boost.
+#define ENTROPIC_PRIOR_RUNS 100.0
+#define ENTROPIC_MIN_WEIGHT 0.1
+#define ENTROPIC_MAX_WEIGHT 10.0
+
+class EntropicSchedule : public PowerSchedule {
+public:
+  EntropicSchedule() : total_new_offsets(0) { }
+
+  void AddEntry(SampleQueueEntry *entry) override;
+  void OnRun(SampleQueueEntry *entry, bool found_new_coverage) override;
+  double GetEnergy(SampleQueueEntry *entry) override;
+
+protected:
+  virtual double GetWeight(SampleQueueEntry *entry);
+
+  std::atomic<uint64_t> total_new_offsets;
+};
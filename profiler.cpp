@@ -0,0 +1,99 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string>
+#include "profiler.h"
+
+static const char *phase_names[NUM_PROFILE_PHASES] = {
+  "mutate",
+  "deliver",
+  "target_start",
+  "run",
+  "coverage",
+  "ignore_coverage",
+  "calibrate",
+  "trim",
+  "lock_wait",
+};
+
+const char *ProfilePhaseName(int phase) {
+  return phase_names[phase];
+}
+
+ThreadProfile::ThreadProfile() {
+  for (int i = 0; i < NUM_PROFILE_PHASES; i++) {
+    total_ns[i] = 0;
+  }
+}
+
+void PrintProfileSummary(ThreadProfile **profiles, size_t num_profiles, uint64_t thread_time_ns) {
+  std::string summary;
+  for (int phase = 0; phase < NUM_PROFILE_PHASES; phase++) {
+    Histogram merged;
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < num_profiles; i++) {
+      if (!profiles[i]) continue;
+      merged.Merge(profiles[i]->histograms[phase]);
+      total_ns += profiles[i]->total_ns[phase];
+    }
+    if (!merged.Count()) continue;
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), " %s %.1f%% %llu/%llu",
+             ProfilePhaseName(phase),
+             thread_time_ns ? 100.0 * total_ns / thread_time_ns : 0.0,
+             (unsigned long long)merged.Percentile(0.5),
+             (unsigned long long)merged.Percentile(0.99));
+    summary += buf;
+  }
+  if (summary.empty()) return;
+  printf("Profile (share of thread time, p50/p99 ns):%s\n", summary.c_str());
+}
+
+static void WritePhase(FILE *fp, const char *thread, int phase, Histogram &histogram, uint64_t total_ns) {
+  if (!histogram.Count()) return;
+  fprintf(fp, "%-8s %-16s %12llu %14.3f %12llu %12llu %12llu %12llu %12llu\n",
+          thread, ProfilePhaseName(phase),
+          (unsigned long long)histogram.Count(), total_ns / 1000000.0,
+          (unsigned long long)histogram.Percentile(0.5),
+          (unsigned long long)histogram.Percentile(0.9),
+          (unsigned long long)histogram.Percentile(0.99),
+          (unsigned long long)histogram.Percentile(0.999),
+          (unsigned long long)histogram.Max());
+}
+
+void WriteProfile(FILE *fp, ThreadProfile **profiles, size_t num_profiles) {
+  fprintf(fp, "# thread phase count total_ms p50_ns p90_ns p99_ns p999_ns max_ns\n");
+
+  for (int phase = 0; phase < NUM_PROFILE_PHASES; phase++) {
+    Histogram merged;
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < num_profiles; i++) {
+      if (!profiles[i]) continue;
+      merged.Merge(profiles[i]->histograms[phase]);
+      total_ns += profiles[i]->total_ns[phase];
+    }
+    WritePhase(fp, "all", phase, merged, total_ns);
+  }
+
+  for (size_t i = 0; i < num_profiles; i++) {
+    if (!profiles[i]) continue;
+    std::string thread = std::to_string(i + 1);
+    for (int phase = 0; phase < NUM_PROFILE_PHASES; phase++) {
+      WritePhase(fp, thread.c_str(), phase, profiles[i]->histograms[phase], profiles[i]->total_ns[phase]);
+    }
+  }
+}
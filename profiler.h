@@ -0,0 +1,85 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <atomic>
+#include <chrono>
+#include "histogram.h"
+
+// Wall time spent in each phase of the fuzzing loop, in nanoseconds.
+// Phases nest: calibration and trimming include the runs they make,
+// a run includes the target start.
+enum ProfilePhase {
+  PHASE_MUTATE,
+  PHASE_DELIVER,
+  // process start (and reaching the target function), if any
+  PHASE_TARGET_START,
+  // the rest of Instrumentation::Run
+  PHASE_RUN,
+  PHASE_COVERAGE,
+  PHASE_IGNORE_COVERAGE,
+  PHASE_CALIBRATE,
+  PHASE_TRIM,
+  PHASE_LOCK_WAIT,
+  NUM_PROFILE_PHASES
+};
+
+const char *ProfilePhaseName(int phase);
+
+inline uint64_t ProfileNow() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// per thread, a single writer like Histogram
+class ThreadProfile {
+public:
+  ThreadProfile();
+
+  void Add(int phase, uint64_t ns) {
+    histograms[phase].Add(ns);
+    total_ns[phase].store(total_ns[phase].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+  }
+
+  Histogram histograms[NUM_PROFILE_PHASES];
+  std::atomic<uint64_t> total_ns[NUM_PROFILE_PHASES];
+};
+
+// adds the time until it goes out of scope, does
+// nothing if profiling is off (profile is NULL)
+class ProfileScope {
+public:
+  ProfileScope(ThreadProfile *profile, ProfilePhase phase) : profile(profile), phase(phase) {
+    if (profile) start = ProfileNow();
+  }
+
+  ~ProfileScope() {
+    if (profile) profile->Add(phase, ProfileNow() - start);
+  }
+
+private:
+  ThreadProfile *profile;
+  ProfilePhase phase;
+  uint64_t start;
+};
+
+// merged over all profiles, share is relative to thread_time_ns
+void PrintProfileSummary(ThreadProfile **profiles, size_t num_profiles, uint64_t thread_time_ns);
+// every phase of every thread, and merged
+void WriteProfile(FILE *fp, ThreadProfile **profiles, size_t num_profiles);
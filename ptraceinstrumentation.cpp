@@ -0,0 +1,544 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(__linux__) && defined(__x86_64__)
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/personality.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+#include "common.h"
+#include "ptraceinstrumentation.h"
+#include "profiler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define INT3 0xCC
+#define PAGE_SIZE_BYTES 0x1000
+
+// only there to interrupt waitpid
+static void TimeoutHandler(int signal) { }
+
+static void InstallTimeoutHandler() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = TimeoutHandler;
+    sigemptyset(&sa.sa_mask);
+    // no SA_RESTART, waitpid has to fail with EINTR
+    sa.sa_flags = 0;
+    if (sigaction(PTRACE_TIMEOUT_SIGNAL, &sa, NULL)) FATAL("Error installing the timeout handler");
+  });
+}
+
+PtraceInstrumentation::PtraceInstrumentation() :
+  debug(false), code_start(0), code_end(0), input_fd(-1),
+  pid(0), mem_fd(-1), module_base(0), module_end(0), timer_thread(0),
+  crash_signal(0), crash_address(0), target_start_ns(0) { }
+
+PtraceInstrumentation::~PtraceInstrumentation() {
+  CleanTarget();
+  if (timer_thread) timer_delete(timer);
+  if (input_fd >= 0) close(input_fd);
+}
+
+void PtraceInstrumentation::Init(int argc, char **argv) {
+  char *target = GetTargetArgv(argc, argv)[0];
+
+  char *option = GetOption("-instrument_module", argc, argv);
+  if (option) {
+    module_name = option;
+  } else {
+    const char *name = strrchr(target, '/');
+    module_name = name ? name + 1 : target;
+  }
+
+  option = GetOption("-bb_file", argc, argv);
+  if (!option) FATAL("The ptrace instrumentation needs a basic block list (-bb_file)");
+  LoadBlocks(option);
+
+  debug = GetBinaryOption("-ptrace_debug", argc, argv, false);
+
+  InstallTimeoutHandler();
+}
+
+void PtraceInstrumentation::LoadBlocks(const char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) FATAL("Error opening %s", filename);
+
+  std::vector<uint64_t> offsets;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = 0;
+    char *end;
+    uint64_t offset = strtoull(line, &end, 16);
+    if (end == line) continue;
+    offsets.push_back(offset);
+  }
+  fclose(fp);
+
+  if (offsets.empty()) FATAL("No basic blocks in %s", filename);
+
+  std::sort(offsets.begin(), offsets.end());
+  code_start = offsets.front();
+  code_end = offsets.back() + 1;
+
+  block_state.resize(code_end - code_start, NOT_A_BLOCK);
+  for (auto offset : offsets) {
+    block_state[offset - code_start] = BLOCK_PLANTED;
+  }
+}
+
+void PtraceInstrumentation::SetInputFile(const std::string &filename) {
+  OpenInputFile(&input_fd, filename);
+}
+
+void PtraceInstrumentation::ArmTimer(uint32_t timeout) {
+  pid_t thread = (pid_t)syscall(SYS_gettid);
+  if (timer_thread != thread) {
+    if (timer_thread) timer_delete(timer);
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = PTRACE_TIMEOUT_SIGNAL;
+    sev.sigev_notify_thread_id = thread;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer)) FATAL("Error creating a timer");
+    timer_thread = thread;
+  }
+
+  // keeps firing after the deadline, so a signal that arrives
+  // just before waitpid blocks doesn't get lost
+  struct itimerspec spec;
+  spec.it_value.tv_sec = timeout / 1000;
+  spec.it_value.tv_nsec = (timeout % 1000) * 1000000;
+  if (!timeout) spec.it_value.tv_nsec = 1;
+  spec.it_interval.tv_sec = 0;
+  spec.it_interval.tv_nsec = PTRACE_TIMEOUT_INTERVAL_MS * 1000000;
+  timer_settime(timer, 0, &spec, NULL);
+}
+
+void PtraceInstrumentation::DisarmTimer() {
+  if (!timer_thread) return;
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  timer_settime(timer, 0, &spec, NULL);
+}
+
+// waits for any task of the target, returns false if the
+// deadline passed before one of them changed state
+bool PtraceInstrumentation::WaitForTarget(pid_t *tid, int *status, uint64_t deadline) {
+  while (true) {
+    // other fuzzing threads have targets of their own
+    pid_t ret = waitpid(-1, status, __WALL | __WNOTHREAD);
+    if (ret > 0) {
+      *tid = ret;
+      return true;
+    }
+    if ((ret < 0) && (errno == EINTR)) {
+      if (GetCurTime() >= deadline) return false;
+      continue;
+    }
+    FATAL("Error waiting for the target");
+  }
+}
+
+// forked processes may outlive the target process
+void PtraceInstrumentation::KillTarget() {
+  if ((pid <= 0) && tasks.empty()) return;
+  if (pid > 0) kill(pid, SIGKILL);
+  for (auto iter = tasks.begin(); iter != tasks.end(); iter++) {
+    kill(iter->first, SIGKILL);
+  }
+  // until no traced task is left
+  pid_t ret;
+  int status;
+  while (((ret = waitpid(-1, &status, __WALL | __WNOTHREAD)) > 0) || (errno == EINTR)) {
+    // created just before the kill, still in its initial stop
+    if ((ret > 0) && WIFSTOPPED(status)) kill(ret, SIGKILL);
+  }
+  for (auto iter = tasks.begin(); iter != tasks.end(); iter++) {
+    if (iter->second.mem_fd >= 0) close(iter->second.mem_fd);
+  }
+  tasks.clear();
+  pid = 0;
+}
+
+// the main thread uses mem_fd, the files of other tasks
+// are opened when they first hit a breakpoint
+int PtraceInstrumentation::GetMemFd(pid_t tid, TracedTask &task) {
+  if (tid == pid) return mem_fd;
+  if (task.mem_fd < 0) {
+    std::string path = std::string("/proc/") + std::to_string(tid) + "/mem";
+    task.mem_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (task.mem_fd < 0) FATAL("Error opening %s", path.c_str());
+  }
+  return task.mem_fd;
+}
+
+// the new task's first stop may be reported before this event
+void PtraceInstrumentation::OnNewTask(pid_t parent_tid, int event) {
+  unsigned long msg;
+  ptrace(PTRACE_GETEVENTMSG, parent_tid, NULL, &msg);
+  pid_t new_tid = (pid_t)msg;
+  TracedTask &parent = tasks[parent_tid];
+  TracedTask &task = tasks.emplace(new_tid, TracedTask()).first->second;
+  // forked processes start with a copy of the breakpoints
+  task.instrumented = parent.instrumented;
+  task.in_target_process = (event == PTRACE_EVENT_CLONE) && parent.in_target_process;
+}
+
+uint64_t PtraceInstrumentation::GetEntryPoint() {
+  std::string path = std::string("/proc/") + std::to_string(pid) + "/auxv";
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) FATAL("Error opening %s", path.c_str());
+  uint64_t entry = 0;
+  Elf64_auxv_t aux;
+  while (read(fd, &aux, sizeof(aux)) == sizeof(aux)) {
+    if (aux.a_type == AT_ENTRY) {
+      entry = aux.a_un.a_val;
+      break;
+    }
+  }
+  close(fd);
+  if (!entry) FATAL("Could not find the target's entry point");
+  return entry;
+}
+
+// from the lowest to the highest mapping of the module's file
+void PtraceInstrumentation::ReadModuleRange() {
+  std::string path = std::string("/proc/") + std::to_string(pid) + "/maps";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) FATAL("Error opening %s", path.c_str());
+  module_base = 0;
+  module_end = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), fp)) {
+    char *file = strchr(line, '/');
+    if (!file) continue;
+    file[strcspn(file, "\n")] = 0;
+    const char *name = strrchr(file, '/') + 1;
+    if (module_name != name) continue;
+    char *end;
+    uint64_t start = strtoull(line, &end, 16);
+    uint64_t stop = strtoull(end + 1, NULL, 16);
+    if (!module_base || (start < module_base)) module_base = start;
+    if (stop > module_end) module_end = stop;
+  }
+  fclose(fp);
+  if (!module_base) FATAL("Module %s is not loaded when the target reaches its entry point", module_name.c_str());
+}
+
+// starts the target and runs it up to its entry point,
+// at which point the module has to be loaded
+void PtraceInstrumentation::StartTarget(char **argv, uint64_t deadline) {
+  pid = fork();
+  if (pid < 0) FATAL("Error creating the target process");
+
+  if (!pid) {
+    int null_fd = open("/dev/null", O_RDWR);
+    if (!debug) {
+      dup2(null_fd, 1);
+      dup2(null_fd, 2);
+    }
+    dup2((input_fd >= 0) ? input_fd : null_fd, 0);
+    personality(ADDR_NO_RANDOMIZE);
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+
+  pid_t tid;
+  int status;
+  if (!WaitForTarget(&tid, &status, deadline) || (tid != pid) || !WIFSTOPPED(status)) {
+    FATAL("Error starting the target");
+  }
+  // the target shouldn't outlive the fuzzer, threads and
+  // processes it creates are traced as well
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(PTRACE_O_EXITKILL |
+    PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC));
+  TracedTask &main_task = tasks[pid];
+  main_task.started = true;
+
+  std::string path = std::string("/proc/") + std::to_string(pid) + "/mem";
+  mem_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (mem_fd < 0) FATAL("Error opening %s", path.c_str());
+
+  uint64_t entry = GetEntryPoint();
+  uint8_t entry_byte, int3 = INT3;
+  if ((pread(mem_fd, &entry_byte, 1, entry) != 1) ||
+      (pwrite(mem_fd, &int3, 1, entry) != 1)) {
+    FATAL("Error setting a breakpoint at the entry point");
+  }
+
+  int signal = 0;
+  while (true) {
+    ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)signal);
+    if (!WaitForTarget(&tid, &status, deadline)) FATAL("The target timed out before reaching its entry point");
+    if ((tid != pid) || !WIFSTOPPED(status)) FATAL("The target exited before reaching its entry point");
+    signal = WSTOPSIG(status);
+    if (signal != SIGTRAP) continue;
+    struct user_regs_struct regs;
+    ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+    if (regs.rip != entry + 1) continue;
+    regs.rip = entry;
+    ptrace(PTRACE_SETREGS, pid, NULL, &regs);
+    break;
+  }
+  pwrite(mem_fd, &entry_byte, 1, entry);
+
+  ReadModuleRange();
+}
+
+void PtraceInstrumentation::PlantBreakpoints() {
+  size_t size = code_end - code_start;
+
+  if (original_code.empty()) {
+    original_code.resize(size);
+    if (pread(mem_fd, original_code.data(), size, module_base + code_start) != (ssize_t)size) {
+      FATAL("Error reading the code of %s, is the block list right?", module_name.c_str());
+    }
+    patched_code = original_code;
+    page_breakpoints.resize((size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES, 0);
+    for (size_t i = 0; i < size; i++) {
+      if (block_state[i] != BLOCK_PLANTED) continue;
+      patched_code[i] = INT3;
+      page_breakpoints[i / PAGE_SIZE_BYTES]++;
+    }
+  }
+
+  // write runs of pages that still have breakpoints
+  size_t num_pages = page_breakpoints.size();
+  size_t page = 0;
+  while (page < num_pages) {
+    if (!page_breakpoints[page]) {
+      page++;
+      continue;
+    }
+    size_t first = page;
+    while ((page < num_pages) && page_breakpoints[page]) page++;
+    size_t start = first * PAGE_SIZE_BYTES;
+    size_t end = std::min(page * PAGE_SIZE_BYTES, size);
+    if (pwrite(mem_fd, patched_code.data() + start, end - start, module_base + code_start + start) != (ssize_t)(end - start)) {
+      FATAL("Error writing breakpoints");
+    }
+  }
+}
+
+// threads of the same process may hit a breakpoint before it is
+// removed, and forked processes have breakpoints of their own
+bool PtraceInstrumentation::OnBreakpoint(pid_t tid, TracedTask &task, uint64_t address) {
+  if (!task.instrumented) return false;
+  if ((address < module_base + code_start) || (address >= module_base + code_end)) return false;
+  uint64_t offset = address - module_base;
+  size_t index = offset - code_start;
+  if (block_state[index] != BLOCK_PLANTED) return false;
+
+  // only removed from this process, the fuzzer decides
+  // whether the block gets planted in the next one
+  if (pwrite(GetMemFd(tid, task), &original_code[index], 1, address) != 1) FATAL("Error removing a breakpoint");
+  hits.push_back(offset);
+  return true;
+}
+
+RunResult PtraceInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  CleanTarget();
+  hits.clear();
+  crash_signal = 0;
+  crash_address = 0;
+  if (input_fd >= 0) lseek(input_fd, 0, SEEK_SET);
+
+  uint64_t start_time = GetCurTime();
+  uint64_t start_ns = ProfileNow();
+  ArmTimer(init_timeout);
+  StartTarget(argv, start_time + init_timeout);
+  PlantBreakpoints();
+  target_start_ns = ProfileNow() - start_ns;
+
+  uint64_t deadline = GetCurTime() + timeout;
+  ArmTimer(timeout);
+
+  RunResult result = OK;
+  // the task to resume, 0 if the last one exited
+  pid_t tid = pid;
+  int signal = 0;
+  int status;
+  while (true) {
+    if (tid) ptrace(PTRACE_CONT, tid, NULL, (void *)(uintptr_t)signal);
+    signal = 0;
+
+    if (!WaitForTarget(&tid, &status, deadline)) {
+      result = HANG;
+      break;
+    }
+
+    // a thread or forked process that exits doesn't end the run
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (tid == pid) {
+        tasks.erase(tid);
+        pid = 0;
+        if (WIFSIGNALED(status)) {
+          crash_signal = WTERMSIG(status);
+          result = CRASH;
+        }
+        break;
+      }
+      auto iter = tasks.find(tid);
+      if (iter != tasks.end()) {
+        if (iter->second.mem_fd >= 0) close(iter->second.mem_fd);
+        tasks.erase(iter);
+      }
+      tid = 0;
+      continue;
+    }
+
+    if (!WIFSTOPPED(status)) continue;
+
+    TracedTask &task = tasks[tid];
+    int stop_signal = WSTOPSIG(status);
+
+    // new tasks start stopped
+    if (!task.started) {
+      task.started = true;
+      if (stop_signal == SIGSTOP) continue;
+    }
+
+    int event = status >> 16;
+    if (event) {
+      if ((event == PTRACE_EVENT_CLONE) || (event == PTRACE_EVENT_FORK) || (event == PTRACE_EVENT_VFORK)) {
+        OnNewTask(tid, event);
+      } else if (event == PTRACE_EVENT_EXEC) {
+        // a thread other than the leader that execs takes over its tid
+        unsigned long former_tid;
+        ptrace(PTRACE_GETEVENTMSG, tid, NULL, &former_tid);
+        if ((pid_t)former_tid != tid) {
+          auto iter = tasks.find((pid_t)former_tid);
+          if (iter != tasks.end()) {
+            if (iter->second.mem_fd >= 0) close(iter->second.mem_fd);
+            tasks.erase(iter);
+          }
+        }
+        TracedTask &exec_task = tasks[tid];
+        exec_task.started = true;
+        exec_task.instrumented = false;
+      }
+      continue;
+    }
+
+    struct user_regs_struct regs;
+    if (stop_signal == SIGTRAP) {
+      ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+      if (OnBreakpoint(tid, task, regs.rip - 1)) {
+        regs.rip--;
+        ptrace(PTRACE_SETREGS, tid, NULL, &regs);
+        continue;
+      }
+    }
+
+    // the target may handle the signal itself, it only
+    // counts as a crash if the target dies from it
+    if (task.in_target_process &&
+        ((stop_signal == SIGSEGV) || (stop_signal == SIGBUS) ||
+         (stop_signal == SIGILL) || (stop_signal == SIGFPE) ||
+         (stop_signal == SIGABRT))) {
+      ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+      crash_address = regs.rip;
+    }
+    signal = stop_signal;
+  }
+
+  DisarmTimer();
+  CleanTarget();
+  return result;
+}
+
+// every run uses a fresh process
+RunResult PtraceInstrumentation::RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
+  return Run(argc, argv, init_timeout, timeout);
+}
+
+void PtraceInstrumentation::CleanTarget() {
+  KillTarget();
+  if (mem_fd >= 0) close(mem_fd);
+  mem_fd = -1;
+}
+
+bool PtraceInstrumentation::HasNewCoverage() {
+  return !hits.empty();
+}
+
+void PtraceInstrumentation::GetCoverage(Coverage &coverage, bool clear_coverage) {
+  if (!hits.empty()) {
+    ModuleCoverage *module_coverage = GetModuleCoverage(coverage, module_name);
+    if (!module_coverage) {
+      coverage.push_back({ module_name, {} });
+      module_coverage = &coverage.back();
+    }
+    module_coverage->offsets.insert(hits.begin(), hits.end());
+  }
+
+  if (clear_coverage) ClearCoverage();
+}
+
+void PtraceInstrumentation::ClearCoverage() {
+  hits.clear();
+}
+
+// the breakpoints stop being planted in new processes
+void PtraceInstrumentation::IgnoreCoverage(Coverage &coverage) {
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->module_name != module_name) continue;
+    for (auto offset : iter->offsets) {
+      if ((offset < code_start) || (offset >= code_end)) continue;
+      size_t index = offset - code_start;
+      if (block_state[index] != BLOCK_PLANTED) continue;
+      block_state[index] = BLOCK_REMOVED;
+      // before the first run, the code isn't known yet
+      if (original_code.empty()) continue;
+      patched_code[index] = original_code[index];
+      page_breakpoints[index / PAGE_SIZE_BYTES]--;
+    }
+  }
+}
+
+std::string PtraceInstrumentation::GetCrashName() {
+  std::stringstream stream;
+  stream << GetSignalName(crash_signal) << "_";
+  if ((crash_address >= module_base) && (crash_address < module_end)) {
+    stream << module_name << "_" << std::hex << (crash_address - module_base);
+  } else {
+    // ASLR is off, so the address is stable for a given target
+    stream << std::hex << crash_address;
+  }
+  return stream.str();
+}
+
+#endif
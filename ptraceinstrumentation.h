@@ -0,0 +1,146 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#if defined(__linux__) && defined(__x86_64__)
+
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "instrumentation.h"
+
+// Collects basic block coverage from unmodified Linux binaries
+// with one-shot software breakpoints. The target is started under
+// ptrace for every run; when it reaches its entry point, an int3 is
+// written to the start of every block of the module that the fuzzer
+// hasn't seen yet. A block costs a trap the first time a run hits
+// it, and once the fuzzer ignores its offset the breakpoint is no
+// longer planted, so most runs in a long campaign execute natively.
+//
+// Blocks come from a precomputed list (-bb_file): one hex offset
+// per line, relative to the module's base address, '#' starts a
+// comment. The module (-instrument_module, the target binary by
+// default) has to be loaded by the time the target reaches its
+// entry point, i.e. the executable or one of its dependencies.
+// ASLR is disabled for the target so crash addresses stay stable.
+//
+// Threads and processes the target creates are traced too, so their
+// breakpoints count as coverage. Forked processes start with their
+// own copy of the breakpoints, and stop being instrumented once they
+// exec. Only the death of the target process itself is a crash.
+#define PTRACE_TIMEOUT_SIGNAL SIGUSR1
+// interval at which the timeout signal repeats after the deadline
+#define PTRACE_TIMEOUT_INTERVAL_MS 10
+
+class PtraceInstrumentation : public Instrumentation {
+public:
+  PtraceInstrumentation();
+  ~PtraceInstrumentation();
+
+  void Init(int argc, char **argv) override;
+
+  RunResult Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+  RunResult RunWithCrashAnalysis(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) override;
+
+  void CleanTarget() override;
+
+  bool HasNewCoverage() override;
+  void GetCoverage(Coverage &coverage, bool clear_coverage) override;
+  void ClearCoverage() override;
+  void IgnoreCoverage(Coverage &coverage) override;
+
+  std::string GetCrashName() override;
+
+  uint64_t GetTargetStartTime() override { return target_start_ns; }
+
+  void SetInputFile(const std::string &filename) override;
+
+protected:
+  // per-byte state of the code region
+  enum BlockState : uint8_t {
+    NOT_A_BLOCK,
+    BLOCK_PLANTED,
+    BLOCK_REMOVED,
+  };
+
+  // a thread of the target, or of a process it forked
+  struct TracedTask {
+    TracedTask() : mem_fd(-1), in_target_process(true), instrumented(true), started(false) { }
+
+    int mem_fd;
+    // false for forked processes
+    bool in_target_process;
+    // false once the task exec'd, its traps aren't breakpoints
+    bool instrumented;
+    // the initial SIGSTOP of new tasks isn't delivered
+    bool started;
+  };
+
+  void LoadBlocks(const char *filename);
+  void StartTarget(char **argv, uint64_t deadline);
+  void PlantBreakpoints();
+  bool OnBreakpoint(pid_t tid, TracedTask &task, uint64_t address);
+  bool WaitForTarget(pid_t *tid, int *status, uint64_t deadline);
+  int GetMemFd(pid_t tid, TracedTask &task);
+  void OnNewTask(pid_t parent_tid, int event);
+  void ArmTimer(uint32_t timeout);
+  void DisarmTimer();
+  void KillTarget();
+  void ReadModuleRange();
+  uint64_t GetEntryPoint();
+
+  std::string module_name;
+  bool debug;
+
+  // offsets are relative to the module, the code region
+  // spans from the first to the last block
+  uint64_t code_start;
+  uint64_t code_end;
+  std::vector<BlockState> block_state;
+  // read from the first target process
+  std::vector<uint8_t> original_code;
+  // original code with an int3 at every planted block
+  std::vector<uint8_t> patched_code;
+  // pages without breakpoints don't have to be written
+  std::vector<uint32_t> page_breakpoints;
+
+  std::vector<uint64_t> hits;
+
+  int input_fd;
+  pid_t pid;
+  // of the target process
+  int mem_fd;
+  // every traced task, including pid
+  std::unordered_map<pid_t, TracedTask> tasks;
+  uint64_t module_base;
+  // end of the module's highest mapping
+  uint64_t module_end;
+
+  // created on the thread that runs the target
+  timer_t timer;
+  pid_t timer_thread;
+
+  int crash_signal;
+  uint64_t crash_address;
+
+  uint64_t target_start_ns;
+};
+
+#endif
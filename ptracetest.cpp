@@ -0,0 +1,164 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Checks the ptrace instrumentation: coverage of a trivial target,
+// ignored coverage, and crashes and hangs being detected. The test
+// is its own target (with -target), the basic block list holds the
+// entry points of the first two functions below, so the crash is
+// (most likely) past the last block of the module.
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "ptraceinstrumentation.h"
+
+#define TEST_TIMEOUT 1000
+#define TEST_HANG_TIMEOUT 200
+
+// the target, not inlined so that every function is a block
+extern "C" __attribute__((noinline)) void TargetEntry(volatile int *state) {
+  *state += 1;
+}
+
+extern "C" __attribute__((noinline)) void TargetCoverA(volatile int *state) {
+  *state += 2;
+}
+
+extern "C" __attribute__((noinline)) void TargetCrash(volatile int *state) {
+  *state += 3;
+  *(volatile int *)NULL = 0;
+}
+
+extern "C" __attribute__((noinline)) void TargetHang(volatile int *state) {
+  while (1) {
+    *state += 4;
+    usleep(1000);
+  }
+}
+
+static int RunTarget() {
+  volatile int state = 0;
+  char input = 0;
+  if (read(0, &input, 1) < 0) return 1;
+  TargetEntry(&state);
+  if (input == 'A') TargetCoverA(&state);
+  if (input == 'C') TargetCrash(&state);
+  if (input == 'H') TargetHang(&state);
+  return 0;
+}
+
+static std::string input_file;
+static char *target_argv[3];
+
+static void WriteFile(const std::string &filename, const std::string &data) {
+  FILE *fp = fopen(filename.c_str(), "wb");
+  if (!fp) FATAL("Error opening %s", filename.c_str());
+  fwrite(data.data(), 1, data.size(), fp);
+  fclose(fp);
+}
+
+static std::string CreateTempFile() {
+  char name_template[] = "/tmp/ptracetest_XXXXXX";
+  int fd = mkstemp(name_template);
+  if (fd < 0) FATAL("Error creating a temporary file");
+  close(fd);
+  return name_template;
+}
+
+static RunResult RunSample(PtraceInstrumentation *instrumentation, const char *input, uint32_t timeout) {
+  WriteFile(input_file, input);
+  return instrumentation->Run(2, target_argv, TEST_TIMEOUT, timeout);
+}
+
+static size_t RunAndCount(PtraceInstrumentation *instrumentation, const char *input) {
+  if (RunSample(instrumentation, input, TEST_TIMEOUT) != OK) {
+    FATAL("Unexpected run result");
+  }
+  Coverage coverage;
+  instrumentation->GetCoverage(coverage, true);
+  size_t num_offsets = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    num_offsets += iter->offsets.size();
+  }
+  return num_offsets;
+}
+
+int main(int argc, char **argv) {
+  if ((argc > 1) && !strcmp(argv[1], "-target")) return RunTarget();
+
+  char path[PATH_MAX];
+  ssize_t path_len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (path_len <= 0) FATAL("Error getting the test's path");
+  path[path_len] = 0;
+  target_argv[0] = path;
+  target_argv[1] = (char *)"-target";
+  target_argv[2] = NULL;
+
+  // offsets relative to the lowest mapping of the executable
+  Dl_info info;
+  if (!dladdr((void *)&TargetEntry, &info)) FATAL("Error finding the test's base address");
+  uintptr_t base = (uintptr_t)info.dli_fbase;
+  std::string blocks;
+  void *functions[] = { (void *)&TargetEntry, (void *)&TargetCoverA };
+  for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+    char line[32];
+    snprintf(line, sizeof(line), "%" PRIxPTR "\n", (uintptr_t)functions[i] - base);
+    blocks += line;
+  }
+  std::string bb_file = CreateTempFile();
+  WriteFile(bb_file, blocks);
+  input_file = CreateTempFile();
+
+  char *instrumentation_argv[] = { argv[0], (char *)"-bb_file", (char *)bb_file.c_str(), (char *)"--", path, NULL };
+  PtraceInstrumentation *instrumentation = new PtraceInstrumentation();
+  instrumentation->Init(5, instrumentation_argv);
+  instrumentation->SetInputFile(input_file);
+
+  if (RunAndCount(instrumentation, "A") != 2) FATAL("Missed coverage");
+
+  Coverage coverage;
+  RunSample(instrumentation, "A", TEST_TIMEOUT);
+  instrumentation->GetCoverage(coverage, true);
+  instrumentation->IgnoreCoverage(coverage);
+  if (RunAndCount(instrumentation, "A") != 0) FATAL("Ignored coverage reported");
+
+  if (RunSample(instrumentation, "C", TEST_TIMEOUT) != CRASH) FATAL("Crash not detected");
+  // named after the module and the offset of the crashing instruction
+  std::string crash_name = instrumentation->GetCrashName();
+  const char *name = strrchr(path, '/') + 1;
+  std::string expected_prefix = std::string("access_violation_") + name + "_";
+  if (crash_name.compare(0, expected_prefix.size(), expected_prefix)) {
+    FATAL("Unexpected crash name %s", crash_name.c_str());
+  }
+  instrumentation->ClearCoverage();
+
+  if (RunSample(instrumentation, "H", TEST_HANG_TIMEOUT) != HANG) FATAL("Hang not detected");
+  instrumentation->ClearCoverage();
+
+  if (RunAndCount(instrumentation, "A") != 0) FATAL("Ignored coverage reported after a crash");
+
+  delete instrumentation;
+  unlink(bb_file.c_str());
+  unlink(input_file.c_str());
+
+  printf("OK\n");
+  return 0;
+}
@@ -24,6 +24,7 @@ limitations under the License.
 
 Sample::Sample() {
   size = 0;
+  capacity = 0;
   bytes = NULL;
 }
 
@@ -33,18 +34,51 @@ Sample::~Sample() {
 
 Sample::Sample(const Sample &in) {
   size = in.size;
+  capacity = size;
   bytes = (char *)malloc(size);
   memcpy(bytes,in.bytes,size);
 }
 
 Sample& Sample::operator= (const Sample &in) {
-  if(bytes) free(bytes);
+  if(this == &in) return *this;
+  Reserve(in.size);
   size = in.size;
-  bytes = (char *)malloc(size);
   memcpy(bytes,in.bytes,size);
   return *this;
 }
 
+void Sample::Reserve(size_t new_capacity) {
+  if(bytes && (new_capacity <= capacity)) return;
+  if(bytes) free(bytes);
+  capacity = new_capacity;
+  bytes = (char *)malloc(capacity);
+}
+
+void Sample::Resize(size_t new_size) {
+  if(new_size > capacity) {
+    size_t new_capacity = capacity * 2;
+    if(new_capacity > MAX_SAMPLE_SIZE) new_capacity = MAX_SAMPLE_SIZE;
+    if(new_capacity < new_size) new_capacity = new_size;
+    bytes = (char *)realloc(bytes, new_capacity);
+    capacity = new_capacity;
+  }
+  size = new_size;
+}
+
+void Sample::Insert(size_t pos, size_t count) {
+  if(pos > size) return;
+  size_t old_size = size;
+  Resize(size + count);
+  memmove(bytes + pos + count, bytes + pos, old_size - pos);
+}
+
+void Sample::Remove(size_t pos, size_t count) {
+  if(pos > size) return;
+  if(count > size - pos) count = size - pos;
+  memmove(bytes + pos, bytes + pos + count, size - pos - count);
+  size -= count;
+}
+
 int Sample::Save(const char * filename) {
   FILE *fp;
   fp = fopen(filename,"wb");
@@ -67,31 +101,38 @@ int Sample::Load(const char * filename) {
     return 0;
   }
   fseek(fp,0,SEEK_END);
-  size = ftell(fp);
+  size_t file_size = ftell(fp);
   fseek(fp,0,SEEK_SET);
-  if(bytes) free(bytes);
-  bytes = (char *)malloc(size);
+  Reserve(file_size);
+  size = file_size;
   fread(bytes, size, 1, fp);
   fclose(fp);
   return 1;
 }
 
 void Sample::Init(const char *data, size_t size) {
-  if(bytes) free(bytes);
+  Reserve(size);
   this->size = size;
-  bytes = (char *)malloc(size);
   memcpy(bytes,data,size);
 }
 
 void Sample::Append(char *data, size_t size) {
   size_t oldsize = this->size;
-  this->size += size;
-  bytes = (char *)realloc(bytes,this->size);
+  Resize(oldsize + size);
   memcpy(bytes+oldsize,data,size);
 }
 
 void Sample::Trim(size_t new_size) {
   if ((new_size < 0) || (new_size > this->size)) return;
+  // keep the buffer, it is likely to grow again
   this->size = new_size;
-  bytes = (char *)realloc(bytes, this->size);
+}
+
+uint64_t Sample::Hash() {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char)bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
 }
@@ -17,6 +17,7 @@ limitations under the License.
 #pragma once
 
 #include <stdio.h>
+#include <inttypes.h>
 
 #define MAX_SAMPLE_SIZE 1000000
 
@@ -24,6 +25,9 @@ class Sample {
 public:
   char *bytes;
   size_t size;
+  // size of the allocated buffer, >= size.
+  // Code that replaces bytes must update it.
+  size_t capacity;
 
   Sample();
   ~Sample();
@@ -38,7 +42,26 @@ public:
 
   void Init(const char *data, size_t size);
 
+  // makes sure the buffer can hold new_capacity bytes,
+  // contents are not preserved when it has to grow
+  void Reserve(size_t new_capacity);
+
+  // changes the size, preserving the contents. When the buffer
+  // has to grow it at least doubles (up to MAX_SAMPLE_SIZE),
+  // new bytes are uninitialized.
+  void Resize(size_t new_size);
+
+  // moves the bytes from pos on count bytes forward,
+  // the count bytes at pos are uninitialized
+  void Insert(size_t pos, size_t count);
+
+  // removes count bytes at pos
+  void Remove(size_t pos, size_t count);
+
   void Append(char *data, size_t size);
 
   void Trim(size_t new_size);
+
+  // FNV-1a hash of the contents
+  uint64_t Hash();
 };
@@ -0,0 +1,137 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include "mutex.h"
+
+// A priority queue split into one shard per fuzzing thread.
+// Threads push to and pop from their own shard and only touch
+// other shards when their own one runs dry (work stealing).
+// Entries are ordered by Compare within each shard.
+// Consumers that find no work can block in WaitForChange()
+// until an entry is pushed or Notify() is called.
+template<class T, class Compare>
+class ShardedQueue {
+public:
+  ShardedQueue() : shards(NULL), num_shards(0),
+    num_entries(0), num_steals(0), version(0), num_waiters(0) { }
+
+  ~ShardedQueue() {
+    if (shards) delete [] shards;
+  }
+
+  void Init(size_t num_shards) {
+    if (shards) delete [] shards;
+    if (num_shards == 0) num_shards = 1;
+    this->num_shards = num_shards;
+    shards = new Shard[num_shards];
+  }
+
+  void Push(size_t shard_index, T entry) {
+    Shard *shard = &shards[shard_index % num_shards];
+    shard->mutex.Lock();
+    shard->queue.push(entry);
+    shard->size = shard->queue.size();
+    shard->mutex.Unlock();
+    num_entries++;
+    Notify();
+  }
+
+  // pops the top entry from the thread's own shard or,
+  // if that one is empty, steals the top entry of another shard
+  bool Pop(size_t shard_index, T *entry) {
+    shard_index = shard_index % num_shards;
+    if (PopFromShard(&shards[shard_index], entry)) return true;
+    for (size_t i = 1; i < num_shards; i++) {
+      if (PopFromShard(&shards[(shard_index + i) % num_shards], entry)) {
+        num_steals++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t Size() { return num_entries; }
+  bool Empty() { return num_entries == 0; }
+  uint64_t NumSteals() { return num_steals; }
+
+  // returns a version number that changes whenever
+  // new work might have become available
+  uint64_t GetVersion() { return version; }
+
+  // wakes up all consumers blocked in WaitForChange
+  void Notify() {
+    version++;
+    if (num_waiters == 0) return;
+    wait_mutex.Lock();
+    wait_cv.Broadcast();
+    wait_mutex.Unlock();
+  }
+
+  // blocks until the version differs from last_version
+  // or timeout_ms elapses
+  void WaitForChange(uint64_t last_version, uint32_t timeout_ms) {
+    wait_mutex.Lock();
+    num_waiters++;
+    if (version == last_version) {
+      wait_cv.Wait(&wait_mutex, timeout_ms);
+    }
+    num_waiters--;
+    wait_mutex.Unlock();
+  }
+
+protected:
+  // keep each shard on its own cache line(s)
+  struct alignas(64) Shard {
+    Shard() : size(0) { }
+    Mutex mutex;
+    std::priority_queue<T, std::vector<T>, Compare> queue;
+    // readable without the lock to skip empty shards quickly
+    std::atomic<size_t> size;
+  };
+
+  bool PopFromShard(Shard *shard, T *entry) {
+    if (shard->size == 0) return false;
+    shard->mutex.Lock();
+    if (shard->queue.empty()) {
+      shard->mutex.Unlock();
+      return false;
+    }
+    *entry = shard->queue.top();
+    shard->queue.pop();
+    shard->size = shard->queue.size();
+    shard->mutex.Unlock();
+    num_entries--;
+    return true;
+  }
+
+  Shard *shards;
+  size_t num_shards;
+
+  std::atomic<size_t> num_entries;
+  std::atomic<uint64_t> num_steals;
+
+  // wakeup of idle consumers
+  std::atomic<uint64_t> version;
+  std::atomic<int> num_waiters;
+  Mutex wait_mutex;
+  ConditionVariable wait_cv;
+};
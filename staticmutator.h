@@ -0,0 +1,311 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <initializer_list>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "prng.h"
+#include "mutator.h"
+#include "mutatorops.h"
+
+// Mutation strategies composed at compile time. The combinators
+// below mirror NRoundMutator, RepeatMutator, PSelectMutator and
+// MutatorSequence, but hold their children by value and are
+// templates over the generator, so a whole pipeline such as
+//
+//   StaticNRound<StaticRepeat<StaticPSelect<ByteFlipOp, AppendOp>>>
+//
+// compiles to a single function without virtual calls. Children
+// are the operators from mutatorops.h or other combinators. Use
+// StaticMutator to plug a pipeline into the fuzzer. Unlike the
+// Mutator tree, pipelines don't support sample contexts.
+
+// xoshiro128**, final so that Rand() calls through
+// a FastPRNG (rather than a PRNG) can be inlined
+class FastPRNG final : public PRNG {
+public:
+  FastPRNG(uint64_t seed = 0) {
+    Seed(seed);
+  }
+
+  // splitmix64, so that any seed (including 0) gives a good state
+  void Seed(uint64_t seed) {
+    for (int i = 0; i < 4; i += 2) {
+      uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      z = z ^ (z >> 31);
+      s[i] = (uint32_t)z;
+      s[i + 1] = (uint32_t)(z >> 32);
+    }
+  }
+
+  uint32_t Rand() override {
+    uint32_t result = Rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = Rotl(s[3], 11);
+    return result;
+  }
+
+private:
+  static uint32_t Rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+
+  uint32_t s[4];
+};
+
+// calls f on the element of t at a runtime index,
+// unrolled into a chain of comparisons
+template<size_t I = 0, class Tuple, class F>
+inline auto StaticVisit(Tuple &t, size_t index, F &&f) -> decltype(f(std::get<0>(t))) {
+  if constexpr (I + 1 < std::tuple_size<Tuple>::value) {
+    if (index != I) return StaticVisit<I + 1>(t, index, f);
+  }
+  return f(std::get<I>(t));
+}
+
+template<class Tuple, class F>
+inline void StaticForEach(Tuple &t, F &&f) {
+  std::apply([&](auto &... child) { (f(child), ...); }, t);
+}
+
+// runs the child for num_rounds rounds, see NRoundMutator
+template<class Child>
+class StaticNRound {
+public:
+  StaticNRound(Child child, size_t num_rounds) :
+    child(std::move(child)), num_rounds(num_rounds), round_limit(num_rounds), current_round(0)
+    { }
+
+  void InitRound(Sample *input_sample) {
+    child.InitRound(input_sample);
+    current_round = 0;
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    if (current_round >= round_limit) return false;
+    child.Mutate(inout_sample, prng, all_samples);
+    current_round++;
+    return true;
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) {
+    child.NotifyResult(result, has_new_coverage);
+  }
+
+  void SetEnergy(double energy) {
+    round_limit = (size_t)(num_rounds * energy);
+    if (round_limit < 1) round_limit = 1;
+  }
+
+protected:
+  Child child;
+  size_t num_rounds;
+  size_t round_limit;
+  size_t current_round;
+};
+
+// runs the child once, then again with probability repeat_p,
+// see RepeatMutator
+template<class Child>
+class StaticRepeat {
+public:
+  StaticRepeat(Child child, double repeat_p) :
+    child(std::move(child)), repeat_p(repeat_p)
+    { }
+
+  void InitRound(Sample *input_sample) {
+    child.InitRound(input_sample);
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    bool ret = child.Mutate(inout_sample, prng, all_samples);
+    if (!ret) return false;
+    while (RandReal(prng) < repeat_p) {
+      child.Mutate(inout_sample, prng, all_samples);
+    }
+    return true;
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) {
+    child.NotifyResult(result, has_new_coverage);
+  }
+
+  void SetEnergy(double energy) {
+    child.SetEnergy(energy);
+  }
+
+protected:
+  Child child;
+  double repeat_p;
+};
+
+// picks a child with probability proportional to its weight,
+// one weight per child, see PSelectMutator
+template<class... Children>
+class StaticPSelect {
+public:
+  static constexpr size_t num_children = sizeof...(Children);
+
+  StaticPSelect(std::initializer_list<double> weights, Children... children) :
+    children(std::move(children)...), psum(0), last_child_index(0)
+  {
+    if (weights.size() != num_children) {
+      FATAL("StaticPSelect needs one weight per child");
+    }
+    size_t i = 0;
+    for (double p : weights) {
+      this->weights[i++] = p;
+      psum += p;
+    }
+  }
+
+  void InitRound(Sample *input_sample) {
+    StaticForEach(children, [&](auto &child) { child.InitRound(input_sample); });
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    double p = RandReal(prng) * psum;
+    double sum = 0;
+    size_t i;
+    for (i = 0; i < num_children - 1; i++) {
+      sum += weights[i];
+      if (p < sum) break;
+    }
+    last_child_index = i;
+    return StaticVisit(children, i, [&](auto &child) {
+      return child.Mutate(inout_sample, prng, all_samples);
+    });
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) {
+    StaticVisit(children, last_child_index, [&](auto &child) {
+      child.NotifyResult(result, has_new_coverage);
+    });
+  }
+
+  void SetEnergy(double energy) {
+    StaticForEach(children, [&](auto &child) { child.SetEnergy(energy); });
+  }
+
+protected:
+  std::tuple<Children...> children;
+  double weights[num_children];
+  double psum;
+  size_t last_child_index;
+};
+
+// runs each child until it returns false, then moves
+// on to the next one, see MutatorSequence
+template<class... Children>
+class StaticSequence {
+public:
+  static constexpr size_t num_children = sizeof...(Children);
+
+  StaticSequence(Children... children) :
+    children(std::move(children)...), current_child_index(0)
+    { }
+
+  void InitRound(Sample *input_sample) {
+    StaticForEach(children, [&](auto &child) { child.InitRound(input_sample); });
+    current_child_index = 0;
+  }
+
+  template<class Rng>
+  bool Mutate(Sample *inout_sample, Rng &prng, std::vector<Sample *> &all_samples) {
+    while (current_child_index < num_children) {
+      bool ret = StaticVisit(children, current_child_index, [&](auto &child) {
+        return child.Mutate(inout_sample, prng, all_samples);
+      });
+      if (ret) return true;
+      current_child_index++;
+    }
+    return false;
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) {
+    if (current_child_index >= num_children) return;
+    StaticVisit(children, current_child_index, [&](auto &child) {
+      child.NotifyResult(result, has_new_coverage);
+    });
+  }
+
+  void SetEnergy(double energy) {
+    StaticForEach(children, [&](auto &child) { child.SetEnergy(energy); });
+  }
+
+protected:
+  std::tuple<Children...> children;
+  size_t current_child_index;
+};
+
+// Runs a pipeline as a Mutator, with a single virtual call per
+// Mutate(). With the default Rng, the pipeline gets its own FastPRNG,
+// seeded from the fuzzer's PRNG on first use so runs with a fixed
+// seed stay repeatable. With Rng = PRNG, it uses the fuzzer's PRNG
+// directly (every random number is then a virtual call again).
+template<class Pipeline, class Rng = FastPRNG>
+class StaticMutator : public Mutator {
+public:
+  StaticMutator(Pipeline pipeline) : pipeline(std::move(pipeline)), seeded(false) { }
+
+  void InitRound(Sample *input_sample, MutatorSampleContext *context) override {
+    pipeline.InitRound(input_sample);
+  }
+
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    if constexpr (std::is_same<Rng, PRNG>::value) {
+      return pipeline.Mutate(inout_sample, *prng, all_samples);
+    } else {
+      if (!seeded) {
+        uint64_t seed = prng->Rand();
+        rng.Seed((seed << 32) | prng->Rand());
+        seeded = true;
+      }
+      return pipeline.Mutate(inout_sample, rng, all_samples);
+    }
+  }
+
+  void NotifyResult(RunResult result, bool has_new_coverage) override {
+    pipeline.NotifyResult(result, has_new_coverage);
+  }
+
+  void SetEnergy(double energy) override {
+    pipeline.SetEnergy(energy);
+  }
+
+protected:
+  Pipeline pipeline;
+  // unused with Rng = PRNG
+  typename std::conditional<std::is_same<Rng, PRNG>::value, FastPRNG, Rng>::type rng;
+  bool seeded;
+};
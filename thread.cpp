@@ -24,12 +24,130 @@ void CreateThread(void *(*start_routine) (void *), void *arg) {
   CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)start_routine, arg, 0, NULL);
 }
 
+// processor groups are not supported, only the first 64 cpus are used
+std::vector<int> GetThreadAffinity() {
+  std::vector<int> cpus;
+  DWORD_PTR process_mask, system_mask;
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) return cpus;
+  // there is no GetThreadAffinityMask, setting it returns the previous one
+  DWORD_PTR thread_mask = SetThreadAffinityMask(GetCurrentThread(), process_mask);
+  if (thread_mask) SetThreadAffinityMask(GetCurrentThread(), thread_mask);
+  else thread_mask = process_mask;
+  for (int i = 0; i < (int)(sizeof(DWORD_PTR) * 8); i++) {
+    if (thread_mask & ((DWORD_PTR)1 << i)) cpus.push_back(i);
+  }
+  return cpus;
+}
+
+bool SetThreadAffinity(const std::vector<int> &cpus) {
+  DWORD_PTR mask = 0;
+  for (auto cpu : cpus) {
+    if (cpu < (int)(sizeof(DWORD_PTR) * 8)) mask |= ((DWORD_PTR)1 << cpu);
+  }
+  if (!mask) return false;
+  return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+bool ThreadAffinitySupported() {
+  return true;
+}
+
+std::vector<double> GetCpuLoad(uint32_t interval_ms) {
+  return std::vector<double>();
+}
+
 #else
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 void CreateThread(void *(*start_routine) (void *), void *arg) {
   pthread_t thread_id;
   pthread_create(&thread_id, NULL, start_routine, arg);
 }
 
+std::vector<int> GetThreadAffinity() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) return cpus;
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &set)) cpus.push_back(i);
+  }
+#else
+  // no affinity API (macOS), all online cpus
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < num_cpus; i++) cpus.push_back(i);
+#endif
+  return cpus;
+}
+
+bool SetThreadAffinity(const std::vector<int> &cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  if (!CPU_COUNT(&set)) return false;
+  // 0 is the calling thread
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+bool ThreadAffinitySupported() {
+#if defined(__linux__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+#if defined(__linux__)
+// busy and total jiffies of each cpu from /proc/stat
+static bool ReadCpuTimes(std::vector<uint64_t> &busy, std::vector<uint64_t> &total) {
+  FILE *fp = fopen("/proc/stat", "r");
+  if (!fp) return false;
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    int cpu;
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+    // skips the aggregate "cpu " line
+    if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu,
+               &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) != 9) continue;
+    if (cpu < 0) continue;
+    if ((size_t)cpu >= busy.size()) {
+      busy.resize(cpu + 1);
+      total.resize(cpu + 1);
+    }
+    busy[cpu] = user + nice + system + irq + softirq + steal;
+    total[cpu] = busy[cpu] + idle + iowait;
+  }
+  fclose(fp);
+  return true;
+}
+#endif
+
+std::vector<double> GetCpuLoad(uint32_t interval_ms) {
+  std::vector<double> load;
+#if defined(__linux__)
+  std::vector<uint64_t> busy_before, total_before, busy_after, total_after;
+  if (!ReadCpuTimes(busy_before, total_before)) return load;
+  usleep(interval_ms * 1000);
+  if (!ReadCpuTimes(busy_after, total_after)) return load;
+  load.resize(busy_after.size());
+  for (size_t i = 0; i < busy_after.size(); i++) {
+    if (i >= busy_before.size()) continue;
+    uint64_t total = total_after[i] - total_before[i];
+    if (total) load[i] = (double)(busy_after[i] - busy_before[i]) / total;
+  }
+#endif
+  return load;
+}
+
 #endif
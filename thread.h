@@ -16,4 +16,21 @@ limitations under the License.
 
 #pragma once
 
+#include <inttypes.h>
+#include <vector>
+
 void CreateThread(void *(*start_routine) (void *), void *arg);
+
+// cpus the calling thread may run on
+std::vector<int> GetThreadAffinity();
+
+// restricts the calling thread to the given cpus. Threads it
+// creates inherit this, as do processes it starts on Linux.
+bool SetThreadAffinity(const std::vector<int> &cpus);
+
+// false if threads can't be pinned at all (macOS)
+bool ThreadAffinitySupported();
+
+// share of time (0 to 1) each cpu was busy over the interval,
+// indexed by cpu number, empty if not available
+std::vector<double> GetCpuLoad(uint32_t interval_ms);